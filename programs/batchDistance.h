@@ -0,0 +1,274 @@
+#ifndef BATCH_DISTANCE_H
+#define BATCH_DISTANCE_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+#include "distance.h"
+#include "matrix.h"
+
+/**
+ * Engine that finds, for many sample blocks at once, the squared distance to the closest block
+ * of a codebook. It expands ‖x - c‖² = ‖x‖² + ‖c‖² - 2<x, c>, so all the inner products are one
+ * matrix product, computed tile by tile: a tile of codebook blocks and values is packed in a
+ * buffer that stays in cache, and a micro-kernel computes 4 sample blocks by 2 codebook blocks
+ * with the partial sums held in registers.
+ *
+ * The inner products are exact integers. Every sample value is split as x = 256 * high + low,
+ * with high in [-128, 127] and low in [0, 255], so a pair of products of a half with a codebook
+ * value is below 2^24 in magnitude and the 32-bit sums of a tile of TILE_VALUES values cannot
+ * overflow. The sums of the tiles are added in 64 bits.
+ */
+class BatchDistance {
+    private:
+        /*
+         * Values and codebook blocks of a packed tile (1024 x 64 int16, 128 KB, fits in L2).
+         * With 1024 values, a 32-bit lane adds at most 64 pairs of products.
+         * The values are the outer loop, so the sample blocks are read once per codebook.
+         */
+        static constexpr size_t TILE_VALUES = 1024;
+        static constexpr size_t TILE_BLOCKS = 64;
+
+        static constexpr size_t QUERY_STEP = 4;
+        static constexpr size_t CODEBOOK_STEP = 2;
+
+        /*
+         * The packed rows are padded with zeros to a multiple of this many values.
+         */
+        static constexpr size_t VALUE_STEP = 32;
+
+        typedef void (*MicroKernelFn)(const short* high, const short* low, size_t queryStride, const short* codebook, size_t codebookStride, size_t n, int64_t* dots, size_t dotsStride);
+
+        Matrix<short> high, low;
+        std::vector<uint64_t> energies;
+        MicroKernelFn microKernel;
+
+        /*
+         * Reference micro-kernel: dots[q][c] += <queries[q], codebook[c]> for 4 x 2 blocks.
+         */
+        static void microKernelScalar(const short* high, const short* low, size_t queryStride, const short* codebook, size_t codebookStride, size_t n, int64_t* dots, size_t dotsStride) {
+            for (size_t q = 0; q < QUERY_STEP; q++)
+                for (size_t c = 0; c < CODEBOOK_STEP; c++)
+                    dots[q * dotsStride + c] += dot(high + q * queryStride, low + q * queryStride, codebook + c * codebookStride, n);
+        }
+
+#ifdef DISTANCE_X86
+        __attribute__((target("avx2")))
+        static int64_t reduceAvx2(__m256i sums) {
+            __m256i wide = _mm256_add_epi64(_mm256_cvtepi32_epi64(_mm256_castsi256_si128(sums)), _mm256_cvtepi32_epi64(_mm256_extracti128_si256(sums, 1)));
+            __m128i half = _mm_add_epi64(_mm256_castsi256_si128(wide), _mm256_extracti128_si256(wide, 1));
+
+            return _mm_cvtsi128_si64(half) + _mm_extract_epi64(half, 1);
+        }
+
+        /*
+         * One pass per half, each with 8 sums of 8 lanes, to stay within the 16 registers.
+         */
+        __attribute__((target("avx2")))
+        static void microKernelAvx2(const short* high, const short* low, size_t queryStride, const short* codebook, size_t codebookStride, size_t n, int64_t* dots, size_t dotsStride) {
+            const short* halves[2] = {high, low};
+            const int64_t scales[2] = {256, 1};
+
+            for (size_t half = 0; half < 2; half++) {
+                __m256i acc[QUERY_STEP][CODEBOOK_STEP];
+                for (size_t q = 0; q < QUERY_STEP; q++)
+                    for (size_t c = 0; c < CODEBOOK_STEP; c++)
+                        acc[q][c] = _mm256_setzero_si256();
+
+                for (size_t i = 0; i < n; i += 16) {
+                    __m256i y0 = _mm256_load_si256((const __m256i*) (codebook + i));
+                    __m256i y1 = _mm256_load_si256((const __m256i*) (codebook + codebookStride + i));
+
+                    for (size_t q = 0; q < QUERY_STEP; q++) {
+                        __m256i x = _mm256_load_si256((const __m256i*) (halves[half] + q * queryStride + i));
+                        acc[q][0] = _mm256_add_epi32(acc[q][0], _mm256_madd_epi16(x, y0));
+                        acc[q][1] = _mm256_add_epi32(acc[q][1], _mm256_madd_epi16(x, y1));
+                    }
+                }
+
+                for (size_t q = 0; q < QUERY_STEP; q++)
+                    for (size_t c = 0; c < CODEBOOK_STEP; c++)
+                        dots[q * dotsStride + c] += scales[half] * reduceAvx2(acc[q][c]);
+            }
+        }
+
+        /*
+         * GCC warns about the undefined vectors used inside its own AVX-512 intrinsics.
+         */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+        __attribute__((target("avx512f")))
+        static int64_t reduceAvx512(__m512i sums) {
+            __m512i wide = _mm512_add_epi64(_mm512_cvtepi32_epi64(_mm512_castsi512_si256(sums)), _mm512_cvtepi32_epi64(_mm512_extracti64x4_epi64(sums, 1)));
+
+            return _mm512_reduce_add_epi64(wide);
+        }
+
+        /*
+         * Both halves at once: 16 sums of 16 lanes, half of the 32 registers, with the fused
+         * multiply-add of pairs of the VNNI extension.
+         */
+        __attribute__((target("avx512f,avx512bw,avx512vnni")))
+        static void microKernelAvx512(const short* high, const short* low, size_t queryStride, const short* codebook, size_t codebookStride, size_t n, int64_t* dots, size_t dotsStride) {
+            __m512i accHigh[QUERY_STEP][CODEBOOK_STEP], accLow[QUERY_STEP][CODEBOOK_STEP];
+            for (size_t q = 0; q < QUERY_STEP; q++) {
+                for (size_t c = 0; c < CODEBOOK_STEP; c++) {
+                    accHigh[q][c] = _mm512_setzero_si512();
+                    accLow[q][c] = _mm512_setzero_si512();
+                }
+            }
+
+            for (size_t i = 0; i < n; i += 32) {
+                __m512i y0 = _mm512_load_si512((const void*) (codebook + i));
+                __m512i y1 = _mm512_load_si512((const void*) (codebook + codebookStride + i));
+
+                for (size_t q = 0; q < QUERY_STEP; q++) {
+                    __m512i xHigh = _mm512_load_si512((const void*) (high + q * queryStride + i));
+                    __m512i xLow = _mm512_load_si512((const void*) (low + q * queryStride + i));
+
+                    accHigh[q][0] = _mm512_dpwssd_epi32(accHigh[q][0], xHigh, y0);
+                    accHigh[q][1] = _mm512_dpwssd_epi32(accHigh[q][1], xHigh, y1);
+                    accLow[q][0] = _mm512_dpwssd_epi32(accLow[q][0], xLow, y0);
+                    accLow[q][1] = _mm512_dpwssd_epi32(accLow[q][1], xLow, y1);
+                }
+            }
+
+            for (size_t q = 0; q < QUERY_STEP; q++)
+                for (size_t c = 0; c < CODEBOOK_STEP; c++)
+                    dots[q * dotsStride + c] += 256 * reduceAvx512(accHigh[q][c]) + reduceAvx512(accLow[q][c]);
+        }
+
+#pragma GCC diagnostic pop
+#endif
+
+        /*
+         * Inner product of a single pair, for the blocks left over by the micro-kernel.
+         */
+        static size_t getPaddedQueries(size_t nQueries) {
+            return (nQueries + QUERY_STEP - 1) / QUERY_STEP * QUERY_STEP;
+        }
+
+        static int64_t dot(const short* high, const short* low, const short* codebook, size_t n) {
+            int64_t sumHigh = 0, sumLow = 0;
+
+            for (size_t i = 0; i < n; i++) {
+                sumHigh += high[i] * codebook[i];
+                sumLow += low[i] * codebook[i];
+            }
+
+            return 256 * sumHigh + sumLow;
+        }
+
+    public:
+        /**
+         * @param sampleBlocks are the sample blocks, copied split in their high and low bytes. The
+         * copies get zero rows up to a multiple of QUERY_STEP, so a few blocks (a chunk of a
+         * stream) still run in the micro-kernel.
+         * @param energies are the squared norms of the sample blocks.
+         * @param kernel selects the vectorized micro-kernel: AVX-512 needs the VNNI extension,
+         * otherwise the AVX2 micro-kernel is used.
+         */
+        BatchDistance(MatrixView<const short> sampleBlocks, const std::vector<uint64_t>& energies, DistanceKernel kernel = bestDistanceKernel())
+            : high(getPaddedQueries(sampleBlocks.getRows()), sampleBlocks.getCols()), low(getPaddedQueries(sampleBlocks.getRows()), sampleBlocks.getCols()),
+              energies(energies), microKernel(microKernelScalar) {
+            for (size_t block = 0; block < sampleBlocks.getRows(); block++) {
+                for (size_t value = 0; value < sampleBlocks.getCols(); value++) {
+                    short sample = sampleBlocks.getRow(block)[value];
+
+                    high.getRow(block)[value] = sample >> 8;
+                    low.getRow(block)[value] = sample & 0xff;
+                }
+            }
+
+#ifdef DISTANCE_X86
+            if (kernel == DistanceKernel::Avx512 && isDistanceKernelSupported(kernel) && __builtin_cpu_supports("avx512vnni"))
+                microKernel = microKernelAvx512;
+            else if ((kernel == DistanceKernel::Avx2 || kernel == DistanceKernel::Avx512) && isDistanceKernelSupported(DistanceKernel::Avx2))
+                microKernel = microKernelAvx2;
+#else
+            (void) kernel;
+#endif
+        }
+
+        /**
+         * Function to compute the inner products of every sample block with every codebook block.
+         * Codebooks of narrower integers (such as int8 quantized centroids) are widened to int16
+         * as their tiles are packed, so they stream fewer bytes through the same micro-kernels.
+         * @param codebook are the codebook blocks, with as many values as the sample blocks.
+         * @param dots receives the inner products, one row of codebook.getRows() values per sample
+         * block (and per padding row).
+         */
+        template <typename T>
+        void getDots(MatrixView<const T> codebook, std::vector<int64_t>& dots) const {
+            size_t nValues = high.getCols();
+            size_t k = codebook.getRows();
+
+            Matrix<short> tile(TILE_BLOCKS, TILE_VALUES);
+            dots.assign(high.getRows() * k, 0);
+
+            for (size_t firstValue = 0; firstValue < nValues; firstValue += TILE_VALUES) {
+                size_t width = std::min(TILE_VALUES, nValues - firstValue);
+
+                /*
+                 * The packed rows and the sample rows are zero after their last value (the rows
+                 * of a Matrix are padded to 64 bytes), so the micro-kernel can always run over a
+                 * multiple of 32 values.
+                 */
+                size_t paddedWidth = (width + VALUE_STEP - 1) / VALUE_STEP * VALUE_STEP;
+
+                for (size_t firstBlock = 0; firstBlock < k; firstBlock += TILE_BLOCKS) {
+                    size_t nBlocks = std::min(TILE_BLOCKS, k - firstBlock);
+
+                    for (size_t block = 0; block < nBlocks; block++) {
+                        const T* values = codebook.getRow(firstBlock + block) + firstValue;
+                        short* packed = tile.getRow(block);
+
+                        std::copy(values, values + width, packed);
+                        std::fill(packed + width, packed + paddedWidth, 0);
+                    }
+
+                    for (size_t query = 0; query < high.getRows(); query += QUERY_STEP) {
+                        int64_t* queryDots = dots.data() + query * k + firstBlock;
+                        size_t block = 0;
+
+                        for (; block + CODEBOOK_STEP <= nBlocks; block += CODEBOOK_STEP)
+                            microKernel(high.getRow(query) + firstValue, low.getRow(query) + firstValue, high.getStride(),
+                                        tile.getRow(block), tile.getStride(), paddedWidth, queryDots + block, k);
+
+                        for (; block < nBlocks; block++)
+                            for (size_t q = 0; q < QUERY_STEP; q++)
+                                queryDots[q * k + block] += dot(high.getRow(query + q) + firstValue, low.getRow(query + q) + firstValue, tile.getRow(block), width);
+                    }
+                }
+            }
+        }
+
+        /**
+         * Function to compute the squared distance of every sample block to its closest codebook block.
+         * @param codebook are the codebook blocks, with as many values as the sample blocks.
+         * @param codebookEnergies are the squared norms of the codebook blocks.
+         * @param minDistances receives one exact distance per sample block.
+         */
+        void nearest(MatrixView<const short> codebook, const std::vector<uint64_t>& codebookEnergies, std::vector<uint64_t>& minDistances) const {
+            size_t nQueries = energies.size();
+            size_t k = codebook.getRows();
+            std::vector<int64_t> dots;
+
+            getDots(codebook, dots);
+            minDistances.assign(nQueries, std::numeric_limits<uint64_t>::max());
+
+            for (size_t query = 0; query < nQueries; query++) {
+                for (size_t block = 0; block < k; block++) {
+                    uint64_t dist = energies[query] + codebookEnergies[block] - 2 * dots[query * k + block];
+
+                    minDistances[query] = std::min(minDistances[query], dist);
+                }
+            }
+        }
+};
+
+#endif
@@ -0,0 +1,112 @@
+#ifndef BLOCK_READER_H
+#define BLOCK_READER_H
+
+#include <cassert>
+#include <sndfile.hh>
+#include "matrix.h"
+
+/*
+  Lê os blocos sobrepostos de um ficheiro. Cada bloco tem blockFrames frames e começa
+  blockFrames - overlappingFactor frames depois do anterior, por isso o número de blocos
+  é conhecido à partida. O overlap tem de ser menor que o bloco, senão os blocos não avançam.
+*/
+class BlockReader{
+
+    private:
+        SndfileHandle& wavFile;
+        size_t blockFrames, overlappingFactor, nBlocks = 0;
+
+        /*
+          Amostras descodificadas por readAll, partilhadas pelos blocos sobrepostos.
+        */
+        Matrix<short> samples;
+        MatrixView<const short> blocks;
+
+    public:
+
+        BlockReader(SndfileHandle& wavFile, size_t blockFrames, size_t overlappingFactor)
+            : wavFile(wavFile), blockFrames(blockFrames), overlappingFactor(overlappingFactor){
+
+            assert(overlappingFactor < blockFrames);
+            size_t hop = blockFrames - overlappingFactor;
+
+            if((size_t) wavFile.frames() >= blockFrames){
+                nBlocks = (wavFile.frames() - blockFrames) / hop + 1;
+            }
+        }
+
+        size_t getNBlocks(){
+            return nBlocks;
+        }
+
+        size_t getChannels(){
+            return wavFile.channels();
+        }
+
+        size_t getSampleRate(){
+            return wavFile.samplerate();
+        }
+
+        /*
+          Número de amostras de cada bloco (frames x canais).
+        */
+        size_t getBlockSize(){
+            return blockFrames * wavFile.channels();
+        }
+
+        /*
+          Descodifica uma só vez, sequencialmente, todas as frames cobertas pelos blocos e
+          devolve os blocos como linhas sobrepostas desse buffer, sem cópias: o bloco i começa
+          i x hop frames depois do início. A vista é válida enquanto o reader existir e as
+          chamadas seguintes devolvem-na sem voltar a ler o ficheiro.
+          Devolve uma vista vazia se o ficheiro não tiver todas as frames.
+        */
+        MatrixView<const short> readAll(){
+            if(nBlocks == 0 || blocks.getRows() > 0){
+                return blocks;
+            }
+
+            size_t hop = blockFrames - overlappingFactor;
+            size_t channels = wavFile.channels();
+            size_t nFrames = (nBlocks - 1) * hop + blockFrames;
+
+            samples = Matrix<short>(1, nFrames * channels);
+
+            wavFile.seek(0, SEEK_SET);
+            if((size_t) wavFile.readf(samples.getRow(0), nFrames) != nFrames){
+                return MatrixView<const short>();
+            }
+
+            blocks = MatrixView<const short>(samples.getRow(0), nBlocks, getBlockSize(), hop * channels);
+            return blocks;
+        }
+
+        /*
+          Lê os blocos first, first + step, first + 2 x step, ... para as linhas de batch e
+          devolve quantos leu. Com step maior que 1 cada lote é uma amostra de todo o ficheiro.
+        */
+        size_t read(MatrixView<short> batch, size_t first = 0, size_t step = 1){
+            size_t hop = blockFrames - overlappingFactor;
+            size_t n = 0;
+
+            for(size_t block = first; block < nBlocks && n < batch.getRows(); block += step, n++){
+
+                if(step != 1 || n == 0){
+                    wavFile.seek(block * hop, SEEK_SET);
+                }
+
+                if((size_t) wavFile.readf(batch.getRow(n), blockFrames) != blockFrames){
+                    break;
+                }
+
+                /*
+                  Retrocede o valor do overlapping para ler o bloco seguinte
+                */
+                wavFile.seek( -overlappingFactor, SEEK_CUR);
+            }
+
+            return n;
+        }
+};
+
+#endif
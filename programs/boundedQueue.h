@@ -0,0 +1,75 @@
+#ifndef BOUNDED_QUEUE_H
+#define BOUNDED_QUEUE_H
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+/**
+ * Queue with a maximum number of items, used to connect the stages of a pipeline.
+ * A producer blocks while the queue is full, so a fast stage cannot run far ahead of a slow one.
+ * Once closed, the consumers drain the remaining items and then stop.
+ */
+template<typename T>
+class BoundedQueue {
+    private:
+        std::mutex m;
+        std::condition_variable notFull, notEmpty;
+        std::deque<T> items;
+        size_t capacity;
+        bool closed = false;
+
+    public:
+        explicit BoundedQueue(size_t capacity) : capacity(capacity > 0 ? capacity : 1) {}
+
+        BoundedQueue(const BoundedQueue&) = delete;
+
+        BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+        /**
+         * Function to add an item, waiting while the queue is full.
+         * @param item is the item to add.
+         * @return false if the queue was closed and the item was discarded.
+         */
+        bool push(T item) {
+            std::unique_lock<std::mutex> lock(m);
+            notFull.wait(lock, [&] { return closed || items.size() < capacity; });
+
+            if (closed)
+                return false;
+
+            items.push_back(std::move(item));
+            notEmpty.notify_one();
+            return true;
+        }
+
+        /**
+         * Function to remove the oldest item, waiting while the queue is empty and open.
+         * @param item receives the removed item.
+         * @return false if the queue is closed and has no more items.
+         */
+        bool pop(T& item) {
+            std::unique_lock<std::mutex> lock(m);
+            notEmpty.wait(lock, [&] { return closed || !items.empty(); });
+
+            if (items.empty())
+                return false;
+
+            item = std::move(items.front());
+            items.pop_front();
+            notFull.notify_one();
+            return true;
+        }
+
+        /**
+         * Function to signal that no more items will be added.
+         */
+        void close() {
+            std::lock_guard<std::mutex> lock(m);
+            closed = true;
+            notFull.notify_all();
+            notEmpty.notify_all();
+        }
+};
+
+#endif
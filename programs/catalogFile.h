@@ -0,0 +1,325 @@
+#ifndef CATALOG_FILE_H
+#define CATALOG_FILE_H
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "codebookFile.h"
+
+/**
+ * Catalog of many codebooks in a single file, so a query maps one file instead of opening
+ * one codebook per song.
+ *
+ * The file is little-endian: a 64 byte header, a table with one 64 byte entry per song, the
+ * song names one after the other, and the centroid arena. The rows of every song are stored
+ * as in a binary codebook (int16, padded to 64 bytes) starting at a 64 byte aligned offset,
+ * so every song is a MatrixView straight into the mapping. The header checksum covers the
+ * table and the names, and each entry has the checksum of its rows.
+ */
+class CatalogFile {
+    public:
+        static constexpr uint32_t VERSION = 1;
+
+    private:
+        struct Header {
+            char magic[8];
+            uint32_t version;
+            uint32_t headerSize;
+            uint32_t entrySize;
+            uint32_t sampleType;
+            uint64_t nSongs;
+            uint64_t namesOffset;
+            uint64_t namesBytes;
+            uint64_t arenaOffset;
+            uint64_t checksum;
+        };
+
+        struct Entry {
+            uint64_t nameOffset;
+            uint32_t nameLength;
+            uint32_t channels;
+            uint32_t sampleRate;
+            uint32_t blockFrames;
+            uint32_t overlapFrames;
+            uint32_t nRows;
+            uint32_t nCols;
+            uint32_t rowStride;
+            uint64_t rowsOffset;
+            uint64_t checksum;
+            uint32_t melBands;
+            uint32_t reserved;
+        };
+
+        static_assert(sizeof(Header) == 64, "the catalog header must fill one cache line");
+        static_assert(sizeof(Entry) == 64, "a catalog entry must fill one cache line");
+
+        static constexpr char MAGIC[8] = {'T', 'A', 'I', 'C', 'A', 'T', 'L', 'G'};
+
+        const char* mapping = nullptr;
+        size_t mappedBytes = 0;
+        const Entry* entries = nullptr;
+        uint64_t nSongs = 0;
+
+        void close() {
+            if (mapping != nullptr)
+                munmap(const_cast<char*>(mapping), mappedBytes);
+
+            mapping = nullptr;
+            mappedBytes = 0;
+            entries = nullptr;
+            nSongs = 0;
+        }
+
+        const Header& getHeader() const {
+            return *reinterpret_cast<const Header*>(mapping);
+        }
+
+        static uint64_t alignUp(uint64_t offset) {
+            return (offset + Matrix<short>::ALIGNMENT - 1) / Matrix<short>::ALIGNMENT * Matrix<short>::ALIGNMENT;
+        }
+
+    public:
+        CatalogFile() = default;
+
+        ~CatalogFile() {
+            close();
+        }
+
+        CatalogFile(const CatalogFile&) = delete;
+
+        CatalogFile& operator=(const CatalogFile&) = delete;
+
+        /**
+         * Function to know if a file starts like a catalog, without mapping it.
+         * @param path is the location of the file.
+         * @return true if the file has the catalog magic.
+         */
+        static bool isCatalog(const std::string& path) {
+            std::ifstream fp(path, std::ios::binary);
+            char magic[sizeof(MAGIC)] = {};
+
+            return fp.read(magic, sizeof(magic)) && std::memcmp(magic, MAGIC, sizeof(MAGIC)) == 0;
+        }
+
+        /**
+         * Function to map a catalog and check that its table fits in the file.
+         * Errors are reported on std::cerr.
+         * @param path is the location of the catalog.
+         * @return true if the catalog was opened.
+         */
+        bool open(const std::string& path) {
+            close();
+
+            int fd = ::open(path.c_str(), O_RDONLY);
+            struct stat status;
+
+            if (fd < 0 || fstat(fd, &status) != 0 || (size_t) status.st_size < sizeof(Header)) {
+                if (fd >= 0)
+                    ::close(fd);
+                std::cerr << "Error: could not open the catalog " << path << std::endl;
+                return false;
+            }
+
+            void* map = mmap(nullptr, status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            ::close(fd);
+
+            if (map == MAP_FAILED) {
+                std::cerr << "Error: could not map the catalog " << path << std::endl;
+                return false;
+            }
+
+            mapping = static_cast<const char*>(map);
+            mappedBytes = status.st_size;
+            const Header& header = getHeader();
+
+            if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 || header.version != VERSION
+                    || header.headerSize != sizeof(Header) || header.entrySize != sizeof(Entry)
+                    || header.sampleType != CodebookFile::SAMPLE_INT16) {
+                std::cerr << "Error: unsupported catalog version in " << path << std::endl;
+                close();
+                return false;
+            }
+
+            if (header.namesOffset != sizeof(Header) + header.nSongs * sizeof(Entry)
+                    || header.namesOffset + header.namesBytes > header.arenaOffset || header.arenaOffset > mappedBytes) {
+                std::cerr << "Error: truncated or corrupted catalog " << path << std::endl;
+                close();
+                return false;
+            }
+
+            entries = reinterpret_cast<const Entry*>(mapping + sizeof(Header));
+            nSongs = header.nSongs;
+
+            for (size_t song = 0; song < nSongs; song++) {
+                const Entry& entry = entries[song];
+
+                if (entry.nameOffset + entry.nameLength > header.namesBytes || entry.rowStride < entry.nCols
+                        || entry.rowsOffset % Matrix<short>::ALIGNMENT != 0 || entry.rowsOffset < header.arenaOffset
+                        || entry.rowsOffset + (uint64_t) entry.nRows * entry.rowStride * sizeof(short) > mappedBytes) {
+                    std::cerr << "Error: truncated or corrupted catalog " << path << std::endl;
+                    close();
+                    return false;
+                }
+            }
+
+            return true;
+        }
+
+        /**
+         * Function to check the table, the names and the rows of every song against their checksums.
+         * This reads the whole catalog.
+         * @return true if the catalog is intact.
+         */
+        bool verify() const {
+            const Header& header = getHeader();
+
+            if (CodebookFile::computeChecksum(mapping + sizeof(Header), header.namesOffset + header.namesBytes - sizeof(Header)) != header.checksum)
+                return false;
+
+            for (size_t song = 0; song < nSongs; song++) {
+                MatrixView<const short> rows = getCentroids(song);
+
+                if (CodebookFile::computeChecksum(rows.getData(), rows.getRows() * rows.getStride() * sizeof(short)) != entries[song].checksum)
+                    return false;
+            }
+
+            return true;
+        }
+
+        /**
+         * Function to retrieve the checksum of the table and names, which identifies the catalog
+         * (used by the indexes built from it).
+         * @return the header checksum.
+         */
+        uint64_t getChecksum() const {
+            return getHeader().checksum;
+        }
+
+        size_t getNSongs() const {
+            return nSongs;
+        }
+
+        std::string getName(size_t song) const {
+            return std::string(mapping + getHeader().namesOffset + entries[song].nameOffset, entries[song].nameLength);
+        }
+
+        CodebookInfo getInfo(size_t song) const {
+            CodebookInfo info;
+            info.channels = entries[song].channels;
+            info.sampleRate = entries[song].sampleRate;
+            info.blockFrames = entries[song].blockFrames;
+            info.overlapFrames = entries[song].overlapFrames;
+            info.melBands = entries[song].melBands;
+            return info;
+        }
+
+        MatrixView<const short> getCentroids(size_t song) const {
+            const Entry& entry = entries[song];
+            const short* rows = reinterpret_cast<const short*>(mapping + entry.rowsOffset);
+
+            return MatrixView<const short>(rows, entry.nRows, entry.nCols, entry.rowStride);
+        }
+
+        /**
+         * Function to write a catalog with the given codebooks.
+         * @param path is the location of the new catalog.
+         * @param names are the names of the songs, in the order they are stored.
+         * @param codebooks are the open binary codebooks of the songs.
+         * @return true if the whole file was written.
+         */
+        static bool write(const std::string& path, const std::vector<std::string>& names, const std::vector<const CodebookFile*>& codebooks) {
+            std::vector<MatrixView<const short>> centroids;
+            std::vector<CodebookInfo> infos;
+
+            for (const CodebookFile* codebook : codebooks) {
+                centroids.push_back(codebook->getCentroids());
+                infos.push_back(codebook->getInfo());
+            }
+
+            return write(path, names, centroids, infos);
+        }
+
+        /**
+         * Function to write a catalog with the given centroids, such as codebooks derived from another catalog.
+         * @param path is the location of the new catalog.
+         * @param names are the names of the songs, in the order they are stored.
+         * @param centroids are the centroids of the songs.
+         * @param infos are the audio parameters of the songs.
+         * @return true if the whole file was written.
+         */
+        static bool write(const std::string& path, const std::vector<std::string>& names, const std::vector<MatrixView<const short>>& centroids,
+                          const std::vector<CodebookInfo>& infos) {
+            std::vector<Entry> table(centroids.size());
+            std::string namesBlob;
+
+            for (size_t song = 0; song < centroids.size(); song++) {
+                table[song] = Entry();
+                table[song].nameOffset = namesBlob.size();
+                table[song].nameLength = names[song].size();
+                namesBlob += names[song];
+            }
+
+            Header header = {};
+            std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+            header.version = VERSION;
+            header.headerSize = sizeof(Header);
+            header.entrySize = sizeof(Entry);
+            header.sampleType = CodebookFile::SAMPLE_INT16;
+            header.nSongs = centroids.size();
+            header.namesOffset = sizeof(Header) + table.size() * sizeof(Entry);
+            header.namesBytes = namesBlob.size();
+            header.arenaOffset = alignUp(header.namesOffset + header.namesBytes);
+
+            uint64_t offset = header.arenaOffset;
+
+            for (size_t song = 0; song < centroids.size(); song++) {
+                MatrixView<const short> rows = centroids[song];
+                const CodebookInfo& info = infos[song];
+                Entry& entry = table[song];
+
+                entry.channels = info.channels;
+                entry.sampleRate = info.sampleRate;
+                entry.blockFrames = info.blockFrames;
+                entry.overlapFrames = info.overlapFrames;
+                entry.melBands = info.melBands;
+                entry.nRows = rows.getRows();
+                entry.nCols = rows.getCols();
+                entry.rowStride = rows.getStride();
+                entry.rowsOffset = offset;
+                entry.checksum = CodebookFile::computeChecksum(rows.getData(), rows.getRows() * rows.getStride() * sizeof(short));
+
+                offset = alignUp(offset + rows.getRows() * rows.getStride() * sizeof(short));
+            }
+
+            std::string tableAndNames(reinterpret_cast<const char*>(table.data()), table.size() * sizeof(Entry));
+            tableAndNames += namesBlob;
+            header.checksum = CodebookFile::computeChecksum(tableAndNames.data(), tableAndNames.size());
+
+            std::ofstream fp(path, std::ios::binary);
+            const char padding[Matrix<short>::ALIGNMENT] = {};
+
+            fp.write(reinterpret_cast<const char*>(&header), sizeof(Header));
+            fp.write(tableAndNames.data(), tableAndNames.size());
+            fp.write(padding, header.arenaOffset - header.namesOffset - header.namesBytes);
+
+            for (size_t song = 0; song < centroids.size(); song++) {
+                MatrixView<const short> rows = centroids[song];
+                size_t rowBytes = rows.getRows() * rows.getStride() * sizeof(short);
+
+                fp.write(reinterpret_cast<const char*>(rows.getData()), rowBytes);
+                fp.write(padding, alignUp(rowBytes) - rowBytes);
+            }
+
+            fp.close();
+            return !fp.fail();
+        }
+};
+
+#endif
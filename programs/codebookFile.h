@@ -0,0 +1,446 @@
+#ifndef CODEBOOK_FILE_H
+#define CODEBOOK_FILE_H
+
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "matrix.h"
+
+/**
+ * Audio parameters a codebook was trained with. A value of 0 means unknown (text codebooks).
+ * The rows are the samples of the blocks, or with melBands > 0 the log-mel features of the
+ * blocks (see LogMel), one value per band.
+ */
+struct CodebookInfo {
+    uint32_t channels = 0;
+    uint32_t sampleRate = 0;
+    uint32_t blockFrames = 0;
+    uint32_t overlapFrames = 0;
+    uint32_t melBands = 0;
+};
+
+/**
+ * Codebook stored on disk, either in the binary format or in the old text format
+ * (one centroid per line, values separated by spaces).
+ *
+ * The binary format is little-endian: a 64 byte header followed by k rows of int16 values,
+ * each row padded with zeros to a multiple of 64 bytes, so a memory-mapped file can be used
+ * directly as a MatrixView with aligned rows. The checksum is a 64-bit FNV-1a of the rows.
+ * Opening a binary codebook only maps it; the rows are read from disk on first access.
+ */
+class CodebookFile {
+    public:
+        static constexpr uint32_t VERSION = 1;
+        static constexpr uint32_t SAMPLE_INT16 = 1;
+
+    private:
+        struct Header {
+            char magic[8];
+            uint32_t version;
+            uint32_t headerSize;
+            uint32_t sampleType;
+            uint32_t channels;
+            uint32_t sampleRate;
+            uint32_t blockFrames;
+            uint32_t overlapFrames;
+            uint32_t nRows;
+            uint32_t nCols;
+            uint32_t rowStride;
+            uint64_t checksum;
+            uint32_t melBands;
+            uint32_t reserved;
+        };
+
+        static_assert(sizeof(Header) == 64, "the codebook header must fill one cache line");
+
+        static constexpr char MAGIC[8] = {'T', 'A', 'I', 'C', 'B', 'O', 'O', 'K'};
+
+        /*
+         * Bytes of text parsed by each thread, at least.
+         */
+        static constexpr size_t TEXT_PART_BYTES = 1 << 20;
+
+        void* mapping = nullptr;
+        size_t mappedBytes = 0;
+        Matrix<short> parsed;
+        MatrixView<const short> centroids;
+        CodebookInfo info;
+        uint64_t checksum = 0;
+
+        void close() {
+            if (mapping != nullptr)
+                munmap(mapping, mappedBytes);
+
+            mapping = nullptr;
+            mappedBytes = 0;
+            parsed = Matrix<short>();
+            centroids = MatrixView<const short>();
+            info = CodebookInfo();
+            checksum = 0;
+        }
+
+        bool openBinary(const std::string& path, int fd, size_t fileBytes) {
+            mapping = mmap(nullptr, fileBytes, PROT_READ, MAP_PRIVATE, fd, 0);
+
+            if (mapping == MAP_FAILED) {
+                mapping = nullptr;
+                std::cerr << "Error: could not map the codebook " << path << std::endl;
+                return false;
+            }
+            mappedBytes = fileBytes;
+
+            Header header;
+            std::memcpy(&header, mapping, sizeof(Header));
+
+            if (header.version != VERSION || header.headerSize != sizeof(Header) || header.sampleType != SAMPLE_INT16) {
+                std::cerr << "Error: unsupported codebook version or sample type in " << path << std::endl;
+                return false;
+            }
+
+            if (header.rowStride < header.nCols || header.rowStride * sizeof(short) % Matrix<short>::ALIGNMENT != 0
+                    || fileBytes != header.headerSize + (size_t) header.nRows * header.rowStride * sizeof(short)) {
+                std::cerr << "Error: truncated or corrupted codebook " << path << std::endl;
+                return false;
+            }
+
+            const short* rows = reinterpret_cast<const short*>(static_cast<const char*>(mapping) + header.headerSize);
+            centroids = MatrixView<const short>(rows, header.nRows, header.nCols, header.rowStride);
+            info.channels = header.channels;
+            info.sampleRate = header.sampleRate;
+            info.blockFrames = header.blockFrames;
+            info.overlapFrames = header.overlapFrames;
+            info.melBands = header.melBands;
+            checksum = header.checksum;
+            return true;
+        }
+
+        static bool isSpace(char c) {
+            return c == ' ' || c == '\t' || c == '\r';
+        }
+
+        static const char* lineEnd(const char* first, const char* last) {
+            const char* end = static_cast<const char*>(std::memchr(first, '\n', last - first));
+            return end != nullptr ? end : last;
+        }
+
+        /*
+         * Counts the values of the first line with values in [first, last).
+         */
+        static size_t countValues(const char* first, const char* last) {
+            while (first < last) {
+                const char* end = lineEnd(first, last);
+                size_t nValues = 0;
+
+                for (const char* c = first; c < end; c++)
+                    if (!isSpace(*c) && (c == first || isSpace(c[-1])))
+                        nValues++;
+
+                if (nValues > 0)
+                    return nValues;
+
+                first = end + 1;
+            }
+
+            return 0;
+        }
+
+        /*
+         * Counts the lines of [first, last) that are not blank.
+         */
+        static size_t countRows(const char* first, const char* last) {
+            size_t nRows = 0;
+
+            while (first < last) {
+                const char* end = lineEnd(first, last);
+
+                for (const char* c = first; c < end; c++) {
+                    if (!isSpace(*c)) {
+                        nRows++;
+                        break;
+                    }
+                }
+
+                first = end + 1;
+            }
+
+            return nRows;
+        }
+
+        /*
+         * Parses the lines of [first, last) into the rows of parsed starting at row.
+         * Returns false if a value is not a short or a line has the wrong number of values.
+         */
+        bool parseRows(const char* first, const char* last, size_t row) {
+            size_t nCols = parsed.getCols();
+
+            while (first < last) {
+                const char* end = lineEnd(first, last);
+                const char* c = first;
+                size_t col = 0;
+
+                while (true) {
+                    while (c < end && isSpace(*c))
+                        c++;
+
+                    if (c == end)
+                        break;
+
+                    if (col == nCols)
+                        return false;
+
+                    std::from_chars_result parsedValue = std::from_chars(c, end, parsed.getRow(row)[col++]);
+                    if (parsedValue.ec != std::errc() || (parsedValue.ptr != end && !isSpace(*parsedValue.ptr)))
+                        return false;
+
+                    c = parsedValue.ptr;
+                }
+
+                if (col > 0) {
+                    if (col != nCols)
+                        return false;
+                    row++;
+                }
+
+                first = end + 1;
+            }
+
+            return true;
+        }
+
+        /*
+         * Maps a text codebook and parses it straight into one matrix, without a string per value.
+         * Large files are split at line boundaries and parsed by several threads: a first pass
+         * counts the rows of each part, so every thread knows the row where its part starts.
+         */
+        bool openText(const std::string& path, int fd, size_t fileBytes) {
+            if (fileBytes == 0) {
+                std::cerr << "Error: empty or invalid codebook " << path << std::endl;
+                return false;
+            }
+
+            void* map = mmap(nullptr, fileBytes, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map == MAP_FAILED) {
+                std::cerr << "Error: could not map the codebook " << path << std::endl;
+                return false;
+            }
+            madvise(map, fileBytes, MADV_SEQUENTIAL);
+
+            const char* text = static_cast<const char*>(map);
+            const char* textEnd = text + fileBytes;
+
+            size_t nParts = std::max<size_t>(1, std::min<size_t>(fileBytes / TEXT_PART_BYTES, std::thread::hardware_concurrency()));
+            std::vector<const char*> bounds(nParts + 1, textEnd);
+            bounds[0] = text;
+
+            for (size_t part = 1; part < nParts; part++) {
+                const char* start = std::max(bounds[part - 1], text + fileBytes * part / nParts);
+                bounds[part] = std::min(lineEnd(start, textEnd) + 1, textEnd);
+            }
+
+            auto runParts = [&](const std::function<void(size_t)>& task) {
+                std::vector<std::thread> threads;
+
+                for (size_t part = 1; part < nParts; part++)
+                    threads.emplace_back(task, part);
+
+                task(0);
+
+                for (std::thread& thread : threads)
+                    thread.join();
+            };
+
+            std::vector<size_t> firstRow(nParts + 1, 0);
+            runParts([&](size_t part) {
+                firstRow[part + 1] = countRows(bounds[part], bounds[part + 1]);
+            });
+
+            for (size_t part = 0; part < nParts; part++)
+                firstRow[part + 1] += firstRow[part];
+
+            size_t nRows = firstRow[nParts];
+            size_t nCols = countValues(text, textEnd);
+            bool valid = nRows > 0;
+
+            if (valid) {
+                parsed = Matrix<short>(nRows, nCols);
+
+                std::vector<char> partValid(nParts, 0);
+                runParts([&](size_t part) {
+                    partValid[part] = parseRows(bounds[part], bounds[part + 1], firstRow[part]);
+                });
+
+                valid = std::find(partValid.begin(), partValid.end(), 0) == partValid.end();
+            }
+
+            munmap(map, fileBytes);
+
+            if (!valid) {
+                std::cerr << "Error: empty or invalid codebook " << path
+                          << " (the values must be shorts, the same number on every line)" << std::endl;
+                return false;
+            }
+
+            centroids = parsed.view();
+            return true;
+        }
+
+    public:
+        CodebookFile() = default;
+
+        /**
+         * Function to compute the 64-bit FNV-1a checksum used by the codebook and catalog files.
+         * @param data points to the first byte.
+         * @param nBytes is the number of bytes.
+         * @param hash is the checksum of the previous bytes, to checksum a file written in parts.
+         * @return the checksum of the bytes.
+         */
+        static uint64_t computeChecksum(const void* data, size_t nBytes, uint64_t hash = 14695981039346656037ULL) {
+            const unsigned char* bytes = static_cast<const unsigned char*>(data);
+
+            for (size_t i = 0; i < nBytes; i++) {
+                hash ^= bytes[i];
+                hash *= 1099511628211ULL;
+            }
+
+            return hash;
+        }
+
+        ~CodebookFile() {
+            close();
+        }
+
+        CodebookFile(const CodebookFile&) = delete;
+
+        CodebookFile& operator=(const CodebookFile&) = delete;
+
+        /**
+         * Function to open a codebook, mapping it if it is binary and parsing it otherwise.
+         * Errors are reported on std::cerr.
+         * @param path is the location of the codebook.
+         * @return true if the codebook was opened.
+         */
+        bool open(const std::string& path) {
+            close();
+
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0) {
+                std::cerr << "Error: could not open the codebook " << path << std::endl;
+                return false;
+            }
+
+            struct stat status;
+            char magic[sizeof(MAGIC)] = {};
+            bool binary = fstat(fd, &status) == 0 && (size_t) status.st_size >= sizeof(Header)
+                    && pread(fd, magic, sizeof(magic), 0) == (ssize_t) sizeof(magic)
+                    && std::memcmp(magic, MAGIC, sizeof(MAGIC)) == 0;
+
+            bool opened = binary ? openBinary(path, fd, status.st_size) : openText(path, fd, status.st_size);
+            ::close(fd);
+
+            if (!opened)
+                close();
+
+            return opened;
+        }
+
+        /**
+         * Function to check the rows of a binary codebook against the checksum of its header.
+         * This reads the whole file; text codebooks have no checksum and always pass.
+         * @return true if the rows are intact.
+         */
+        bool verify() const {
+            if (mapping == nullptr)
+                return true;
+
+            return computeChecksum(centroids.getData(), centroids.getRows() * centroids.getStride() * sizeof(short)) == checksum;
+        }
+
+        /**
+         * Function to know if the codebook was opened from the binary format.
+         * @return true for binary codebooks, false for text codebooks.
+         */
+        bool isBinary() const {
+            return mapping != nullptr;
+        }
+
+        MatrixView<const short> getCentroids() const {
+            return centroids;
+        }
+
+        const CodebookInfo& getInfo() const {
+            return info;
+        }
+
+        /**
+         * Function to write a codebook in the binary format.
+         * @param path is the location of the new codebook.
+         * @param centroids are the rows of the codebook.
+         * @param info are the audio parameters the codebook was trained with.
+         * @return true if the whole file was written.
+         */
+        static bool write(const std::string& path, MatrixView<const short> centroids, const CodebookInfo& info) {
+            Matrix<short> rows(centroids.getRows(), centroids.getCols());
+
+            for (size_t i = 0; i < centroids.getRows(); i++)
+                std::copy(centroids.getRow(i), centroids.getRow(i) + centroids.getCols(), rows.getRow(i));
+
+            size_t rowBytes = rows.getRows() * rows.getStride() * sizeof(short);
+
+            Header header = {};
+            std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+            header.version = VERSION;
+            header.headerSize = sizeof(Header);
+            header.sampleType = SAMPLE_INT16;
+            header.channels = info.channels;
+            header.sampleRate = info.sampleRate;
+            header.blockFrames = info.blockFrames;
+            header.overlapFrames = info.overlapFrames;
+            header.melBands = info.melBands;
+            header.nRows = rows.getRows();
+            header.nCols = rows.getCols();
+            header.rowStride = rows.getStride();
+            header.checksum = computeChecksum(rows.getRow(0), rowBytes);
+
+            std::ofstream fp(path, std::ios::binary);
+            fp.write(reinterpret_cast<const char*>(&header), sizeof(Header));
+            fp.write(reinterpret_cast<const char*>(rows.getRow(0)), rowBytes);
+
+            fp.close();
+            return !fp.fail();
+        }
+
+        /**
+         * Function to write a codebook in the text format, one centroid per line.
+         * @param path is the location of the new codebook.
+         * @param centroids are the rows of the codebook.
+         * @return true if the whole file was written.
+         */
+        static bool writeText(const std::string& path, MatrixView<const short> centroids) {
+            std::ofstream fp(path);
+
+            for (size_t i = 0; i < centroids.getRows(); i++) {
+                const short* centroid = centroids.getRow(i);
+
+                for (size_t j = 0; j < centroids.getCols(); j++)
+                    fp << centroid[j] << " ";
+
+                fp << "\n";
+            }
+
+            fp.close();
+            return !fp.fail();
+        }
+};
+
+#endif
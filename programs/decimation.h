@@ -0,0 +1,49 @@
+#ifndef DECIMATION_H
+#define DECIMATION_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * Function to decimate interleaved samples: every group of factor consecutive frames becomes one
+ * frame with the rounded mean of each channel, a low-pass filter followed by downsampling.
+ * The mean is linear, so the decimated centroids of a codebook are (up to the rounding) the
+ * centroids of the decimated blocks, and a song and a sample decimated with the same factor
+ * can be compared at a fraction of the cost.
+ * @param samples are the interleaved samples.
+ * @param nFrames is the number of frames of samples.
+ * @param channels is the number of channels.
+ * @param factor is the number of frames averaged into one.
+ * @param decimated receives nFrames / factor frames; a partial group at the end is dropped.
+ */
+inline void decimateFrames(const short* samples, size_t nFrames, size_t channels, size_t factor, short* decimated) {
+    for (size_t frame = 0; frame < nFrames / factor; frame++) {
+        for (size_t channel = 0; channel < channels; channel++) {
+            int64_t sum = 0;
+
+            for (size_t i = 0; i < factor; i++)
+                sum += samples[(frame * factor + i) * channels + channel];
+
+            int64_t half = (int64_t) factor / 2;
+            decimated[frame * channels + channel] = (short) (sum >= 0 ? (sum + half) / (int64_t) factor : -((-sum + half) / (int64_t) factor));
+        }
+    }
+}
+
+/**
+ * Function to decimate a whole signal.
+ * @param samples are the interleaved samples.
+ * @param channels is the number of channels.
+ * @param factor is the number of frames averaged into one.
+ * @return the decimated interleaved samples.
+ */
+inline std::vector<short> decimateFrames(const std::vector<short>& samples, size_t channels, size_t factor) {
+    size_t nFrames = samples.size() / channels;
+    std::vector<short> decimated(nFrames / factor * channels);
+
+    decimateFrames(samples.data(), nFrames, channels, factor, decimated.data());
+    return decimated;
+}
+
+#endif
@@ -0,0 +1,233 @@
+#ifndef DISTANCE_H
+#define DISTANCE_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DISTANCE_X86 1
+#endif
+
+/**
+ * Squared euclidean distance kernels over int16 vectors.
+ * All kernels compute the exact integer sum of (a[i] - b[i])^2, so every variant
+ * returns the same value and distances can be compared without any rounding.
+ */
+typedef uint64_t (*SquaredDistanceFn)(const short* a, const short* b, size_t n);
+
+enum class DistanceKernel { Scalar, Sse2, Avx2, Avx512 };
+
+/**
+ * Reference implementation, used for the vector tails and as the fallback on other CPUs.
+ */
+inline uint64_t squaredDistanceScalar(const short* a, const short* b, size_t n) {
+    uint64_t sum = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        int64_t diff = (int) a[i] - (int) b[i];
+        sum += diff * diff;
+    }
+
+    return sum;
+}
+
+#ifdef DISTANCE_X86
+
+/*
+ * The vector kernels take |a - b| as max - min, which always fits in an unsigned 16-bit lane,
+ * square it into 32-bit lanes with mullo/mulhi and accumulate in 64-bit lanes.
+ */
+
+__attribute__((target("sse2")))
+inline uint64_t squaredDistanceSse2(const short* a, const short* b, size_t n) {
+    const __m128i low32 = _mm_set1_epi64x(0xffffffff);
+    __m128i acc = _mm_setzero_si128();
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        __m128i x = _mm_loadu_si128((const __m128i*) (a + i));
+        __m128i y = _mm_loadu_si128((const __m128i*) (b + i));
+        __m128i diff = _mm_sub_epi16(_mm_max_epi16(x, y), _mm_min_epi16(x, y));
+        __m128i lo = _mm_mullo_epi16(diff, diff);
+        __m128i hi = _mm_mulhi_epu16(diff, diff);
+        __m128i sq0 = _mm_unpacklo_epi16(lo, hi);
+        __m128i sq1 = _mm_unpackhi_epi16(lo, hi);
+
+        acc = _mm_add_epi64(acc, _mm_and_si128(sq0, low32));
+        acc = _mm_add_epi64(acc, _mm_srli_epi64(sq0, 32));
+        acc = _mm_add_epi64(acc, _mm_and_si128(sq1, low32));
+        acc = _mm_add_epi64(acc, _mm_srli_epi64(sq1, 32));
+    }
+
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i*) lanes, acc);
+
+    return lanes[0] + lanes[1] + squaredDistanceScalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2")))
+inline uint64_t squaredDistanceAvx2(const short* a, const short* b, size_t n) {
+    const __m256i low32 = _mm256_set1_epi64x(0xffffffff);
+    __m256i acc = _mm256_setzero_si256();
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        __m256i x = _mm256_loadu_si256((const __m256i*) (a + i));
+        __m256i y = _mm256_loadu_si256((const __m256i*) (b + i));
+        __m256i diff = _mm256_sub_epi16(_mm256_max_epi16(x, y), _mm256_min_epi16(x, y));
+        __m256i lo = _mm256_mullo_epi16(diff, diff);
+        __m256i hi = _mm256_mulhi_epu16(diff, diff);
+        __m256i sq0 = _mm256_unpacklo_epi16(lo, hi);
+        __m256i sq1 = _mm256_unpackhi_epi16(lo, hi);
+
+        acc = _mm256_add_epi64(acc, _mm256_and_si256(sq0, low32));
+        acc = _mm256_add_epi64(acc, _mm256_srli_epi64(sq0, 32));
+        acc = _mm256_add_epi64(acc, _mm256_and_si256(sq1, low32));
+        acc = _mm256_add_epi64(acc, _mm256_srli_epi64(sq1, 32));
+    }
+
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i*) lanes, acc);
+
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + squaredDistanceScalar(a + i, b + i, n - i);
+}
+
+/*
+ * Some GCC versions warn about the undefined vectors used inside their own AVX-512 intrinsics.
+ */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+__attribute__((target("avx512f,avx512bw")))
+inline uint64_t squaredDistanceAvx512(const short* a, const short* b, size_t n) {
+    const __m512i low32 = _mm512_set1_epi64(0xffffffff);
+    __m512i acc = _mm512_setzero_si512();
+    size_t i = 0;
+
+    for (; i + 32 <= n; i += 32) {
+        __m512i x = _mm512_loadu_si512((const void*) (a + i));
+        __m512i y = _mm512_loadu_si512((const void*) (b + i));
+        __m512i diff = _mm512_sub_epi16(_mm512_max_epi16(x, y), _mm512_min_epi16(x, y));
+        __m512i lo = _mm512_mullo_epi16(diff, diff);
+        __m512i hi = _mm512_mulhi_epu16(diff, diff);
+        __m512i sq0 = _mm512_unpacklo_epi16(lo, hi);
+        __m512i sq1 = _mm512_unpackhi_epi16(lo, hi);
+
+        acc = _mm512_add_epi64(acc, _mm512_and_si512(sq0, low32));
+        acc = _mm512_add_epi64(acc, _mm512_srli_epi64(sq0, 32));
+        acc = _mm512_add_epi64(acc, _mm512_and_si512(sq1, low32));
+        acc = _mm512_add_epi64(acc, _mm512_srli_epi64(sq1, 32));
+    }
+
+    return _mm512_reduce_add_epi64(acc) + squaredDistanceScalar(a + i, b + i, n - i);
+}
+
+#pragma GCC diagnostic pop
+
+#endif
+
+/**
+ * Function to check if the running CPU can execute a kernel.
+ * @param kernel is the kernel to check.
+ * @return true if the kernel can be used on this machine.
+ */
+inline bool isDistanceKernelSupported(DistanceKernel kernel) {
+    switch (kernel) {
+        case DistanceKernel::Scalar:
+            return true;
+#ifdef DISTANCE_X86
+        case DistanceKernel::Sse2:
+            return __builtin_cpu_supports("sse2");
+        case DistanceKernel::Avx2:
+            return __builtin_cpu_supports("avx2");
+        case DistanceKernel::Avx512:
+            return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+#endif
+        default:
+            return false;
+    }
+}
+
+/**
+ * Function to pick the widest kernel supported by the running CPU.
+ * @return the fastest available kernel.
+ */
+inline DistanceKernel bestDistanceKernel() {
+    for (DistanceKernel kernel : {DistanceKernel::Avx512, DistanceKernel::Avx2, DistanceKernel::Sse2})
+        if (isDistanceKernelSupported(kernel))
+            return kernel;
+
+    return DistanceKernel::Scalar;
+}
+
+/**
+ * Function to retrieve the implementation of a kernel.
+ * @param kernel is a kernel supported by the running CPU.
+ * @return a pointer to the kernel function.
+ */
+inline SquaredDistanceFn getSquaredDistance(DistanceKernel kernel) {
+    switch (kernel) {
+#ifdef DISTANCE_X86
+        case DistanceKernel::Sse2:
+            return squaredDistanceSse2;
+        case DistanceKernel::Avx2:
+            return squaredDistanceAvx2;
+        case DistanceKernel::Avx512:
+            return squaredDistanceAvx512;
+#endif
+        default:
+            return squaredDistanceScalar;
+    }
+}
+
+/**
+ * Number of values added between two checks of squaredDistanceBounded.
+ */
+constexpr size_t PARTIAL_DISTANCE_STEP = 256;
+
+/**
+ * Function to compute a squared distance that stops as soon as it exceeds a bound
+ * (partial distance elimination).
+ * @param squaredDistance is the kernel used for each step.
+ * @param bound is the distance above which the exact value is not needed.
+ * @return the exact distance if it is at most bound, otherwise some value larger than bound.
+ */
+inline uint64_t squaredDistanceBounded(SquaredDistanceFn squaredDistance, const short* a, const short* b, size_t n, uint64_t bound) {
+    uint64_t sum = 0;
+
+    for (size_t i = 0; i < n; i += PARTIAL_DISTANCE_STEP) {
+        sum += squaredDistance(a + i, b + i, std::min(PARTIAL_DISTANCE_STEP, n - i));
+
+        if (sum > bound)
+            return sum;
+    }
+
+    return sum;
+}
+
+/**
+ * Function to parse a kernel name given on the command line.
+ * @param name is one of scalar, sse2, avx2 or avx512.
+ * @param kernel receives the parsed kernel.
+ * @return false if the name is unknown.
+ */
+inline bool parseDistanceKernel(const std::string& name, DistanceKernel& kernel) {
+    if (name == "scalar")
+        kernel = DistanceKernel::Scalar;
+    else if (name == "sse2")
+        kernel = DistanceKernel::Sse2;
+    else if (name == "avx2")
+        kernel = DistanceKernel::Avx2;
+    else if (name == "avx512")
+        kernel = DistanceKernel::Avx512;
+    else
+        return false;
+
+    return true;
+}
+
+#endif
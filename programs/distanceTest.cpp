@@ -0,0 +1,169 @@
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include "distance.h"
+#include "kMeans.h"
+#include "matrix.h"
+#include "threadPool.h"
+
+/*
+  Verifica que todos os kernels de distância suportados pelo CPU dão exatamente os mesmos
+  valores que o escalar, com amostras aleatórias e com os valores extremos de int16, e que o
+  KMeans chega às mesmas atribuições e centroids com cada um deles.
+*/
+
+static const char* KERNEL_NAMES[] = {"scalar", "sse2", "avx2", "avx512"};
+static const DistanceKernel KERNELS[] = {DistanceKernel::Scalar, DistanceKernel::Sse2, DistanceKernel::Avx2, DistanceKernel::Avx512};
+
+/*
+  Preenche um vetor com amostras de um dos padrões do teste.
+*/
+static void fill(std::vector<short>& values, int pattern, std::mt19937_64& generator){
+    std::uniform_int_distribution<int> anySample(-32768, 32767);
+    std::uniform_int_distribution<int> anyExtreme(0, 3);
+    const short extremes[] = {-32768, 32767, 0, -1};
+
+    for(size_t i = 0; i < values.size(); i++){
+        switch(pattern){
+            case 0:
+                values[i] = (short) anySample(generator);
+                break;
+            case 1:
+                values[i] = extremes[anyExtreme(generator)];
+                break;
+            case 2:
+                values[i] = -32768;
+                break;
+            default:
+                values[i] = 32767;
+                break;
+        }
+    }
+}
+
+/*
+  Compara as distâncias de todos os kernels em vetores de vários tamanhos, para passar
+  pelas caudas escalares de cada largura de vetor.
+*/
+static size_t checkDistances(std::mt19937_64& generator){
+    size_t nFailures = 0;
+    std::vector<size_t> lengths;
+
+    for(size_t n = 0; n <= 130; n++){
+        lengths.push_back(n);
+    }
+    lengths.push_back(1000);
+    lengths.push_back(8820);
+
+    for(size_t n : lengths){
+        std::vector<short> a(n), b(n);
+
+        for(int patternA = 0; patternA < 4; patternA++){
+            for(int patternB = 0; patternB < 4; patternB++){
+                fill(a, patternA, generator);
+                fill(b, patternB, generator);
+
+                uint64_t expected = squaredDistanceScalar(a.data(), b.data(), n);
+
+                for(size_t kernel = 1; kernel < 4; kernel++){
+                    if(!isDistanceKernelSupported(KERNELS[kernel])){
+                        continue;
+                    }
+
+                    SquaredDistanceFn squaredDistance = getSquaredDistance(KERNELS[kernel]);
+                    uint64_t dist = squaredDistance(a.data(), b.data(), n);
+                    uint64_t bounded = squaredDistanceBounded(squaredDistance, a.data(), b.data(), n, expected);
+
+                    if(dist != expected || bounded != expected){
+                        std::cerr << KERNEL_NAMES[kernel] << ": distance " << dist << " (bounded " << bounded << ") instead of "
+                                  << expected << " with " << n << " samples, patterns " << patternA << " and " << patternB << std::endl;
+                        nFailures++;
+                    }
+                }
+            }
+        }
+    }
+
+    return nFailures;
+}
+
+/*
+  Agrupa os mesmos blocos com cada kernel e com os dois algoritmos e compara as atribuições
+  e os centroids com os do Lloyd escalar.
+*/
+static size_t checkKMeans(int pattern, std::mt19937_64& generator, ThreadPool& pool){
+    const size_t nBlocks = 2000, blockSize = 37, k = 16;
+    size_t nFailures = 0;
+    Matrix<short> blocks(nBlocks, blockSize);
+    std::vector<short> values(blockSize);
+
+    /*
+      Blocos à volta de alguns centros para o KMeans ter clusters a encontrar.
+    */
+    std::vector<std::vector<short>> centers(k, std::vector<short>(blockSize));
+    for(std::vector<short>& center : centers){
+        fill(center, pattern, generator);
+    }
+
+    std::uniform_int_distribution<size_t> anyCenter(0, k - 1);
+    std::uniform_int_distribution<int> noise(-2000, 2000);
+
+    for(size_t block = 0; block < nBlocks; block++){
+        const std::vector<short>& center = centers[anyCenter(generator)];
+
+        for(size_t value = 0; value < blockSize; value++){
+            int sample = center[value] + noise(generator);
+            blocks.getRow(block)[value] = (short) std::max(-32768, std::min(32767, sample));
+        }
+    }
+
+    Matrix<short> expected(k, blockSize);
+    KMeans reference(k, 50, DistanceKernel::Scalar, KMeansAlgorithm::Lloyd, 1);
+    reference.getClusters(blocks.view(), expected.view(), pool);
+
+    for(size_t kernel = 0; kernel < 4; kernel++){
+        if(!isDistanceKernelSupported(KERNELS[kernel])){
+            std::cout << "Skipping " << KERNEL_NAMES[kernel] << ", not supported by this CPU" << std::endl;
+            continue;
+        }
+
+        for(KMeansAlgorithm algorithm : {KMeansAlgorithm::Lloyd, KMeansAlgorithm::Hamerly}){
+            Matrix<short> centroids(k, blockSize);
+            KMeans km(k, 50, KERNELS[kernel], algorithm, 1);
+            km.getClusters(blocks.view(), centroids.view(), pool);
+
+            bool same = km.getAssignments() == reference.getAssignments();
+            for(size_t cluster = 0; cluster < k && same; cluster++){
+                same = std::equal(centroids.getRow(cluster), centroids.getRow(cluster) + blockSize, expected.getRow(cluster));
+            }
+
+            if(!same){
+                std::cerr << KERNEL_NAMES[kernel] << (algorithm == KMeansAlgorithm::Lloyd ? " lloyd" : " hamerly")
+                          << ": k-means differs from scalar lloyd with pattern " << pattern << std::endl;
+                nFailures++;
+            }
+        }
+    }
+
+    return nFailures;
+}
+
+int main(){
+    std::mt19937_64 generator(1);
+    ThreadPool pool(2);
+
+    size_t nFailures = checkDistances(generator);
+
+    for(int pattern = 0; pattern < 2; pattern++){
+        nFailures += checkKMeans(pattern, generator, pool);
+    }
+
+    if(nFailures > 0){
+        std::cerr << nFailures << " checks failed" << std::endl;
+        return 1;
+    }
+
+    std::cout << "All distance kernels and k-means assignments agree" << std::endl;
+    return 0;
+}
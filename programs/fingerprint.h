@@ -0,0 +1,585 @@
+#ifndef FINGERPRINT_H
+#define FINGERPRINT_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "codebookFile.h"
+#include "logMel.h"
+#include "matrix.h"
+
+/**
+ * Landmark of a signal: the hash of a pair of spectral peaks and the frame of the first one.
+ */
+struct Landmark {
+    uint32_t hash;
+    uint32_t frame;
+};
+
+/**
+ * Extraction of constellation landmarks from audio, an identification independent of codebooks.
+ *
+ * The signal is mixed to mono and resampled to SAMPLE_RATE, and its log power spectrogram is
+ * computed with frames of FFT_SIZE values every HOP values. A peak is a bin that is the maximum
+ * of its neighbourhood (PEAK_BINS bins and PEAK_FRAMES frames on each side), so there are a few
+ * per second, spread over the spectrum, and the loudest parts of the song survive noise and
+ * compression. Every peak is paired with the FAN_OUT closest peaks of its target zone (up to
+ * MAX_DELTA_FRAMES frames later and MAX_DELTA_BINS bins away), and the pair is hashed from the
+ * two frequencies and their time difference, which do not depend on where the sample starts.
+ */
+class Fingerprinter {
+    public:
+        static constexpr size_t SAMPLE_RATE = 11025;
+        static constexpr size_t FFT_SIZE = 1024;
+        static constexpr size_t HOP = 256;
+        static constexpr size_t PEAK_BINS = 12;
+        static constexpr size_t PEAK_FRAMES = 8;
+        static constexpr size_t FAN_OUT = 5;
+        static constexpr size_t MAX_DELTA_FRAMES = 63;
+        static constexpr size_t MAX_DELTA_BINS = 96;
+
+        /*
+         * Peaks below this power (|X|² / n of int16 samples) are silence.
+         */
+        static constexpr float MIN_POWER = 1.0f;
+
+    private:
+        RealFft fft;
+        std::vector<float> window;
+
+        struct Peak {
+            uint32_t frame;
+            uint32_t bin;
+        };
+
+        /*
+         * Mono signal at SAMPLE_RATE: the channels are averaged, a box filter of the decimation
+         * ratio removes most of what would alias, and the signal is linearly interpolated.
+         */
+        static std::vector<float> getSignal(const short* samples, size_t nFrames, size_t channels, size_t sampleRate) {
+            std::vector<float> mono(nFrames);
+
+            for (size_t frame = 0; frame < nFrames; frame++) {
+                float sum = 0;
+
+                for (size_t channel = 0; channel < channels; channel++)
+                    sum += samples[frame * channels + channel];
+
+                mono[frame] = sum / channels;
+            }
+
+            size_t width = std::max<size_t>(1, sampleRate / SAMPLE_RATE);
+
+            if (width > 1) {
+                std::vector<float> filtered(nFrames);
+                double sum = 0;
+
+                for (size_t frame = 0; frame < nFrames; frame++) {
+                    sum += mono[frame];
+                    if (frame >= width)
+                        sum -= mono[frame - width];
+
+                    filtered[frame] = sum / std::min(frame + 1, width);
+                }
+
+                mono.swap(filtered);
+            }
+
+            if (sampleRate == SAMPLE_RATE || nFrames == 0)
+                return mono;
+
+            double step = (double) sampleRate / SAMPLE_RATE;
+            std::vector<float> signal((size_t) ((nFrames - 1) / step) + 1);
+
+            for (size_t i = 0; i < signal.size(); i++) {
+                double position = i * step;
+                size_t frame = std::min((size_t) position, nFrames - 1);
+                double fraction = position - frame;
+
+                signal[i] = frame + 1 < nFrames ? (float) (mono[frame] * (1 - fraction) + mono[frame + 1] * fraction) : mono[frame];
+            }
+
+            return signal;
+        }
+
+        /*
+         * Hash of a pair: 9 bits for each frequency and 6 for the time difference, mixed by a
+         * bijection of 32 bits so the prefixes of the hashes are spread evenly in the index.
+         */
+        static uint32_t getHash(uint32_t bin, uint32_t targetBin, uint32_t deltaFrames) {
+            uint32_t hash = bin << 15 | targetBin << 6 | deltaFrames;
+
+            hash *= 0x9e3779b1u;
+            return hash ^ hash >> 16;
+        }
+
+    public:
+        Fingerprinter() : fft(FFT_SIZE), window(FFT_SIZE) {
+            for (size_t i = 0; i < FFT_SIZE; i++)
+                window[i] = 0.5f - 0.5f * std::cos(2 * M_PI * i / FFT_SIZE);
+        }
+
+        /**
+         * Function to extract the landmarks of interleaved 16-bit samples.
+         * @param samples are the interleaved samples.
+         * @param channels is the number of channels of the samples.
+         * @param sampleRate is the sample rate of the samples.
+         * @return the landmarks, ordered by frame.
+         */
+        std::vector<Landmark> getLandmarks(const std::vector<short>& samples, size_t channels, size_t sampleRate) const {
+            std::vector<float> signal = getSignal(samples.data(), samples.size() / channels, channels, sampleRate);
+            size_t nBins = FFT_SIZE / 2;
+            size_t nFrames = signal.size() >= FFT_SIZE ? (signal.size() - FFT_SIZE) / HOP + 1 : 0;
+
+            /*
+             * Log power spectrogram, without the DC bin, and its maximum over the frequency neighbourhoods.
+             */
+            Matrix<float> spectrogram(nFrames, nBins), frequencyMax(nFrames, nBins);
+            std::vector<float> frame(FFT_SIZE), power(nBins + 1), scratch(FFT_SIZE);
+
+            for (size_t t = 0; t < nFrames; t++) {
+                for (size_t i = 0; i < FFT_SIZE; i++)
+                    frame[i] = signal[t * HOP + i] * window[i];
+
+                fft.powerSpectrum(frame.data(), power.data(), scratch.data(), scratch.data() + FFT_SIZE / 2);
+
+                float* row = spectrogram.getRow(t);
+                for (size_t bin = 0; bin < nBins; bin++)
+                    row[bin] = power[bin + 1] > MIN_POWER ? std::log(power[bin + 1]) : -INFINITY;
+
+                for (size_t bin = 0; bin < nBins; bin++) {
+                    size_t first = bin >= PEAK_BINS ? bin - PEAK_BINS : 0, last = std::min(nBins - 1, bin + PEAK_BINS);
+                    frequencyMax.getRow(t)[bin] = *std::max_element(row + first, row + last + 1);
+                }
+            }
+
+            /*
+             * A peak is a bin that equals the maximum of its neighbourhood; of equal neighbours,
+             * only the first in time and in frequency is kept.
+             */
+            std::vector<Peak> peaks;
+
+            for (size_t t = 0; t < nFrames; t++) {
+                size_t first = t >= PEAK_FRAMES ? t - PEAK_FRAMES : 0, last = std::min(nFrames - 1, t + PEAK_FRAMES);
+
+                for (size_t bin = 0; bin < nBins; bin++) {
+                    float value = spectrogram.getRow(t)[bin];
+
+                    if (value == -INFINITY || value != frequencyMax.getRow(t)[bin])
+                        continue;
+
+                    bool isPeak = true;
+                    for (size_t other = first; other <= last && isPeak; other++) {
+                        float neighbour = frequencyMax.getRow(other)[bin];
+                        isPeak = other < t ? neighbour < value : neighbour <= value;
+                    }
+
+                    if (isPeak && (peaks.empty() || peaks.back().frame != t || peaks.back().bin + PEAK_BINS < bin))
+                        peaks.push_back({(uint32_t) t, (uint32_t) bin});
+                }
+            }
+
+            std::vector<Landmark> landmarks;
+
+            for (size_t anchor = 0; anchor < peaks.size(); anchor++) {
+                size_t nTargets = 0;
+
+                for (size_t target = anchor + 1; target < peaks.size() && nTargets < FAN_OUT; target++) {
+                    uint32_t deltaFrames = peaks[target].frame - peaks[anchor].frame;
+
+                    if (deltaFrames > MAX_DELTA_FRAMES)
+                        break;
+
+                    if (deltaFrames == 0 || (size_t) std::abs((int) peaks[target].bin - (int) peaks[anchor].bin) > MAX_DELTA_BINS)
+                        continue;
+
+                    landmarks.push_back({getHash(peaks[anchor].bin, peaks[target].bin, deltaFrames), peaks[anchor].frame});
+                    nTargets++;
+                }
+            }
+
+            return landmarks;
+        }
+};
+
+/**
+ * Inverted index of the landmarks of many songs, mapped from a single file.
+ * A sample is identified by looking up its landmarks and voting, for every song, on the frame
+ * offset between the song and the sample: the landmarks of the right song agree on one offset,
+ * the chance collisions spread over all of them. A query only reads the postings of its hashes,
+ * so its cost grows with the number of matches, not with the number of songs.
+ *
+ * The file is little-endian: a 64 byte header, then the songs (name offset, name length and
+ * frames, 16 bytes each), a directory with the first posting of every prefix of directoryBits
+ * bits of the hashes, the hashes of the postings in increasing order, the postings (song and
+ * frame of the landmark) and the song names. Every section starts at a 64 byte aligned offset,
+ * and the header has the checksum of everything after it.
+ */
+class FingerprintIndex {
+    public:
+        static constexpr uint32_t VERSION = 1;
+
+        /**
+         * Votes of a song: the landmarks of the sample that agree on its best offset.
+         */
+        struct Match {
+            size_t song;
+            size_t votes;
+            int64_t offset;
+        };
+
+    private:
+        struct Header {
+            char magic[8];
+            uint32_t version;
+            uint32_t headerSize;
+            uint32_t directoryBits;
+            uint32_t sampleRate;
+            uint64_t nSongs;
+            uint64_t nPostings;
+            uint64_t namesBytes;
+            uint64_t checksum;
+            uint64_t reserved;
+        };
+
+        struct Song {
+            uint64_t nameOffset;
+            uint32_t nameLength;
+            uint32_t nFrames;
+        };
+
+        struct Posting {
+            uint32_t song;
+            uint32_t frame;
+        };
+
+        /*
+         * Offsets of the sections, derived from the header.
+         */
+        struct Layout {
+            uint64_t songs, directory, hashes, postings, names, end;
+        };
+
+        static_assert(sizeof(Header) == 64, "the fingerprint index header must fill one cache line");
+
+        static constexpr char MAGIC[8] = {'T', 'A', 'I', 'F', 'P', 'R', 'N', 'T'};
+
+        const char* mapping = nullptr;
+        size_t mappedBytes = 0;
+        const Song* songs = nullptr;
+        const uint64_t* directory = nullptr;
+        const uint32_t* hashes = nullptr;
+        const Posting* postings = nullptr;
+        const char* names = nullptr;
+
+        void close() {
+            if (mapping != nullptr)
+                munmap(const_cast<char*>(mapping), mappedBytes);
+
+            mapping = nullptr;
+            mappedBytes = 0;
+        }
+
+        const Header& getHeader() const {
+            return *reinterpret_cast<const Header*>(mapping);
+        }
+
+        static uint64_t alignUp(uint64_t offset) {
+            return (offset + Matrix<short>::ALIGNMENT - 1) / Matrix<short>::ALIGNMENT * Matrix<short>::ALIGNMENT;
+        }
+
+        static Layout getLayout(const Header& header) {
+            Layout layout;
+
+            layout.songs = alignUp(sizeof(Header));
+            layout.directory = alignUp(layout.songs + header.nSongs * sizeof(Song));
+            layout.hashes = alignUp(layout.directory + (((uint64_t) 1 << header.directoryBits) + 1) * sizeof(uint64_t));
+            layout.postings = alignUp(layout.hashes + header.nPostings * sizeof(uint32_t));
+            layout.names = alignUp(layout.postings + header.nPostings * sizeof(Posting));
+            layout.end = layout.names + header.namesBytes;
+            return layout;
+        }
+
+    public:
+        FingerprintIndex() = default;
+
+        ~FingerprintIndex() {
+            close();
+        }
+
+        FingerprintIndex(const FingerprintIndex&) = delete;
+
+        FingerprintIndex& operator=(const FingerprintIndex&) = delete;
+
+        /**
+         * Function to map a fingerprint index and check that its sections fit in the file.
+         * Errors are reported on std::cerr.
+         * @param path is the location of the index.
+         * @return true if the index was opened.
+         */
+        bool open(const std::string& path) {
+            close();
+
+            int fd = ::open(path.c_str(), O_RDONLY);
+            struct stat status;
+
+            if (fd < 0 || fstat(fd, &status) != 0 || (size_t) status.st_size < sizeof(Header)) {
+                if (fd >= 0)
+                    ::close(fd);
+                std::cerr << "Error: could not open the fingerprint index " << path << std::endl;
+                return false;
+            }
+
+            void* map = mmap(nullptr, status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            ::close(fd);
+
+            if (map == MAP_FAILED) {
+                std::cerr << "Error: could not map the fingerprint index " << path << std::endl;
+                return false;
+            }
+
+            mapping = static_cast<const char*>(map);
+            mappedBytes = status.st_size;
+            const Header& header = getHeader();
+
+            if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 || header.version != VERSION || header.headerSize != sizeof(Header)) {
+                std::cerr << "Error: " << path << " is not a fingerprint index of a supported version" << std::endl;
+                close();
+                return false;
+            }
+
+            /*
+             * The counts are bounded by the file size first, so the layout cannot overflow.
+             */
+            bool fits = header.directoryBits <= 32 && header.nSongs <= mappedBytes / sizeof(Song) && header.nPostings <= mappedBytes / sizeof(Posting)
+                        && header.namesBytes <= mappedBytes;
+            Layout layout = fits ? getLayout(header) : Layout();
+
+            if (!fits || header.sampleRate != Fingerprinter::SAMPLE_RATE || layout.end > mappedBytes) {
+                std::cerr << "Error: truncated or corrupted fingerprint index " << path << std::endl;
+                close();
+                return false;
+            }
+
+            songs = reinterpret_cast<const Song*>(mapping + layout.songs);
+            directory = reinterpret_cast<const uint64_t*>(mapping + layout.directory);
+            hashes = reinterpret_cast<const uint32_t*>(mapping + layout.hashes);
+            postings = reinterpret_cast<const Posting*>(mapping + layout.postings);
+            names = mapping + layout.names;
+
+            /*
+             * The directory must split the postings into consecutive ranges; the songs of the
+             * postings are checked by identify, so opening does not read every posting.
+             */
+            uint64_t nPrefixes = (uint64_t) 1 << header.directoryBits;
+            bool valid = directory[0] == 0 && directory[nPrefixes] == header.nPostings;
+
+            for (uint64_t prefix = 0; prefix < nPrefixes && valid; prefix++)
+                valid = directory[prefix] <= directory[prefix + 1];
+
+            for (size_t song = 0; song < header.nSongs && valid; song++)
+                valid = songs[song].nameOffset <= header.namesBytes && songs[song].nameLength <= header.namesBytes - songs[song].nameOffset;
+
+            if (!valid) {
+                std::cerr << "Error: truncated or corrupted fingerprint index " << path << std::endl;
+                close();
+                return false;
+            }
+
+            return true;
+        }
+
+        /**
+         * Function to check everything after the header against its checksum.
+         * This reads the whole index.
+         * @return true if the index is intact.
+         */
+        bool verify() const {
+            return CodebookFile::computeChecksum(mapping + sizeof(Header), getLayout(getHeader()).end - sizeof(Header)) == getHeader().checksum;
+        }
+
+        size_t getNSongs() const {
+            return getHeader().nSongs;
+        }
+
+        size_t getNPostings() const {
+            return getHeader().nPostings;
+        }
+
+        std::string getName(size_t song) const {
+            return std::string(names + songs[song].nameOffset, songs[song].nameLength);
+        }
+
+        /**
+         * Function to get the duration of a song, in spectrogram frames.
+         */
+        size_t getNFrames(size_t song) const {
+            return songs[song].nFrames;
+        }
+
+        /**
+         * Function to vote for the songs that contain the landmarks of a sample.
+         * Postings of songs outside the index, only possible in a corrupted file, are ignored.
+         * @param landmarks are the landmarks of the sample.
+         * @return one match per song, in the order of the index.
+         */
+        std::vector<Match> identify(const std::vector<Landmark>& landmarks) const {
+            uint32_t bits = getHeader().directoryBits;
+            uint64_t nSongs = getNSongs();
+            std::vector<uint64_t> votes;
+
+            for (const Landmark& landmark : landmarks) {
+                uint64_t prefix = bits > 0 ? landmark.hash >> (32 - bits) : 0;
+                const uint32_t* first = hashes + directory[prefix];
+                const uint32_t* last = hashes + directory[prefix + 1];
+                std::pair<const uint32_t*, const uint32_t*> range = std::equal_range(first, last, landmark.hash);
+
+                /*
+                 * The offset is biased so that it sorts as an unsigned value after the song.
+                 */
+                for (const uint32_t* hash = range.first; hash != range.second; hash++) {
+                    const Posting& posting = postings[hash - hashes];
+                    if (posting.song >= nSongs)
+                        continue;
+
+                    uint64_t offset = (uint64_t) ((int64_t) posting.frame - landmark.frame + ((int64_t) 1 << 31));
+
+                    votes.push_back((uint64_t) posting.song << 32 | offset);
+                }
+            }
+
+            std::sort(votes.begin(), votes.end());
+
+            std::vector<Match> matches(getNSongs());
+            for (size_t song = 0; song < matches.size(); song++)
+                matches[song] = {song, 0, 0};
+
+            for (size_t first = 0, last; first < votes.size(); first = last) {
+                for (last = first; last < votes.size() && votes[last] == votes[first]; last++)
+                    ;
+
+                Match& match = matches[votes[first] >> 32];
+                if (last - first > match.votes) {
+                    match.votes = last - first;
+                    match.offset = (int64_t) (votes[first] & 0xffffffffu) - ((int64_t) 1 << 31);
+                }
+            }
+
+            return matches;
+        }
+
+        /**
+         * Function to write the index of the landmarks of some songs.
+         * @param path is the location of the new index.
+         * @param songNames are the names of the songs.
+         * @param songLandmarks are the landmarks of every song.
+         * @param songFrames are the durations of the songs, in spectrogram frames.
+         * @return true if the whole file was written.
+         */
+        static bool write(const std::string& path, const std::vector<std::string>& songNames, const std::vector<std::vector<Landmark>>& songLandmarks,
+                          const std::vector<size_t>& songFrames) {
+            struct Entry {
+                uint32_t hash;
+                Posting posting;
+
+                bool operator<(const Entry& other) const {
+                    return hash != other.hash ? hash < other.hash
+                         : posting.song != other.posting.song ? posting.song < other.posting.song : posting.frame < other.posting.frame;
+                }
+            };
+
+            std::vector<Entry> entries;
+
+            for (size_t song = 0; song < songLandmarks.size(); song++)
+                for (const Landmark& landmark : songLandmarks[song])
+                    entries.push_back({landmark.hash, {(uint32_t) song, landmark.frame}});
+
+            std::sort(entries.begin(), entries.end());
+
+            /*
+             * About four postings per prefix, so the search inside a prefix is short.
+             */
+            uint32_t bits = 8;
+            while (bits < 24 && ((uint64_t) 4 << bits) < entries.size())
+                bits++;
+
+            std::vector<Song> table(songNames.size());
+            std::string namesBlob;
+
+            for (size_t song = 0; song < songNames.size(); song++) {
+                table[song] = {namesBlob.size(), (uint32_t) songNames[song].size(), (uint32_t) songFrames[song]};
+                namesBlob += songNames[song];
+            }
+
+            std::vector<uint64_t> prefixes(((size_t) 1 << bits) + 1, 0);
+            std::vector<uint32_t> entryHashes(entries.size());
+            std::vector<Posting> entryPostings(entries.size());
+
+            for (size_t entry = 0; entry < entries.size(); entry++) {
+                prefixes[(entries[entry].hash >> (32 - bits)) + 1]++;
+                entryHashes[entry] = entries[entry].hash;
+                entryPostings[entry] = entries[entry].posting;
+            }
+
+            for (size_t prefix = 1; prefix < prefixes.size(); prefix++)
+                prefixes[prefix] += prefixes[prefix - 1];
+
+            Header header = {};
+            std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+            header.version = VERSION;
+            header.headerSize = sizeof(Header);
+            header.directoryBits = bits;
+            header.sampleRate = Fingerprinter::SAMPLE_RATE;
+            header.nSongs = songNames.size();
+            header.nPostings = entries.size();
+            header.namesBytes = namesBlob.size();
+
+            Layout layout = getLayout(header);
+            std::ofstream fp(path, std::ios::binary);
+            uint64_t written = sizeof(Header);
+            uint64_t checksum = CodebookFile::computeChecksum(nullptr, 0);
+
+            auto writeBytes = [&](const void* data, size_t nBytes) {
+                fp.write(static_cast<const char*>(data), nBytes);
+                checksum = CodebookFile::computeChecksum(data, nBytes, checksum);
+                written += nBytes;
+            };
+
+            auto padTo = [&](uint64_t offset) {
+                const char padding[Matrix<short>::ALIGNMENT] = {};
+                writeBytes(padding, offset - written);
+            };
+
+            fp.write(reinterpret_cast<const char*>(&header), sizeof(Header));
+
+            padTo(layout.songs);
+            writeBytes(table.data(), table.size() * sizeof(Song));
+            padTo(layout.directory);
+            writeBytes(prefixes.data(), prefixes.size() * sizeof(uint64_t));
+            padTo(layout.hashes);
+            writeBytes(entryHashes.data(), entryHashes.size() * sizeof(uint32_t));
+            padTo(layout.postings);
+            writeBytes(entryPostings.data(), entryPostings.size() * sizeof(Posting));
+            padTo(layout.names);
+            writeBytes(namesBlob.data(), namesBlob.size());
+
+            header.checksum = checksum;
+            fp.seekp(0);
+            fp.write(reinterpret_cast<const char*>(&header), sizeof(Header));
+
+            fp.close();
+            return !fp.fail();
+        }
+};
+
+#endif
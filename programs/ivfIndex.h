@@ -0,0 +1,705 @@
+#ifndef IVF_INDEX_H
+#define IVF_INDEX_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "catalogFile.h"
+#include "distance.h"
+#include "kMeans.h"
+#include "matrix.h"
+#include "threadPool.h"
+
+/**
+ * Approximate index over the centroids of every song of a catalog, to find the songs worth
+ * scoring without comparing the sample with every centroid of the catalog.
+ *
+ * The centroids are split in coarse lists (an inverted file) by their closest coarse center, and
+ * the residual of each centroid to its center is product quantized: the values are split in
+ * subspaces and every subspace stores the index of its closest codeword in one byte. A sample
+ * block visits only the nProbe lists with the closest centers, estimates its distance to their
+ * centroids from the codes, and the best estimates are re-ranked with the exact distance to the
+ * centroids in the catalog.
+ *
+ * The file is little-endian: a 64 byte header, then the coarse centers (int16 rows padded as in
+ * a codebook), the codewords (float rows of nCols values, one row per codeword with every subspace
+ * side by side), the list terms (float, nLists x nSubspaces x nCodewords), the list offsets
+ * (uint64, nLists + 1), the entries (song and row of every centroid, list after list) and the codes
+ * (nSubspaces bytes per entry). Every section starts at a 64 byte aligned offset. The header keeps
+ * the checksum of the catalog it was built from, and the checksum of everything after the header.
+ */
+class IvfIndex {
+    public:
+        static constexpr uint32_t VERSION = 1;
+
+        /**
+         * Number of centroids of each sample block re-ranked with the exact distance.
+         */
+        static constexpr size_t RERANK_CANDIDATES = 32;
+
+        /**
+         * Number of songs of each sample block, closest first after the re-ranking, kept as candidates.
+         */
+        static constexpr size_t SONGS_PER_BLOCK = 2;
+
+        /**
+         * Parameters of the index build; zero picks the default of a parameter.
+         */
+        struct Options {
+            size_t nLists = 0;            // default: the square root of the number of centroids
+            size_t nSubspaces = 0;        // default: DEFAULT_SUBSPACES, at most one per value
+            size_t nCodewords = 16;       // at most 256, so a code fits in one byte
+            size_t trainingVectors = 8192;
+            int iterations = 20;
+            uint64_t seed = 1;
+        };
+
+        static constexpr size_t DEFAULT_SUBSPACES = 64;
+
+    private:
+        struct Header {
+            char magic[8];
+            uint32_t version;
+            uint32_t headerSize;
+            uint32_t nCols;
+            uint32_t nLists;
+            uint32_t nSubspaces;
+            uint32_t nCodewords;
+            uint32_t channels;
+            uint32_t blockFrames;
+            uint64_t nEntries;
+            uint64_t catalogChecksum;
+            uint64_t checksum;
+        };
+
+        struct Entry {
+            uint32_t song;
+            uint32_t row;
+        };
+
+        /*
+         * Offsets of the sections, derived from the header.
+         */
+        struct Layout {
+            uint64_t coarse, codewords, listTerms, listOffsets, entries, codes, end;
+        };
+
+        static_assert(sizeof(Header) == 64, "the index header must fill one cache line");
+
+        static constexpr char MAGIC[8] = {'T', 'A', 'I', 'I', 'V', 'F', 'P', 'Q'};
+
+        const char* mapping = nullptr;
+        size_t mappedBytes = 0;
+        MatrixView<const short> coarse;
+        const float* codewords = nullptr;
+        const float* listTerms = nullptr;
+        const uint64_t* listOffsets = nullptr;
+        const Entry* entries = nullptr;
+        const uint8_t* codes = nullptr;
+        SquaredDistanceFn squaredDistance = getSquaredDistance(bestDistanceKernel());
+
+        void close() {
+            if (mapping != nullptr)
+                munmap(const_cast<char*>(mapping), mappedBytes);
+
+            mapping = nullptr;
+            mappedBytes = 0;
+        }
+
+        const Header& getHeader() const {
+            return *reinterpret_cast<const Header*>(mapping);
+        }
+
+        static uint64_t alignUp(uint64_t offset) {
+            return (offset + Matrix<short>::ALIGNMENT - 1) / Matrix<short>::ALIGNMENT * Matrix<short>::ALIGNMENT;
+        }
+
+        static Layout getLayout(const Header& header) {
+            uint64_t nTerms = (uint64_t) header.nLists * header.nSubspaces * header.nCodewords;
+            Layout layout;
+
+            layout.coarse = alignUp(sizeof(Header));
+            layout.codewords = alignUp(layout.coarse + (uint64_t) header.nLists * Matrix<short>::getPaddedStride(header.nCols) * sizeof(short));
+            layout.listTerms = alignUp(layout.codewords + (uint64_t) header.nCodewords * header.nCols * sizeof(float));
+            layout.listOffsets = alignUp(layout.listTerms + nTerms * sizeof(float));
+            layout.entries = alignUp(layout.listOffsets + ((uint64_t) header.nLists + 1) * sizeof(uint64_t));
+            layout.codes = alignUp(layout.entries + header.nEntries * sizeof(Entry));
+            layout.end = layout.codes + header.nEntries * header.nSubspaces;
+            return layout;
+        }
+
+        /*
+         * The values of subspace m are [getSubspaceBegin(m), getSubspaceBegin(m + 1)).
+         */
+        static size_t getSubspaceBegin(size_t subspace, size_t nCols, size_t nSubspaces) {
+            return subspace * nCols / nSubspaces;
+        }
+
+        size_t nearestList(const short* block, size_t nLists, MatrixView<const short> centers) const {
+            size_t nearest = 0;
+            uint64_t minDist = squaredDistance(block, centers.getRow(0), centers.getCols());
+
+            for (size_t list = 1; list < nLists; list++) {
+                uint64_t dist = squaredDistance(block, centers.getRow(list), centers.getCols());
+
+                if (dist < minDist) {
+                    minDist = dist;
+                    nearest = list;
+                }
+            }
+
+            return nearest;
+        }
+
+        /*
+         * Index of the codeword closest to the residual block - center in every subspace.
+         */
+        static void encode(const short* block, const short* center, const std::vector<float>& codewords,
+                           size_t nCols, size_t nSubspaces, size_t nCodewords, uint8_t* code) {
+            for (size_t subspace = 0; subspace < nSubspaces; subspace++) {
+                size_t begin = getSubspaceBegin(subspace, nCols, nSubspaces);
+                size_t end = getSubspaceBegin(subspace + 1, nCols, nSubspaces);
+                float minDist = std::numeric_limits<float>::infinity();
+                code[subspace] = 0;
+
+                for (size_t codeword = 0; codeword < nCodewords; codeword++) {
+                    const float* values = codewords.data() + codeword * nCols;
+                    float dist = 0;
+
+                    for (size_t value = begin; value < end; value++) {
+                        float diff = (float) (block[value] - center[value]) - values[value];
+                        dist += diff * diff;
+                    }
+
+                    if (dist < minDist) {
+                        minDist = dist;
+                        code[subspace] = codeword;
+                    }
+                }
+            }
+        }
+
+        /*
+         * Lloyd iterations over the residuals of the training blocks in one subspace, starting
+         * from evenly spaced training blocks. A codeword without blocks keeps its last position.
+         */
+        static void trainSubspace(MatrixView<const short> training, MatrixView<const short> centers, const std::vector<size_t>& lists,
+                                  size_t begin, size_t end, size_t nCodewords, const Options& options, std::vector<float>& codewords) {
+            size_t nCols = training.getCols();
+            size_t nTraining = training.getRows();
+            size_t width = end - begin;
+            std::vector<float> residuals(nTraining * width);
+
+            for (size_t block = 0; block < nTraining; block++)
+                for (size_t value = begin; value < end; value++)
+                    residuals[block * width + value - begin] = training.getRow(block)[value] - centers.getRow(lists[block])[value];
+
+            std::vector<float> subCodewords(nCodewords * width);
+            for (size_t codeword = 0; codeword < nCodewords; codeword++) {
+                size_t block = (codeword * nTraining / nCodewords + options.seed) % nTraining;
+                std::copy(residuals.begin() + block * width, residuals.begin() + (block + 1) * width, subCodewords.begin() + codeword * width);
+            }
+
+            std::vector<double> sums(nCodewords * width);
+            std::vector<size_t> counts(nCodewords);
+
+            for (int iteration = 0; iteration < options.iterations; iteration++) {
+                std::fill(sums.begin(), sums.end(), 0.0);
+                std::fill(counts.begin(), counts.end(), 0);
+
+                for (size_t block = 0; block < nTraining; block++) {
+                    const float* residual = residuals.data() + block * width;
+                    float minDist = std::numeric_limits<float>::infinity();
+                    size_t nearest = 0;
+
+                    for (size_t codeword = 0; codeword < nCodewords; codeword++) {
+                        const float* values = subCodewords.data() + codeword * width;
+                        float dist = 0;
+
+                        for (size_t value = 0; value < width; value++)
+                            dist += (residual[value] - values[value]) * (residual[value] - values[value]);
+
+                        if (dist < minDist) {
+                            minDist = dist;
+                            nearest = codeword;
+                        }
+                    }
+
+                    counts[nearest]++;
+                    for (size_t value = 0; value < width; value++)
+                        sums[nearest * width + value] += residual[value];
+                }
+
+                for (size_t codeword = 0; codeword < nCodewords; codeword++)
+                    if (counts[codeword] > 0)
+                        for (size_t value = 0; value < width; value++)
+                            subCodewords[codeword * width + value] = sums[codeword * width + value] / counts[codeword];
+            }
+
+            for (size_t codeword = 0; codeword < nCodewords; codeword++)
+                std::copy(subCodewords.begin() + codeword * width, subCodewords.begin() + (codeword + 1) * width,
+                          codewords.begin() + codeword * nCols + begin);
+        }
+
+    public:
+        IvfIndex() = default;
+
+        ~IvfIndex() {
+            close();
+        }
+
+        IvfIndex(const IvfIndex&) = delete;
+
+        IvfIndex& operator=(const IvfIndex&) = delete;
+
+        /**
+         * Function to know if a file starts like an index, without mapping it.
+         * @param path is the location of the file.
+         * @return true if the file has the index magic.
+         */
+        static bool isIndex(const std::string& path) {
+            std::ifstream fp(path, std::ios::binary);
+            char magic[sizeof(MAGIC)] = {};
+
+            return fp.read(magic, sizeof(magic)) && std::memcmp(magic, MAGIC, sizeof(MAGIC)) == 0;
+        }
+
+        /**
+         * Function to map an index and check that its sections fit in the file.
+         * Errors are reported on std::cerr.
+         * @param path is the location of the index.
+         * @return true if the index was opened.
+         */
+        bool open(const std::string& path) {
+            close();
+
+            int fd = ::open(path.c_str(), O_RDONLY);
+            struct stat status;
+
+            if (fd < 0 || fstat(fd, &status) != 0 || (size_t) status.st_size < sizeof(Header)) {
+                if (fd >= 0)
+                    ::close(fd);
+                std::cerr << "Error: could not open the index " << path << std::endl;
+                return false;
+            }
+
+            void* map = mmap(nullptr, status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            ::close(fd);
+
+            if (map == MAP_FAILED) {
+                std::cerr << "Error: could not map the index " << path << std::endl;
+                return false;
+            }
+
+            mapping = static_cast<const char*>(map);
+            mappedBytes = status.st_size;
+            const Header& header = getHeader();
+
+            if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 || header.version != VERSION || header.headerSize != sizeof(Header)) {
+                std::cerr << "Error: unsupported index version in " << path << std::endl;
+                close();
+                return false;
+            }
+
+            Layout layout = getLayout(header);
+
+            if (header.nLists == 0 || header.nSubspaces == 0 || header.nSubspaces > header.nCols
+                    || header.nCodewords == 0 || header.nCodewords > 256 || layout.end > mappedBytes) {
+                std::cerr << "Error: truncated or corrupted index " << path << std::endl;
+                close();
+                return false;
+            }
+
+            coarse = MatrixView<const short>(reinterpret_cast<const short*>(mapping + layout.coarse), header.nLists,
+                                             header.nCols, Matrix<short>::getPaddedStride(header.nCols));
+            codewords = reinterpret_cast<const float*>(mapping + layout.codewords);
+            listTerms = reinterpret_cast<const float*>(mapping + layout.listTerms);
+            listOffsets = reinterpret_cast<const uint64_t*>(mapping + layout.listOffsets);
+            entries = reinterpret_cast<const Entry*>(mapping + layout.entries);
+            codes = reinterpret_cast<const uint8_t*>(mapping + layout.codes);
+
+            for (size_t list = 0; list < header.nLists; list++) {
+                if (listOffsets[list] > listOffsets[list + 1]) {
+                    std::cerr << "Error: truncated or corrupted index " << path << std::endl;
+                    close();
+                    return false;
+                }
+            }
+
+            if (listOffsets[0] != 0 || listOffsets[header.nLists] != header.nEntries) {
+                std::cerr << "Error: truncated or corrupted index " << path << std::endl;
+                close();
+                return false;
+            }
+
+            return true;
+        }
+
+        /**
+         * Function to check everything after the header against its checksum.
+         * This reads the whole index.
+         * @return true if the index is intact.
+         */
+        bool verify() const {
+            return CodebookFile::computeChecksum(mapping + sizeof(Header), getLayout(getHeader()).end - sizeof(Header)) == getHeader().checksum;
+        }
+
+        /**
+         * Function to know if the index was built from a catalog, so its entries point to the same songs.
+         * @param catalog is an open catalog.
+         * @return true if the catalog is the one indexed.
+         */
+        bool isBuiltFrom(const CatalogFile& catalog) const {
+            return getHeader().catalogChecksum == catalog.getChecksum();
+        }
+
+        size_t getNLists() const {
+            return getHeader().nLists;
+        }
+
+        size_t getNSubspaces() const {
+            return getHeader().nSubspaces;
+        }
+
+        size_t getNCodewords() const {
+            return getHeader().nCodewords;
+        }
+
+        size_t getNEntries() const {
+            return getHeader().nEntries;
+        }
+
+        size_t getChannels() const {
+            return getHeader().channels;
+        }
+
+        size_t getBlockFrames() const {
+            return getHeader().blockFrames;
+        }
+
+        /**
+         * Function to find the songs with centroids close to the blocks of a sample.
+         * Every sample block is compared with the coarse centers, the centroids of its nProbe closest
+         * lists are ranked by their estimated distance, the best RERANK_CANDIDATES of them are re-ranked
+         * with their exact distance, and the songs of the SONGS_PER_BLOCK closest ones are kept.
+         * A larger nProbe visits more centroids: a better recall for a slower query.
+         * @param sampleBlocks are the blocks of the sample, with as many values as the indexed centroids.
+         * @param catalog is the catalog the index was built from.
+         * @param nProbe is the number of lists visited by every sample block.
+         * @param pool runs the sample blocks in parallel.
+         * @return the candidate songs, in the order of the catalog.
+         */
+        std::vector<size_t> getCandidates(MatrixView<const short> sampleBlocks, const CatalogFile& catalog, size_t nProbe, ThreadPool& pool) const {
+            const Header& header = getHeader();
+            size_t nCols = header.nCols;
+            size_t nLists = header.nLists;
+            size_t nSubspaces = header.nSubspaces;
+            size_t nCodewords = header.nCodewords;
+            size_t nTerms = nSubspaces * nCodewords;
+
+            nProbe = std::max<size_t>(1, std::min(nProbe, nLists));
+
+            struct Scratch {
+                std::vector<std::pair<uint64_t, size_t>> lists;
+                std::vector<float> innerProducts, table;
+                std::vector<std::pair<float, uint64_t>> shortlist;
+                std::vector<std::pair<uint64_t, size_t>> reranked;
+            };
+
+            std::vector<Scratch> scratches(pool.getNThreads());
+            std::vector<std::vector<size_t>> blockSongs(sampleBlocks.getRows());
+
+            pool.parallelFor(sampleBlocks.getRows(), [&](size_t block, size_t thread) {
+                Scratch& scratch = scratches[thread];
+                const short* sampleBlock = sampleBlocks.getRow(block);
+
+                scratch.lists.resize(nLists);
+                for (size_t list = 0; list < nLists; list++)
+                    scratch.lists[list] = std::make_pair(squaredDistance(sampleBlock, coarse.getRow(list), nCols), list);
+
+                std::partial_sort(scratch.lists.begin(), scratch.lists.begin() + nProbe, scratch.lists.end());
+
+                /*
+                 * ‖x - c - p‖² = ‖x - c‖² + (‖p‖² + 2<c, p>) - 2<x, p>: the middle term only depends on
+                 * the list and is stored in the index, and <x, p> is computed once per sample block.
+                 */
+                scratch.innerProducts.assign(nTerms, 0.0f);
+                for (size_t subspace = 0; subspace < nSubspaces; subspace++) {
+                    size_t begin = getSubspaceBegin(subspace, nCols, nSubspaces);
+                    size_t end = getSubspaceBegin(subspace + 1, nCols, nSubspaces);
+
+                    for (size_t codeword = 0; codeword < nCodewords; codeword++) {
+                        const float* values = codewords + codeword * nCols;
+                        float sum = 0;
+
+                        for (size_t value = begin; value < end; value++)
+                            sum += sampleBlock[value] * values[value];
+
+                        scratch.innerProducts[subspace * nCodewords + codeword] = sum;
+                    }
+                }
+
+                scratch.shortlist.clear();
+                scratch.table.resize(nTerms);
+
+                for (size_t probe = 0; probe < nProbe; probe++) {
+                    size_t list = scratch.lists[probe].second;
+                    const float* terms = listTerms + list * nTerms;
+
+                    for (size_t term = 0; term < nTerms; term++)
+                        scratch.table[term] = terms[term] - 2 * scratch.innerProducts[term];
+
+                    for (uint64_t entry = listOffsets[list]; entry < listOffsets[list + 1]; entry++) {
+                        const uint8_t* code = codes + entry * nSubspaces;
+                        float dist = scratch.lists[probe].first;
+
+                        for (size_t subspace = 0; subspace < nSubspaces; subspace++)
+                            dist += scratch.table[subspace * nCodewords + code[subspace]];
+
+                        if (scratch.shortlist.size() < RERANK_CANDIDATES) {
+                            scratch.shortlist.emplace_back(dist, entry);
+                            std::push_heap(scratch.shortlist.begin(), scratch.shortlist.end());
+                        }
+                        else if (dist < scratch.shortlist.front().first) {
+                            std::pop_heap(scratch.shortlist.begin(), scratch.shortlist.end());
+                            scratch.shortlist.back() = std::make_pair(dist, entry);
+                            std::push_heap(scratch.shortlist.begin(), scratch.shortlist.end());
+                        }
+                    }
+                }
+
+                scratch.reranked.clear();
+                for (const std::pair<float, uint64_t>& candidate : scratch.shortlist) {
+                    const Entry& entry = entries[candidate.second];
+
+                    if (entry.song >= catalog.getNSongs() || entry.row >= catalog.getCentroids(entry.song).getRows())
+                        continue;
+
+                    uint64_t dist = squaredDistance(sampleBlock, catalog.getCentroids(entry.song).getRow(entry.row), nCols);
+                    scratch.reranked.emplace_back(dist, entry.song);
+                }
+
+                std::sort(scratch.reranked.begin(), scratch.reranked.end());
+
+                for (const std::pair<uint64_t, size_t>& candidate : scratch.reranked) {
+                    std::vector<size_t>& songs = blockSongs[block];
+
+                    if (songs.size() == SONGS_PER_BLOCK)
+                        break;
+                    if (std::find(songs.begin(), songs.end(), candidate.second) == songs.end())
+                        songs.push_back(candidate.second);
+                }
+            });
+
+            std::vector<char> isCandidate(catalog.getNSongs());
+            for (const std::vector<size_t>& songs : blockSongs)
+                for (size_t song : songs)
+                    isCandidate[song] = 1;
+
+            std::vector<size_t> candidates;
+            for (size_t song = 0; song < isCandidate.size(); song++)
+                if (isCandidate[song])
+                    candidates.push_back(song);
+
+            return candidates;
+        }
+
+        /**
+         * Function to build the index of a catalog and write it.
+         * Every song of the catalog must have the same channels and block size, and the same
+         * features (samples, or log-mel bands of the same sample rate).
+         * The coarse centers are trained with k-means on evenly spaced centroids of the catalog, and
+         * the codewords with k-means on the residuals of the same centroids, one subspace per task.
+         * Errors are reported on std::cerr.
+         * @param catalog is the open catalog.
+         * @param path is the location of the new index.
+         * @param options are the parameters of the index.
+         * @param pool runs the training and the encoding in parallel.
+         * @return true if the whole index was written.
+         */
+        static bool build(const CatalogFile& catalog, const std::string& path, Options options, ThreadPool& pool) {
+            size_t nSongs = catalog.getNSongs();
+
+            if (nSongs == 0) {
+                std::cerr << "Error: the catalog has no songs" << std::endl;
+                return false;
+            }
+
+            CodebookInfo info = catalog.getInfo(0);
+            size_t nCols = catalog.getCentroids(0).getCols();
+            std::vector<uint64_t> firstRows(nSongs + 1, 0);
+
+            for (size_t song = 0; song < nSongs; song++) {
+                CodebookInfo songInfo = catalog.getInfo(song);
+
+                if (songInfo.channels != info.channels || songInfo.blockFrames != info.blockFrames || catalog.getCentroids(song).getCols() != nCols
+                        || songInfo.melBands != info.melBands || (info.melBands > 0 && songInfo.sampleRate != info.sampleRate)) {
+                    std::cerr << "Error: " << catalog.getName(song) << " does not have the channels, block size and features of "
+                              << catalog.getName(0) << ", every song of an index must have the same" << std::endl;
+                    return false;
+                }
+
+                firstRows[song + 1] = firstRows[song] + catalog.getCentroids(song).getRows();
+            }
+
+            size_t nEntries = firstRows[nSongs];
+
+            if (nEntries == 0 || nCols == 0) {
+                std::cerr << "Error: the catalog has no centroids" << std::endl;
+                return false;
+            }
+
+            size_t nTraining = std::min(std::max<size_t>(options.trainingVectors, 1), nEntries);
+            size_t nLists = options.nLists > 0 ? options.nLists : std::max<size_t>(1, std::sqrt((double) nEntries));
+            size_t nSubspaces = options.nSubspaces > 0 ? options.nSubspaces : DEFAULT_SUBSPACES;
+            size_t nCodewords = options.nCodewords > 0 ? options.nCodewords : Options().nCodewords;
+
+            nLists = std::min(nLists, nTraining);
+            nSubspaces = std::min(nSubspaces, nCols);
+            nCodewords = std::min<size_t>(std::min<size_t>(nCodewords, 256), nTraining);
+
+            auto getRow = [&](uint64_t index) {
+                size_t song = std::upper_bound(firstRows.begin(), firstRows.end(), index) - firstRows.begin() - 1;
+                return std::make_pair(song, (size_t) (index - firstRows[song]));
+            };
+
+            Matrix<short> training(nTraining, nCols);
+            for (size_t block = 0; block < nTraining; block++) {
+                std::pair<size_t, size_t> row = getRow(block * nEntries / nTraining);
+                const short* values = catalog.getCentroids(row.first).getRow(row.second);
+                std::copy(values, values + nCols, training.getRow(block));
+            }
+
+            Matrix<short> centers(nLists, nCols);
+            KMeans(nLists, options.iterations, bestDistanceKernel(), KMeansAlgorithm::Lloyd, options.seed).getClusters(training.view(), centers.view(), pool);
+
+            IvfIndex searcher;
+            std::vector<size_t> trainingLists(nTraining);
+            pool.parallelFor(nTraining, [&](size_t block, size_t) {
+                trainingLists[block] = searcher.nearestList(training.getRow(block), nLists, centers.view());
+            });
+
+            std::vector<float> codewords(nCodewords * nCols);
+            pool.parallelFor(nSubspaces, [&](size_t subspace, size_t) {
+                trainSubspace(training.view(), centers.view(), trainingLists, getSubspaceBegin(subspace, nCols, nSubspaces),
+                              getSubspaceBegin(subspace + 1, nCols, nSubspaces), nCodewords, options, codewords);
+            });
+
+            size_t nTerms = nSubspaces * nCodewords;
+            std::vector<float> terms(nLists * nTerms);
+            pool.parallelFor(nLists, [&](size_t list, size_t) {
+                const short* center = centers.getRow(list);
+
+                for (size_t subspace = 0; subspace < nSubspaces; subspace++) {
+                    for (size_t codeword = 0; codeword < nCodewords; codeword++) {
+                        const float* values = codewords.data() + codeword * nCols;
+                        float term = 0;
+
+                        for (size_t value = getSubspaceBegin(subspace, nCols, nSubspaces); value < getSubspaceBegin(subspace + 1, nCols, nSubspaces); value++)
+                            term += values[value] * values[value] + 2 * center[value] * values[value];
+
+                        terms[list * nTerms + subspace * nCodewords + codeword] = term;
+                    }
+                }
+            });
+
+            std::vector<uint32_t> entryLists(nEntries);
+            std::vector<uint8_t> entryCodes(nEntries * nSubspaces);
+            pool.parallelFor(nSongs, [&](size_t song, size_t) {
+                MatrixView<const short> rows = catalog.getCentroids(song);
+
+                for (size_t row = 0; row < rows.getRows(); row++) {
+                    uint64_t index = firstRows[song] + row;
+                    size_t list = searcher.nearestList(rows.getRow(row), nLists, centers.view());
+
+                    entryLists[index] = list;
+                    encode(rows.getRow(row), centers.getRow(list), codewords, nCols, nSubspaces, nCodewords, entryCodes.data() + index * nSubspaces);
+                }
+            });
+
+            /*
+             * Counting sort of the centroids by list, keeping the catalog order inside a list.
+             */
+            std::vector<uint64_t> offsets(nLists + 1, 0);
+            for (uint32_t list : entryLists)
+                offsets[list + 1]++;
+            for (size_t list = 0; list < nLists; list++)
+                offsets[list + 1] += offsets[list];
+
+            std::vector<uint64_t> order(nEntries);
+            std::vector<uint64_t> next(offsets.begin(), offsets.end() - 1);
+            for (uint64_t index = 0; index < nEntries; index++)
+                order[next[entryLists[index]]++] = index;
+
+            Header header = {};
+            std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+            header.version = VERSION;
+            header.headerSize = sizeof(Header);
+            header.nCols = nCols;
+            header.nLists = nLists;
+            header.nSubspaces = nSubspaces;
+            header.nCodewords = nCodewords;
+            header.channels = info.channels;
+            header.blockFrames = info.blockFrames;
+            header.nEntries = nEntries;
+            header.catalogChecksum = catalog.getChecksum();
+
+            Layout layout = getLayout(header);
+            std::ofstream fp(path, std::ios::binary);
+            uint64_t written = sizeof(Header);
+            uint64_t checksum = CodebookFile::computeChecksum(nullptr, 0);
+
+            auto writeBytes = [&](const void* data, size_t nBytes) {
+                fp.write(static_cast<const char*>(data), nBytes);
+                checksum = CodebookFile::computeChecksum(data, nBytes, checksum);
+                written += nBytes;
+            };
+
+            auto padTo = [&](uint64_t offset) {
+                const char padding[Matrix<short>::ALIGNMENT] = {};
+                writeBytes(padding, offset - written);
+            };
+
+            fp.write(reinterpret_cast<const char*>(&header), sizeof(Header));
+
+            padTo(layout.coarse);
+            writeBytes(centers.getRow(0), nLists * centers.getStride() * sizeof(short));
+            padTo(layout.codewords);
+            writeBytes(codewords.data(), codewords.size() * sizeof(float));
+            padTo(layout.listTerms);
+            writeBytes(terms.data(), terms.size() * sizeof(float));
+            padTo(layout.listOffsets);
+            writeBytes(offsets.data(), offsets.size() * sizeof(uint64_t));
+            padTo(layout.entries);
+
+            for (uint64_t index : order) {
+                std::pair<size_t, size_t> row = getRow(index);
+                Entry entry = {(uint32_t) row.first, (uint32_t) row.second};
+                writeBytes(&entry, sizeof(Entry));
+            }
+
+            padTo(layout.codes);
+            for (uint64_t index : order)
+                writeBytes(entryCodes.data() + index * nSubspaces, nSubspaces);
+
+            header.checksum = checksum;
+            fp.seekp(0);
+            fp.write(reinterpret_cast<const char*>(&header), sizeof(Header));
+
+            fp.close();
+            return !fp.fail();
+        }
+};
+
+#endif
@@ -1,233 +1,624 @@
-#include "cluster.h"
+#ifndef KMEANS_H
+#define KMEANS_H
+
+#include "matrix.h"
+#include "distance.h"
+#include "threadPool.h"
 #include <algorithm>
-#include <thread>
-#include <pthread.h>
-#include <mutex>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+/*
+  Lloyd calcula sempre a distância de cada ponto a todos os centroids.
+  Hamerly guarda limites para cada ponto e salta os pontos que não podem mudar de cluster,
+  chegando exatamente aos mesmos centroids que Lloyd.
+*/
+enum class KMeansAlgorithm { Lloyd, Hamerly };
 
 class KMeans{
 
 
     private:
-        std::vector<Cluster> clusters;
-        std::vector<Point> points; 
+        /*
+          Número de pontos em cada tarefa da pool, pequeno para as threads livres poderem roubar trabalho.
+        */
+        static constexpr size_t POINTS_PER_CHUNK = 8;
+
+        /*
+          Índice do cluster de cada ponto, NO_CLUSTER enquanto o ponto não tem cluster.
+        */
+        static constexpr size_t NO_CLUSTER = SIZE_MAX;
+        std::vector<size_t> assignments;
+        /*
+          Somas e contagens parciais por cluster, uma cópia (k x D e k) por thread.
+        */
+        std::vector<std::vector<int64_t>> sums;
+        std::vector<std::vector<size_t>> counts;
+        /*
+          Vistas (não são donas da memória) sobre a matriz N x D dos blocos
+          e a matriz K x D dos centroids.
+        */
+        MatrixView<const short> blocks;
+        MatrixView<short> centroids;
         size_t blockSize, k;
         int iterations;
-        bool done;
-        std::mutex m;
-    
-    public:
+        KMeansAlgorithm algorithm;
+        SquaredDistanceFn squaredDistance;
+        std::atomic<size_t> changed;
+        int completedIterations = 0;
+
+        /*
+          Inicialização k-means||: SEEDING_ROUNDS rondas em que cada ponto é escolhido como
+          candidato com probabilidade proporcional à distância ao quadrado aos candidatos
+          anteriores, seguidas de um k-means++ pesado sobre os candidatos.
+        */
+        static constexpr size_t SEEDING_ROUNDS = 5;
+        uint64_t seed;
+
+        /*
+          Estado do Hamerly: limite superior da distância de cada ponto ao seu centroid,
+          limite inferior da distância ao segundo mais próximo, quanto cada centroid se
+          moveu na última iteração e metade da distância ao centroid vizinho mais próximo.
+          As comparações usam uma pequena margem para os erros de arredondamento nunca
+          deixarem saltar um ponto que Lloyd mudaria de cluster.
+        */
+        static constexpr double BOUND_MARGIN = 1e-9;
+        std::vector<double> upper, lower;
+        std::vector<double> drift, halfGap;
+        std::vector<uint64_t> centroidDistances;
+        double maxDrift, secondMaxDrift;
+        size_t maxDriftCluster;
+
+        /*
+          Gerador sem estado (splitmix64): o número depende só da semente, da ronda e do ponto,
+          por isso a inicialização é a mesma com qualquer número de threads.
+        */
+        uint64_t randomHash(uint64_t round, uint64_t index){
+            uint64_t x = seed + 0x9e3779b97f4a7c15ULL * (round + 1) + 0xd1b54a32d192ed03ULL * index;
+
+            for(int i = 0; i < 2; i++){
+                x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+                x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+                x ^= x >> 31;
+            }
+
+            return x;
+        }
+
+        /*
+          Número uniforme em [0, 1).
+        */
+        double randomUniform(uint64_t round, uint64_t index){
+            return (randomHash(round, index) >> 11) * (1.0 / 9007199254740992.0);
+        }
 
         /*
-            Dado uma posição de ínicio e uma de fim calcula
-            os clusters a que os pontos nessa gama pretencem.
+          Escolhe os k centroids iniciais com k-means|| e copia-os para a matriz de centroids.
         */
-        void updateNearestCluster(size_t start, size_t end){
+        void seedCentroids(ThreadPool& pool){
+            size_t nPoints = blocks.getRows();
+            size_t nChunks = (nPoints + POINTS_PER_CHUNK - 1) / POINTS_PER_CHUNK;
+
+            std::vector<size_t> candidates;
+            std::vector<bool> isCandidate(nPoints, false);
+            std::vector<uint64_t> minDist(nPoints, std::numeric_limits<uint64_t>::max());
+            std::vector<size_t> nearestCandidate(nPoints, 0);
+            std::vector<uint64_t> chunkCost(nChunks);
+            uint64_t cost = 0;
+
             /*
-               Calcula a distância a todos os centroids
+              Atualiza a distância de cada ponto ao candidato mais próximo com os candidatos
+              a partir de first, e o custo total (soma exata, não depende da ordem).
             */
-            for(size_t point = start; point < end; point++){
+            auto addCandidates = [&](size_t first){
+                pool.parallelFor(nChunks, [&](size_t chunk, size_t){
+                    size_t end = std::min((chunk + 1) * POINTS_PER_CHUNK, nPoints);
+                    uint64_t sum = 0;
+
+                    for(size_t point = chunk * POINTS_PER_CHUNK; point < end; point++){
+                        for(size_t candidate = first; candidate < candidates.size(); candidate++){
+                            uint64_t dist = squaredDistance(blocks.getRow(candidates[candidate]), blocks.getRow(point), blockSize);
+
+                            if(dist < minDist[point]){
+                                minDist[point] = dist;
+                                nearestCandidate[point] = candidate;
+                            }
+                        }
+                        sum += minDist[point];
+                    }
 
-                double min_dist, sum = 0.0, dist;
-                
-                for(size_t position = 0; position < blockSize; position++){
+                    chunkCost[chunk] = sum;
+                });
 
-                    sum += pow(clusters[0].getCentroidByPos(position) - points[point].getBlockByValue(position), 2.0);
-                
+                cost = 0;
+                for(size_t chunk = 0; chunk < nChunks; chunk++){
+                    cost += chunkCost[chunk];
                 }
-                min_dist = sqrt(sum);
-                size_t nearestClusterId = clusters[0].getId();
+            };
+
+            size_t first = randomHash(0, 0) % nPoints;
+            candidates.push_back(first);
+            isCandidate[first] = true;
+            addCandidates(0);
+
+            double oversampling = 0.5 * k;
 
-                for(size_t cluster = 1; cluster < k; cluster ++){
-                    
-                    sum = 0.0;
-                    
-                    for(size_t position = 0; position < blockSize; position++){
-                        
-                        sum += pow(clusters[cluster].getCentroidByPos(position) - points[point].getBlockByValue(position), 2);
+            for(size_t round = 1; round <= SEEDING_ROUNDS && cost > 0; round++){
+                size_t firstNew = candidates.size();
+
+                for(size_t point = 0; point < nPoints; point++){
+                    if(randomUniform(round, point) * cost < oversampling * minDist[point]){
+                        candidates.push_back(point);
+                        isCandidate[point] = true;
                     }
+                }
 
-                    dist = sqrt(sum);
-                    
-                    if(dist < min_dist){
-                        min_dist = dist;
-                        nearestClusterId = clusters[cluster].getId();
+                addCandidates(firstNew);
+            }
+
+            /*
+              Se houver menos candidatos que clusters (por exemplo muitos blocos iguais)
+              completa com os primeiros pontos que ainda não são candidatos.
+            */
+            if(candidates.size() < k){
+                size_t firstNew = candidates.size();
+
+                for(size_t point = 0; point < nPoints && candidates.size() < k; point++){
+                    if(!isCandidate[point]){
+                        candidates.push_back(point);
+                        isCandidate[point] = true;
                     }
                 }
-                size_t previousClusterId = points[point].getClusterId();
+
+                addCandidates(firstNew);
+            }
+
+            /*
+              O peso de cada candidato é o número de pontos que lhe estão mais próximos.
+            */
+            size_t nCandidates = candidates.size();
+            std::vector<double> weights(nCandidates, 0.0);
+            for(size_t point = 0; point < nPoints; point++){
+                weights[nearestCandidate[point]] += 1.0;
+            }
+
+            /*
+              k-means++ pesado sobre os candidatos.
+            */
+            std::vector<uint64_t> candidateDist(nCandidates, std::numeric_limits<uint64_t>::max());
+            std::vector<bool> chosen(nCandidates, false);
+            size_t candidateChunks = (nCandidates + POINTS_PER_CHUNK - 1) / POINTS_PER_CHUNK;
+            size_t next = nCandidates - 1;
+
+            double totalWeight = 0.0;
+            for(size_t candidate = 0; candidate < nCandidates; candidate++){
+                totalWeight += weights[candidate];
+            }
+
+            double target = randomUniform(SEEDING_ROUNDS + 1, 0) * totalWeight;
+            for(size_t candidate = 0; candidate < nCandidates; candidate++){
+                if(weights[candidate] > 0 && (target -= weights[candidate]) < 0){
+                    next = candidate;
+                    break;
+                }
+            }
+
+            for(size_t i = 0; i < k; i++){
+                size_t point = candidates[next];
+
+                chosen[next] = true;
+                std::copy(blocks.getRow(point), blocks.getRow(point) + blockSize, centroids.getRow(i));
+                assignments[point] = i;
+
+                if(i + 1 == k){
+                    break;
+                }
+
+                pool.parallelFor(candidateChunks, [&](size_t chunk, size_t){
+                    size_t end = std::min((chunk + 1) * POINTS_PER_CHUNK, nCandidates);
+
+                    for(size_t candidate = chunk * POINTS_PER_CHUNK; candidate < end; candidate++){
+                        uint64_t dist = squaredDistance(blocks.getRow(point), blocks.getRow(candidates[candidate]), blockSize);
+                        candidateDist[candidate] = std::min(candidateDist[candidate], dist);
+                    }
+                });
+
                 /*
-                    Verifica se o ponto mudou de cluster, se o fez tem de atualizar o clusterId no ponto
-                    e alterar também o array de pontos nos dois clusters.
+                  Escolhe o próximo com probabilidade proporcional a peso x distância ao quadrado.
+                  Se todos os candidatos restantes coincidirem com os escolhidos usa o primeiro livre.
                 */
-                if(nearestClusterId != previousClusterId){
-                    if(previousClusterId != 0){
-                        for(size_t cluster = 0; cluster < k; cluster++){
-                            if(clusters[cluster].getId() == previousClusterId){
-                                m.lock();
-                                clusters[cluster].removePoint(point) ;
-                                m.unlock();
-                            }
-                        }
+                double total = 0.0;
+                for(size_t candidate = 0; candidate < nCandidates; candidate++){
+                    if(!chosen[candidate]){
+                        total += weights[candidate] * candidateDist[candidate];
                     }
+                }
+
+                next = std::find(chosen.begin(), chosen.end(), false) - chosen.begin();
+                target = randomUniform(SEEDING_ROUNDS + 2, i) * total;
+
+                for(size_t candidate = 0; candidate < nCandidates && total > 0; candidate++){
+                    double score = chosen[candidate] ? 0.0 : weights[candidate] * candidateDist[candidate];
 
-                    for(size_t cluster = 0; cluster < k; cluster++){
-                        if(clusters[cluster].getId() == nearestClusterId){
-                            m.lock();
-                            clusters[cluster].addPoint(point);
-                            m.unlock();
-                            points[point].setClusterId(nearestClusterId);
-                            
-                        }
-                    } 
                     /*
-                      Indica que houve uma alteração de cluster
+                      Se o arredondamento deixar sobrar um resto fica o último candidato possível.
                     */
-                    this->done = false;
+                    if(score > 0){
+                        next = candidate;
+                        if((target -= score) < 0){
+                            break;
+                        }
+                    }
                 }
-            };
+            }
         }
 
         /*
-          Dado um ponto de ínicio e um de fim atualiza todos os centroids
-          presentes nessa gama.
+          Soma o bloco às somas do cluster na thread.
         */
-        void updateCentroids(size_t start, size_t end){
+        void accumulate(size_t thread, const short* block, size_t cluster){
+            int64_t* clusterSums = sums[thread].data() + cluster * blockSize;
 
-            /*
-              Para cada cluster, vai pegar em todos os pontos que lhe pertencem e
-              calcular a média da distância em cada entrada dele.
-            */
-            for(size_t cluster = start; cluster < end; cluster++){
-
-                size_t clusterNBlocks = clusters[cluster].getNBlocks();
-                
+            if(counts[thread][cluster]++ == 0){
+                std::copy(block, block + blockSize, clusterSums);
+            }
+            else{
                 for(size_t value = 0; value < blockSize; value++){
-                    
-                    double sum = 0.0;
+                    clusterSums[value] += block[value];
+                }
+            }
+        }
 
-                    if(clusterNBlocks > 0){
-                        
-                        for(size_t block = 0; block < clusterNBlocks; block++){
+        /*
+          Procura o centroid mais próximo do bloco (em caso de empate fica o de menor índice)
+          e devolve também a distância ao segundo mais próximo.
+        */
+        size_t nearestCluster(const short* block, uint64_t& minDist, uint64_t& secondDist){
+            size_t nearest = 0;
 
-                            sum += points[clusters[cluster].getBlock(block)].getBlockByValue(value);
-                            
-                        }
+            minDist = squaredDistance(centroids.getRow(0), block, blockSize);
+            secondDist = std::numeric_limits<uint64_t>::max();
+
+            for(size_t cluster = 1; cluster < k; cluster++){
+
+                uint64_t dist = squaredDistance(centroids.getRow(cluster), block, blockSize);
+
+                if(dist < minDist){
+                    secondDist = minDist;
+                    minDist = dist;
+                    nearest = cluster;
+                }
+                else if(dist < secondDist){
+                    secondDist = dist;
+                }
+            }
+
+            return nearest;
+        }
+
+        /*
+          Calcula, para cada centroid, metade da distância ao centroid mais próximo.
+        */
+        void updateHalfGaps(ThreadPool& pool){
 
-                        clusters[cluster].setCentroidByPos(value, sum / clusterNBlocks);
+            pool.parallelFor(k, [&](size_t cluster, size_t){
+                for(size_t other = cluster + 1; other < k; other++){
+                    centroidDistances[cluster * k + other] = squaredDistance(centroids.getRow(cluster), centroids.getRow(other), blockSize);
+                }
+            });
+
+            for(size_t cluster = 0; cluster < k; cluster++){
+                uint64_t minDist = std::numeric_limits<uint64_t>::max();
+
+                for(size_t other = 0; other < k; other++){
+                    if(other != cluster){
+                        minDist = std::min(minDist, centroidDistances[std::min(cluster, other) * k + std::max(cluster, other)]);
                     }
                 }
+
+                halfGap[cluster] = k > 1 ? 0.5 * std::sqrt((double) minDist) : std::numeric_limits<double>::infinity();
             }
         }
 
-        KMeans(size_t k, int iterations){
-            this->k = k;
-            this->iterations = iterations;
-        }       
+        /*
+          Guarda o maior e o segundo maior deslocamento dos centroids, para atualizar os limites inferiores.
+        */
+        void updateMaxDrift(){
+            maxDrift = 0.0;
+            secondMaxDrift = 0.0;
+            maxDriftCluster = 0;
+
+            for(size_t cluster = 0; cluster < k; cluster++){
+                if(drift[cluster] > maxDrift){
+                    secondMaxDrift = maxDrift;
+                    maxDrift = drift[cluster];
+                    maxDriftCluster = cluster;
+                }
+                else if(drift[cluster] > secondMaxDrift){
+                    secondMaxDrift = drift[cluster];
+                }
+            }
+        }
+
+    public:
 
-        std::vector<std::vector<short>> getClusters(std::vector<std::vector<short>> blocks, int nThreads){
-            
-            std::thread threads[nThreads];    
+        /*
+            Dado uma posição de ínicio e uma de fim calcula os clusters a que os
+            pontos nessa gama pretencem e acumula cada ponto nas somas da thread.
+        */
+        void assignAndAccumulate(size_t thread, size_t start, size_t end){
+            size_t threadChanged = 0;
 
-            blockSize = blocks[0].size();
             /*
-              Adiciona os blocos como sendo pontos
+               Calcula a distância a todos os centroids
             */
+            for(size_t point = start; point < end; point++){
 
-            for(size_t i = 0; i < blocks.size(); i++){
-                Point p(blocks[i], i);
-                points.push_back(p);
+                const short* block = blocks.getRow(point);
+                /*
+                  Compara as distâncias ao quadrado, a raiz não altera qual é o mais próximo
+                */
+                uint64_t minDist, secondDist;
+                size_t nearest = nearestCluster(block, minDist, secondDist);
+
+                /*
+                  Cada ponto só é escrito pela thread que o processa, não é preciso sincronizar.
+                */
+                if(nearest != assignments[point]){
+                    assignments[point] = nearest;
+                    threadChanged++;
+                }
+
+                accumulate(thread, block, nearest);
             }
 
             /*
-              Inicializa os Clusters.
+              Indica quantos pontos mudaram de cluster
             */
+            changed += threadChanged;
+        }
 
-            
-            srand(time(NULL));
+        /*
+            Versão Hamerly de assignAndAccumulate. Na primeira iteração calcula todas as distâncias
+            para inicializar os limites, nas seguintes só as calcula para os pontos cujos limites
+            não garantem que o centroid atual continua a ser o mais próximo.
+        */
+        void assignAndAccumulateHamerly(size_t thread, size_t start, size_t end, bool firstIteration){
+            size_t threadChanged = 0;
 
-            std::vector<size_t> usedPoints;
-            
+            for(size_t point = start; point < end; point++){
 
-            for(size_t i = 1; i <= k; i++){
-                while(true){
-                    size_t randInd = rand() % points.size();
-                    
-                    if(std::find(usedPoints.begin(), usedPoints.end(), randInd) == usedPoints.end()){
+                const short* block = blocks.getRow(point);
+                size_t cluster = assignments[point];
 
-                        usedPoints.push_back(randInd);
-                    
-                        points[randInd].setClusterId(i);
+                if(!firstIteration){
+                    /*
+                      Os centroids moveram-se, os limites alargam-se no máximo esse deslocamento.
+                    */
+                    upper[point] += drift[cluster];
+                    lower[point] -= cluster == maxDriftCluster ? secondMaxDrift : maxDrift;
 
-                        Cluster c(points[randInd], i);
-                        
-                        points[randInd].setClusterId(i);
+                    double bound = std::max(halfGap[cluster], lower[point]) * (1.0 - BOUND_MARGIN);
 
-                        clusters.push_back(c);
+                    if(upper[point] * (1.0 + BOUND_MARGIN) < bound){
+                        accumulate(thread, block, cluster);
+                        continue;
+                    }
 
-                        break;
+                    upper[point] = std::sqrt((double) squaredDistance(centroids.getRow(cluster), block, blockSize));
+
+                    if(upper[point] * (1.0 + BOUND_MARGIN) < bound){
+                        accumulate(thread, block, cluster);
+                        continue;
                     }
+                }
+
+                uint64_t minDist, secondDist;
+                size_t nearest = nearestCluster(block, minDist, secondDist);
+
+                upper[point] = std::sqrt((double) minDist);
+                lower[point] = k > 1 ? std::sqrt((double) secondDist) : std::numeric_limits<double>::infinity();
 
+                if(nearest != cluster){
+                    assignments[point] = nearest;
+                    threadChanged++;
                 }
+
+                accumulate(thread, block, nearest);
             }
 
-            
-            int iter = 0;
-            int pointsStep = points.size() / nThreads;
-            int clustersStep = k / nThreads;
+            changed += threadChanged;
+        }
 
-            while(true){
-                done = true;
+        /*
+          Dado um ponto de ínicio e um de fim junta as somas de todas as threads,
+          sempre pela mesma ordem, e atualiza os centroids presentes nessa gama.
+        */
+        void reduceCentroids(size_t start, size_t end){
+
+            std::vector<int64_t> sum(blockSize);
+
+            for(size_t cluster = start; cluster < end; cluster++){
+
+                size_t clusterNBlocks = 0;
+
+                std::fill(sum.begin(), sum.end(), 0);
+
+                for(size_t thread = 0; thread < sums.size(); thread++){
+
+                    if(counts[thread][cluster] == 0){
+                        continue;
+                    }
+
+                    clusterNBlocks += counts[thread][cluster];
+
+                    const int64_t* threadSums = sums[thread].data() + cluster * blockSize;
+                    for(size_t value = 0; value < blockSize; value++){
+                        sum[value] += threadSums[value];
+                    }
+                }
 
                 /*
-                  Atualiza as atribuições dos pontos aos clusters
+                  Um cluster sem pontos mantém o centroid anterior.
                 */
+                if(clusterNBlocks == 0){
+                    if(algorithm == KMeansAlgorithm::Hamerly){
+                        drift[cluster] = 0.0;
+                    }
+                    continue;
+                }
 
-                for(int i = 0; i < nThreads; i++){
+                short* centroid = centroids.getRow(cluster);
 
-                    if(i == nThreads -1){
-                        size_t start = i*pointsStep;
-                        size_t end = points.size();
-                        threads[i] = std::thread(&KMeans::updateNearestCluster, this, start, end);
-                    }
-                    else{
-                        size_t start = i*pointsStep;
-                        size_t end = i*pointsStep + pointsStep;
-                        threads[i] = std::thread(&KMeans::updateNearestCluster, this, start, end);
+                if(algorithm == KMeansAlgorithm::Hamerly){
+                    /*
+                      Guarda quanto o centroid se vai mover
+                    */
+                    std::vector<short> updated(blockSize);
+                    for(size_t value = 0; value < blockSize; value++){
+                        updated[value] = sum[value] / (int64_t) clusterNBlocks;
                     }
+                    drift[cluster] = std::sqrt((double) squaredDistance(centroid, updated.data(), blockSize));
+                    std::copy(updated.begin(), updated.end(), centroid);
+                    continue;
                 }
-                for(int i = 0; i < nThreads; i++){
-                    threads[i].join();
+
+                for(size_t value = 0; value < blockSize; value++){
+                    centroid[value] = sum[value] / (int64_t) clusterNBlocks;
                 }
+            }
+        }
+
+        KMeans(size_t k, int iterations, DistanceKernel kernel = bestDistanceKernel(), KMeansAlgorithm algorithm = KMeansAlgorithm::Lloyd, uint64_t seed = 1){
+            this->k = k;
+            this->iterations = iterations;
+            this->seed = seed;
+            this->algorithm = algorithm;
+            this->squaredDistance = getSquaredDistance(kernel);
+        }
+
+        /*
+          Agrupa as linhas de blocks em k clusters e escreve os centroids
+          resultantes nas linhas de centroids (k x D).
+          Com warmStart as linhas de centroids já têm os centroids iniciais (por exemplo de um
+          codebook anterior) e a inicialização aleatória não é feita.
+          Devolve false, sem alterar os centroids, se for preciso inicializar e houver menos
+          blocos que clusters: o k-means|| não tem k pontos diferentes para escolher.
+        */
+        bool getClusters(MatrixView<const short> blocks, MatrixView<short> centroids, ThreadPool& pool, bool warmStart = false){
+
+            if(!warmStart && (k == 0 || blocks.getRows() < k)){
+                return false;
+            }
 
+            size_t nThreads = pool.getNThreads();
+
+            this->blocks = blocks;
+            this->centroids = centroids;
+            blockSize = blocks.getCols();
+            size_t nPoints = blocks.getRows();
+
+            assignments.assign(nPoints, NO_CLUSTER);
+            /*
+              Cada thread aloca as suas somas (sem copiar um vetor temporário, que duplicava a memória).
+            */
+            sums.resize(nThreads);
+            for(std::vector<int64_t>& threadSums : sums){
+                threadSums.assign(k * blockSize, 0);
+            }
+            counts.assign(nThreads, std::vector<size_t>(k));
+
+            if(algorithm == KMeansAlgorithm::Hamerly){
+                upper.assign(nPoints, 0.0);
+                lower.assign(nPoints, 0.0);
+                drift.assign(k, 0.0);
+                halfGap.assign(k, 0.0);
+                centroidDistances.assign(k * k, 0);
+            }
+
+            /*
+              Inicializa os Clusters.
+            */
+            if(!warmStart){
+                seedCentroids(pool);
+            }
+
+            int iter = 0;
+            size_t nChunks = (nPoints + POINTS_PER_CHUNK - 1) / POINTS_PER_CHUNK;
+
+            while(true){
+                changed = 0;
 
                 /*
-                  Atualizar os centroids de acordo com as novas atribuições.
+                  As somas de um cluster só são lidas se a contagem for positiva,
+                  por isso basta limpar as contagens.
                 */
-                for(int i = 0; i < nThreads; i++){
-                    if(i == nThreads -1){
-                        size_t start = i*clustersStep;
-                        size_t end = clusters.size();
-                        threads[i] = std::thread(&KMeans::updateCentroids, this, start, end);
-                    }
-                    else{
-                        size_t start = i*clustersStep;
-                        size_t end = i*clustersStep + clustersStep;
-                        threads[i] = std::thread(&KMeans::updateCentroids, this, start, end);
+                for(size_t thread = 0; thread < nThreads; thread++){
+                    std::fill(counts[thread].begin(), counts[thread].end(), 0);
+                }
+
+                /*
+                  Atualiza as atribuições dos pontos aos clusters e acumula as somas
+                */
+                if(algorithm == KMeansAlgorithm::Hamerly){
+                    bool firstIteration = iter == 0;
+
+                    if(!firstIteration){
+                        updateHalfGaps(pool);
                     }
+
+                    pool.parallelFor(nChunks, [&](size_t chunk, size_t thread){
+                        size_t start = chunk * POINTS_PER_CHUNK;
+                        size_t end = std::min(start + POINTS_PER_CHUNK, nPoints);
+                        assignAndAccumulateHamerly(thread, start, end, firstIteration);
+                    });
+                }
+                else{
+                    pool.parallelFor(nChunks, [&](size_t chunk, size_t thread){
+                        size_t start = chunk * POINTS_PER_CHUNK;
+                        size_t end = std::min(start + POINTS_PER_CHUNK, nPoints);
+                        assignAndAccumulate(thread, start, end);
+                    });
                 }
-                for(int i = 0; i < nThreads; i++){
-                    threads[i].join();
+
+                /*
+                  Atualizar os centroids a partir das somas de cada thread, um cluster por tarefa.
+                */
+                pool.parallelFor(k, [&](size_t cluster, size_t){
+                    reduceCentroids(cluster, cluster + 1);
+                });
+
+                if(algorithm == KMeansAlgorithm::Hamerly){
+                    updateMaxDrift();
                 }
 
-                if(done || iter > iterations){
+                completedIterations = iter + 1;
+
+                if(changed == 0 || iter > iterations){
                     break;
                 }
                 iter ++;
             }
-            std::vector< std::vector<short>> centroids;
-            for(size_t i = 0; i < k; i++){
-                centroids.push_back(clusters[i].getCentroid());
-            }
-            return centroids;
+
+            return true;
+        }
+
+        /*
+          Número de iterações feitas na última chamada a getClusters.
+        */
+        int getIterations(){
+            return completedIterations;
+        }
+
+        /*
+          Cluster de cada bloco no fim da última chamada a getClusters.
+        */
+        const std::vector<size_t>& getAssignments() const{
+            return assignments;
         }
 };
 
+#endif
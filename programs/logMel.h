@@ -0,0 +1,289 @@
+#ifndef LOG_MEL_H
+#define LOG_MEL_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <vector>
+#include "matrix.h"
+#include "threadPool.h"
+
+/**
+ * Power spectrum of real signals with a power of two length.
+ * The n real values are packed as n / 2 complex values, transformed with an iterative radix-2
+ * FFT and split into the spectrum of the real signal. The real and imaginary parts are kept in
+ * separate arrays and every stage has its own contiguous twiddles, so the butterflies are plain
+ * loops over consecutive floats that the compiler vectorizes.
+ */
+class RealFft {
+    private:
+        size_t n;
+        std::vector<size_t> bitReverse;
+        std::vector<float> twiddleRe, twiddleIm;
+        std::vector<float> splitRe, splitIm;
+
+    public:
+        /**
+         * @param n is the number of real values, a power of two of at least 4.
+         */
+        explicit RealFft(size_t n) : n(n), bitReverse(n / 2), twiddleRe(n / 2), twiddleIm(n / 2), splitRe(n / 2 + 1), splitIm(n / 2 + 1) {
+            size_t m = n / 2;
+            size_t bits = 0;
+
+            while (((size_t) 1 << bits) < m)
+                bits++;
+
+            for (size_t i = 0; i < m; i++) {
+                size_t reversed = 0;
+
+                for (size_t bit = 0; bit < bits; bit++)
+                    reversed |= ((i >> bit) & 1) << (bits - 1 - bit);
+
+                bitReverse[i] = reversed;
+            }
+
+            /*
+             * The stage that joins transforms of half values uses twiddles [half, 2 * half).
+             */
+            for (size_t half = 1; half < m; half *= 2) {
+                for (size_t j = 0; j < half; j++) {
+                    twiddleRe[half + j] = std::cos(M_PI * j / half);
+                    twiddleIm[half + j] = -std::sin(M_PI * j / half);
+                }
+            }
+
+            for (size_t k = 0; k <= m; k++) {
+                splitRe[k] = std::cos(2 * M_PI * k / n);
+                splitIm[k] = -std::sin(2 * M_PI * k / n);
+            }
+        }
+
+        size_t getSize() const {
+            return n;
+        }
+
+        /**
+         * Function to compute the power spectrum |X[k]|^2 / n of a real signal.
+         * @param input are the n values of the signal.
+         * @param power receives the n / 2 + 1 bins, from 0 to the Nyquist frequency.
+         * @param re and im are scratch buffers of n / 2 values.
+         */
+        void powerSpectrum(const float* input, float* power, float* re, float* im) const {
+            size_t m = n / 2;
+
+            for (size_t i = 0; i < m; i++) {
+                re[bitReverse[i]] = input[2 * i];
+                im[bitReverse[i]] = input[2 * i + 1];
+            }
+
+            for (size_t half = 1; half < m; half *= 2) {
+                const float* wRe = twiddleRe.data() + half;
+                const float* wIm = twiddleIm.data() + half;
+
+                for (size_t start = 0; start < m; start += 2 * half) {
+                    float* aRe = re + start;
+                    float* aIm = im + start;
+                    float* bRe = re + start + half;
+                    float* bIm = im + start + half;
+
+                    for (size_t j = 0; j < half; j++) {
+                        float tRe = bRe[j] * wRe[j] - bIm[j] * wIm[j];
+                        float tIm = bRe[j] * wIm[j] + bIm[j] * wRe[j];
+
+                        bRe[j] = aRe[j] - tRe;
+                        bIm[j] = aIm[j] - tIm;
+                        aRe[j] += tRe;
+                        aIm[j] += tIm;
+                    }
+                }
+            }
+
+            /*
+             * With Z the transform of the packed values, X[k] = E + W^k O where
+             * E = (Z[k] + conj(Z[m - k])) / 2 and O = (Z[k] - conj(Z[m - k])) / 2i.
+             */
+            float scale = 1.0f / n;
+
+            for (size_t k = 0; k <= m; k++) {
+                size_t a = k % m, b = (m - k) % m;
+                float eRe = (re[a] + re[b]) / 2, eIm = (im[a] - im[b]) / 2;
+                float oRe = (im[a] + im[b]) / 2, oIm = (re[b] - re[a]) / 2;
+                float xRe = eRe + splitRe[k] * oRe - splitIm[k] * oIm;
+                float xIm = eIm + splitRe[k] * oIm + splitIm[k] * oRe;
+
+                power[k] = (xRe * xRe + xIm * xIm) * scale;
+            }
+        }
+};
+
+/**
+ * Log-mel features of audio blocks: each block is mixed to mono, windowed, transformed to its
+ * power spectrum and summed in triangular bands evenly spaced on the mel scale. The log of every
+ * band is stored in hundredths of a dB, so the features are int16 vectors with one value per
+ * band and are clustered, stored and compared with the same code as the samples.
+ * The spectrum of a block barely changes when the audio is shifted by a fraction of the block,
+ * which the samples themselves do not tolerate.
+ */
+class LogMel {
+    public:
+        /**
+         * Feature units per dB.
+         */
+        static constexpr double SCALE = 100;
+
+        /**
+         * Number of bands used when none is given.
+         */
+        static constexpr size_t DEFAULT_BANDS = 40;
+
+        /**
+         * Range, in dB, kept below the loudest band of a block. The quieter bands are raised to
+         * this floor, otherwise bands that are almost silent in the song, where any noise of the
+         * sample is tens of dB louder, would dominate the distances.
+         */
+        static constexpr double DYNAMIC_RANGE = 15;
+
+    private:
+        struct Band {
+            size_t firstBin;
+            std::vector<float> weights;
+        };
+
+        size_t channels, blockFrames;
+        RealFft fft;
+        std::vector<float> window;
+        std::vector<Band> bands;
+
+        static size_t getFftSize(size_t blockFrames) {
+            size_t size = 4;
+
+            while (size < blockFrames)
+                size *= 2;
+
+            return size;
+        }
+
+        static double toMel(double frequency) {
+            return 2595 * std::log10(1 + frequency / 700);
+        }
+
+        static double fromMel(double mel) {
+            return 700 * (std::pow(10, mel / 2595) - 1);
+        }
+
+    public:
+        /**
+         * @param channels is the number of interleaved channels of the blocks.
+         * @param sampleRate is the sample rate of the audio, which places the bands.
+         * @param blockFrames is the number of frames of each block, zero padded to a power of two.
+         * @param nBands is the number of mel bands, between 0 Hz and half the sample rate.
+         */
+        LogMel(size_t channels, size_t sampleRate, size_t blockFrames, size_t nBands)
+            : channels(channels), blockFrames(blockFrames), fft(getFftSize(blockFrames)), window(blockFrames), bands(nBands) {
+            for (size_t frame = 0; frame < blockFrames; frame++)
+                window[frame] = 0.5 - 0.5 * std::cos(2 * M_PI * frame / blockFrames);
+
+            size_t nBins = fft.getSize() / 2 + 1;
+            double binWidth = (double) sampleRate / fft.getSize();
+            double maxMel = toMel(sampleRate / 2.0);
+
+            for (size_t band = 0; band < nBands; band++) {
+                double low = fromMel(maxMel * band / (nBands + 1));
+                double center = fromMel(maxMel * (band + 1) / (nBands + 1));
+                double high = fromMel(maxMel * (band + 2) / (nBands + 1));
+
+                size_t first = std::min(nBins, (size_t) std::ceil(low / binWidth));
+                size_t last = std::min(nBins, (size_t) std::floor(high / binWidth) + 1);
+
+                bands[band].firstBin = first;
+                for (size_t bin = first; bin < last; bin++) {
+                    double frequency = bin * binWidth;
+                    double weight = frequency <= center ? (frequency - low) / (center - low) : (high - frequency) / (high - center);
+
+                    bands[band].weights.push_back(std::max(0.0, weight));
+                }
+            }
+        }
+
+        size_t getNBands() const {
+            return bands.size();
+        }
+
+        /**
+         * Function to compute the features of one block.
+         * @param block are the blockFrames x channels interleaved samples.
+         * @param features receives one value per band.
+         * @param scratch is reused between calls to avoid allocations.
+         */
+        void getFeatures(const short* block, short* features, std::vector<float>& scratch) const {
+            size_t n = fft.getSize();
+            scratch.resize(3 * n + 2 + bands.size());
+
+            float* mono = scratch.data();
+            float* power = mono + n;
+            float* re = power + n / 2 + 1;
+            float* im = re + n / 2;
+
+            for (size_t frame = 0; frame < blockFrames; frame++) {
+                float sum = 0;
+
+                for (size_t channel = 0; channel < channels; channel++)
+                    sum += block[frame * channels + channel];
+
+                mono[frame] = sum / channels * window[frame];
+            }
+            std::fill(mono + blockFrames, mono + n, 0.0f);
+
+            fft.powerSpectrum(mono, power, re, im);
+
+            float* levels = im + n / 2;
+            float maxLevel = 0;
+
+            for (size_t band = 0; band < bands.size(); band++) {
+                double energy = 0;
+
+                for (size_t bin = 0; bin < bands[band].weights.size(); bin++)
+                    energy += bands[band].weights[bin] * power[bands[band].firstBin + bin];
+
+                levels[band] = 10 * std::log10(1 + energy);
+                maxLevel = std::max(maxLevel, levels[band]);
+            }
+
+            for (size_t band = 0; band < bands.size(); band++)
+                features[band] = (short) std::min(32767.0, std::round(SCALE * std::max(levels[band], maxLevel - (float) DYNAMIC_RANGE)));
+        }
+
+        /**
+         * Function to compute the features of every block.
+         * @param blocks are rows of blockFrames x channels interleaved samples.
+         * @return one row of features per block.
+         */
+        Matrix<short> getFeatures(MatrixView<const short> blocks) const {
+            Matrix<short> features(blocks.getRows(), bands.size());
+            std::vector<float> scratch;
+
+            for (size_t block = 0; block < blocks.getRows(); block++)
+                getFeatures(blocks.getRow(block), features.getRow(block), scratch);
+
+            return features;
+        }
+
+        /**
+         * Function to compute the features of every block, split between the threads of a pool.
+         */
+        Matrix<short> getFeatures(MatrixView<const short> blocks, ThreadPool& pool) const {
+            Matrix<short> features(blocks.getRows(), bands.size());
+            size_t nChunks = std::min(blocks.getRows(), 16 * pool.getNThreads());
+
+            pool.parallelFor(nChunks, [&](size_t chunk, size_t) {
+                std::vector<float> scratch;
+
+                for (size_t block = chunk * blocks.getRows() / nChunks; block < (chunk + 1) * blocks.getRows() / nChunks; block++)
+                    getFeatures(blocks.getRow(block), features.getRow(block), scratch);
+            });
+
+            return features;
+        }
+};
+
+#endif
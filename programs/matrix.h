@@ -0,0 +1,116 @@
+#ifndef MATRIX_H
+#define MATRIX_H
+
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <new>
+
+/**
+ * Non-owning view over a row-major matrix.
+ * The stride is the distance, in elements, between the start of two consecutive rows.
+ * It may be larger than the number of columns (padded rows) or smaller (overlapping rows).
+ */
+template<typename T>
+class MatrixView {
+    private:
+        T* data;
+        size_t nRows, nCols, rowStride;
+
+    public:
+        MatrixView() : data(nullptr), nRows(0), nCols(0), rowStride(0) {}
+
+        MatrixView(T* data, size_t nRows, size_t nCols, size_t rowStride)
+            : data(data), nRows(nRows), nCols(nCols), rowStride(rowStride) {}
+
+        operator MatrixView<const T>() const {
+            return MatrixView<const T>(data, nRows, nCols, rowStride);
+        }
+
+        T* getRow(size_t row) const {
+            return data + row * rowStride;
+        }
+
+        T* getData() const {
+            return data;
+        }
+
+        size_t getRows() const {
+            return nRows;
+        }
+
+        size_t getCols() const {
+            return nCols;
+        }
+
+        size_t getStride() const {
+            return rowStride;
+        }
+};
+
+/**
+ * Row-major matrix stored in a single 64-byte aligned allocation.
+ * Each row is padded with zeros up to a multiple of 64 bytes, so every row starts aligned.
+ */
+template<typename T>
+class Matrix {
+    public:
+        static constexpr size_t ALIGNMENT = 64;
+
+    private:
+        struct AlignedFree {
+            void operator()(T* ptr) const {
+                std::free(ptr);
+            }
+        };
+
+        std::unique_ptr<T[], AlignedFree> data;
+        size_t nRows, nCols, rowStride;
+
+    public:
+        Matrix() : nRows(0), nCols(0), rowStride(0) {}
+
+        /**
+         * Function to compute the padded row length used for a given number of columns.
+         * @param nCols is the number of columns.
+         * @return the stride, in elements, of a matrix with nCols columns.
+         */
+        static size_t getPaddedStride(size_t nCols) {
+            return (nCols * sizeof(T) + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT / sizeof(T);
+        }
+
+        Matrix(size_t nRows, size_t nCols) : nRows(nRows), nCols(nCols), rowStride(getPaddedStride(nCols)) {
+            size_t rowBytes = rowStride * sizeof(T);
+
+            if (nRows * rowBytes > 0) {
+                T* ptr = static_cast<T*>(std::aligned_alloc(ALIGNMENT, nRows * rowBytes));
+                if (ptr == nullptr)
+                    throw std::bad_alloc();
+                std::memset(static_cast<void*>(ptr), 0, nRows * rowBytes);
+                data.reset(ptr);
+            }
+        }
+
+        T* getRow(size_t row) const {
+            return data.get() + row * rowStride;
+        }
+
+        size_t getRows() const {
+            return nRows;
+        }
+
+        size_t getCols() const {
+            return nCols;
+        }
+
+        size_t getStride() const {
+            return rowStride;
+        }
+
+        MatrixView<T> view() const {
+            return MatrixView<T>(data.get(), nRows, nCols, rowStride);
+        }
+};
+
+#endif
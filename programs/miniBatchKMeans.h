@@ -0,0 +1,370 @@
+#ifndef MINI_BATCH_KMEANS_H
+#define MINI_BATCH_KMEANS_H
+
+#include "kMeans.h"
+#include "blockReader.h"
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+/*
+  KMeans por mini-lotes: os blocos são lidos do ficheiro em lotes de tamanho fixo e os
+  centroids são atualizados a cada lote, por isso a memória usada não depende do tamanho
+  do ficheiro. O lote b tem os blocos b, b + nBatches, b + 2 x nBatches, ... para cada
+  lote representar a música toda e não só um excerto. No fim faz um passo de Lloyd com todos os blocos (também lidos em lotes)
+  e compara a distorção antes e depois desse passo. Esse ganho só mostra que o mini-lote ainda não
+  tinha convergido; para saber a que distância fica do k-means com todos os blocos, compareFull
+  corre também Lloyd com todos os blocos até convergir, a partir dos mesmos centroids iniciais.
+*/
+class MiniBatchKMeans{
+
+    private:
+        size_t k, blockSize;
+        int maxEpochs, epochs = 0;
+        DistanceKernel kernel;
+        SquaredDistanceFn squaredDistance;
+        uint64_t seed;
+        bool compareFull;
+        int fullBatchIterations = 0;
+        double miniBatchDistortion = 0.0, refinedDistortion = 0.0, fullBatchDistortion = 0.0;
+
+        /*
+          Centroids em vírgula flutuante (estado do treino) e arredondados a short (usados nas distâncias).
+        */
+        Matrix<float> learned;
+        MatrixView<short> centroids;
+        /*
+          Com compareFull, cópia dos centroids iniciais para o Lloyd com todos os blocos.
+        */
+        Matrix<short> seeded;
+        std::vector<uint64_t> clusterCounts;
+
+        /*
+          Cluster mais próximo e distância de cada linha do lote atual.
+        */
+        std::vector<size_t> nearest;
+        std::vector<uint64_t> nearestDist;
+
+        static constexpr size_t ROWS_PER_CHUNK = 8;
+
+        /*
+          Estimativa dos bytes usados por linha do lote (bloco, atribuição e estado da inicialização).
+        */
+        static size_t bytesPerBatchRow(size_t blockSize){
+            return Matrix<short>::getPaddedStride(blockSize) * sizeof(short) + 64;
+        }
+
+        /*
+          Bytes fixos: centroids (float e short), somas do passo de Lloyd e somas por thread do
+          KMeans usado para inicializar no primeiro lote. A cópia dos centroids iniciais de
+          compareFull cabe no lugar dos float, que são libertados antes das somas serem criadas.
+        */
+        static size_t fixedBytes(size_t k, size_t blockSize, size_t nThreads){
+            size_t stride = Matrix<short>::getPaddedStride(blockSize);
+            size_t training = k * stride * (sizeof(float) + sizeof(short) + sizeof(int64_t));
+            size_t seeding = k * stride * sizeof(short) + nThreads * k * blockSize * sizeof(int64_t);
+            return std::max(training, seeding) + k * sizeof(uint64_t);
+        }
+
+        /*
+          Calcula o cluster mais próximo de cada uma das n primeiras linhas do lote e devolve a soma das distâncias.
+        */
+        double assignBatch(MatrixView<const short> batch, size_t n, ThreadPool& pool){
+            size_t nChunks = (n + ROWS_PER_CHUNK - 1) / ROWS_PER_CHUNK;
+
+            pool.parallelFor(nChunks, [&](size_t chunk, size_t){
+                size_t end = std::min((chunk + 1) * ROWS_PER_CHUNK, n);
+
+                for(size_t row = chunk * ROWS_PER_CHUNK; row < end; row++){
+                    const short* block = batch.getRow(row);
+                    uint64_t minDist = squaredDistance(centroids.getRow(0), block, blockSize);
+                    size_t cluster = 0;
+
+                    for(size_t other = 1; other < k; other++){
+                        uint64_t dist = squaredDistance(centroids.getRow(other), block, blockSize);
+                        if(dist < minDist){
+                            minDist = dist;
+                            cluster = other;
+                        }
+                    }
+
+                    nearest[row] = cluster;
+                    nearestDist[row] = minDist;
+                }
+            });
+
+            double sum = 0.0;
+            for(size_t row = 0; row < n; row++){
+                sum += nearestDist[row];
+            }
+            return sum;
+        }
+
+        /*
+          Atualiza os centroids com as linhas do lote: c = c + (x - c) / v, em que v é o número
+          de blocos que o centroid já viu. As linhas de cada centroid são aplicadas pela ordem do
+          lote numa única tarefa, por isso o resultado não depende do número de threads.
+        */
+        void updateBatch(MatrixView<const short> batch, size_t n, ThreadPool& pool){
+            std::vector<std::vector<size_t>> rows(k);
+
+            for(size_t row = 0; row < n; row++){
+                rows[nearest[row]].push_back(row);
+            }
+
+            pool.parallelFor(k, [&](size_t cluster, size_t){
+                if(rows[cluster].empty()){
+                    return;
+                }
+
+                float* center = learned.getRow(cluster);
+
+                for(size_t row : rows[cluster]){
+                    const short* block = batch.getRow(row);
+                    float rate = 1.0f / ++clusterCounts[cluster];
+
+                    for(size_t value = 0; value < blockSize; value++){
+                        center[value] += (block[value] - center[value]) * rate;
+                    }
+                }
+
+                short* rounded = centroids.getRow(cluster);
+                for(size_t value = 0; value < blockSize; value++){
+                    rounded[value] = (short) std::lround(center[value]);
+                }
+            });
+        }
+
+        /*
+          Passo de Lloyd com todos os blocos, lidos em lotes: soma as distâncias dos blocos aos
+          centroids atuais, que devolve, e acumula as somas exatas de cada cluster para os
+          substituir pelas médias. moved diz se algum centroid mudou.
+        */
+        double lloydStep(BlockReader& reader, Matrix<short>& batch, size_t nBatches, ThreadPool& pool, bool& moved){
+            Matrix<int64_t> sums(k, blockSize);
+            std::vector<uint64_t> counts(k, 0);
+            double distortion = 0.0;
+
+            for(size_t b = 0; b < nBatches; b++){
+                size_t n = reader.read(batch.view(), b, nBatches);
+                distortion += assignBatch(batch.view(), n, pool);
+
+                pool.parallelFor(k, [&](size_t cluster, size_t){
+                    int64_t* clusterSums = sums.getRow(cluster);
+
+                    for(size_t row = 0; row < n; row++){
+                        if(nearest[row] == cluster){
+                            const short* block = batch.getRow(row);
+                            for(size_t value = 0; value < blockSize; value++){
+                                clusterSums[value] += block[value];
+                            }
+                            counts[cluster]++;
+                        }
+                    }
+                });
+            }
+
+            moved = false;
+            for(size_t cluster = 0; cluster < k; cluster++){
+                if(counts[cluster] > 0){
+                    short* centroid = centroids.getRow(cluster);
+                    const int64_t* clusterSums = sums.getRow(cluster);
+
+                    for(size_t value = 0; value < blockSize; value++){
+                        short mean = clusterSums[value] / (int64_t) counts[cluster];
+                        moved = moved || mean != centroid[value];
+                        centroid[value] = mean;
+                    }
+                }
+            }
+
+            return distortion;
+        }
+
+        /*
+          Soma das distâncias de todos os blocos aos centroids atuais.
+        */
+        double getDistortion(BlockReader& reader, Matrix<short>& batch, size_t nBatches, ThreadPool& pool){
+            double distortion = 0.0;
+
+            for(size_t b = 0; b < nBatches; b++){
+                size_t n = reader.read(batch.view(), b, nBatches);
+                distortion += assignBatch(batch.view(), n, pool);
+            }
+
+            return distortion;
+        }
+
+    public:
+
+        MiniBatchKMeans(size_t k, int maxEpochs, DistanceKernel kernel, uint64_t seed, bool compareFull = false){
+            this->k = k;
+            this->maxEpochs = maxEpochs;
+            this->kernel = kernel;
+            this->squaredDistance = getSquaredDistance(kernel);
+            this->seed = seed;
+            this->compareFull = compareFull;
+        }
+
+        /*
+          Número de linhas por lote que cabem em memBudget bytes, 0 se nem k linhas couberem.
+        */
+        static size_t getBatchSize(size_t memBudget, size_t k, size_t blockSize, size_t nThreads){
+            size_t fixed = fixedBytes(k, blockSize, nThreads);
+
+            if(memBudget <= fixed){
+                return 0;
+            }
+
+            size_t batchSize = (memBudget - fixed) / bytesPerBatchRow(blockSize);
+            return batchSize < k ? 0 : batchSize;
+        }
+
+        /*
+          Memória mínima para treinar k centroids de blocos com blockSize amostras.
+        */
+        static size_t getMinimumBudget(size_t k, size_t blockSize, size_t nThreads){
+            return fixedBytes(k, blockSize, nThreads) + k * bytesPerBatchRow(blockSize) + 1;
+        }
+
+        /*
+          Treina k centroids com os blocos de reader, em lotes de batchSize blocos, e
+          escreve-os nas linhas de centroids (k x D). Com warmStart o treino começa nos centroids
+          que já estão em centroids. Devolve false se o reader tiver menos de k blocos.
+        */
+        bool getClusters(BlockReader& reader, size_t batchSize, MatrixView<short> centroids, ThreadPool& pool, bool warmStart = false){
+            blockSize = reader.getBlockSize();
+            this->centroids = centroids;
+
+            Matrix<short> batch(batchSize, blockSize);
+            nearest.assign(batchSize, 0);
+            nearestDist.assign(batchSize, 0);
+
+            size_t nBatches = (reader.getNBlocks() + batchSize - 1) / batchSize;
+
+            /*
+              Inicializa com o KMeans normal sobre o primeiro lote. Um lote pode ter menos de k
+              blocos (por exemplo 301 blocos em lotes de 150 dão lotes de 101), por isso juntam-se
+              os lotes seguintes até haver pelo menos k; cabem sempre porque batchSize >= k.
+            */
+            size_t n = reader.read(batch.view(), 0, nBatches);
+            for(size_t b = 1; b < nBatches && n < k; b++){
+                n += reader.read(MatrixView<short>(batch.getRow(n), batchSize - n, blockSize, batch.getStride()), b, nBatches);
+            }
+
+            if(!warmStart){
+                KMeans km(k, maxEpochs, kernel, KMeansAlgorithm::Lloyd, seed);
+                if(!km.getClusters(MatrixView<const short>(batch.getRow(0), n, blockSize, batch.getStride()), centroids, pool)){
+                    return false;
+                }
+            }
+
+            if(compareFull){
+                seeded = Matrix<short>(k, blockSize);
+                for(size_t cluster = 0; cluster < k; cluster++){
+                    std::copy(centroids.getRow(cluster), centroids.getRow(cluster) + blockSize, seeded.getRow(cluster));
+                }
+            }
+
+            learned = Matrix<float>(k, blockSize);
+            clusterCounts.assign(k, 0);
+
+            for(size_t cluster = 0; cluster < k; cluster++){
+                std::copy(centroids.getRow(cluster), centroids.getRow(cluster) + blockSize, learned.getRow(cluster));
+            }
+
+            /*
+              Cada centroid começa com o peso dos blocos da inicialização que lhe pertencem.
+            */
+            assignBatch(batch.view(), n, pool);
+            for(size_t row = 0; row < n; row++){
+                clusterCounts[nearest[row]]++;
+            }
+
+            /*
+              Passagens pelo ficheiro até a distorção deixar de melhorar ou chegar ao máximo.
+            */
+            double previous = 0.0;
+
+            for(epochs = 1; epochs <= maxEpochs; epochs++){
+                double distortion = 0.0;
+
+                for(size_t b = 0; b < nBatches; b++){
+                    n = reader.read(batch.view(), b, nBatches);
+                    distortion += assignBatch(batch.view(), n, pool);
+                    updateBatch(batch.view(), n, pool);
+                }
+
+                if(epochs > 1 && previous - distortion < 1e-3 * previous){
+                    break;
+                }
+                previous = distortion;
+            }
+            epochs = std::min(epochs, maxEpochs);
+
+            /*
+              Passo de Lloyd com todos os blocos: mede a distorção dos centroids do mini-lote e
+              substitui-os pelas médias exatas dos seus clusters.
+            */
+            learned = Matrix<float>();
+
+            bool moved;
+            miniBatchDistortion = lloydStep(reader, batch, nBatches, pool, moved) / reader.getNBlocks();
+            refinedDistortion = getDistortion(reader, batch, nBatches, pool) / reader.getNBlocks();
+
+            /*
+              Lloyd com todos os blocos a partir dos centroids iniciais, até nenhum centroid mudar
+              ou chegar ao máximo de iterações.
+            */
+            if(compareFull){
+                MatrixView<short> trained = this->centroids;
+                this->centroids = seeded.view();
+
+                moved = true;
+                for(fullBatchIterations = 0; moved && fullBatchIterations < maxEpochs; fullBatchIterations++){
+                    lloydStep(reader, batch, nBatches, pool, moved);
+                }
+
+                fullBatchDistortion = getDistortion(reader, batch, nBatches, pool) / reader.getNBlocks();
+                this->centroids = trained;
+                seeded = Matrix<short>();
+            }
+
+            return true;
+        }
+
+        /*
+          Número de passagens pelo ficheiro feitas no treino.
+        */
+        int getEpochs(){
+            return epochs;
+        }
+
+        /*
+          Distorção média por bloco dos centroids do mini-lote.
+        */
+        double getMiniBatchDistortion(){
+            return miniBatchDistortion;
+        }
+
+        /*
+          Distorção média por bloco depois do passo de Lloyd com todos os blocos.
+        */
+        double getRefinedDistortion(){
+            return refinedDistortion;
+        }
+
+        /*
+          Com compareFull, distorção média por bloco do Lloyd com todos os blocos e o número
+          de iterações que fez.
+        */
+        double getFullBatchDistortion(){
+            return fullBatchDistortion;
+        }
+
+        int getFullBatchIterations(){
+            return fullBatchIterations;
+        }
+};
+
+#endif
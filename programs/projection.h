@@ -0,0 +1,586 @@
+#ifndef PROJECTION_H
+#define PROJECTION_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <numeric>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "catalogFile.h"
+#include "distance.h"
+#include "matrix.h"
+#include "threadPool.h"
+
+/**
+ * Projection of the centroids of a catalog on their principal subspace, to find the closest
+ * centroid of every sample block with few full distances and the same result as the full search.
+ *
+ * The rows of the basis are orthonormal, so for a projection P and the residual r = x - PᵀPx of
+ * a vector outside the subspace, ‖x - c‖² = ‖P(x - c)‖² + ‖r_x - r_c‖² >= ‖Px - Pc‖² + (‖r_x‖ - ‖r_c‖)².
+ * Every centroid of a song gets this lower bound from nDims values, the centroids are visited
+ * from the lowest bound with the exact int16 distance, and the search stops when the lowest bound
+ * left is above the best exact distance.
+ *
+ * The file is little-endian: a 64 byte header, then the basis (nDims rows of nCols doubles), the
+ * projected centroids (nDims doubles each, in the order of the catalog), the norms of their
+ * residuals (one double each) and the first centroid of every song (uint64, nSongs + 1). Every
+ * section starts at a 64 byte aligned offset. The header keeps the checksum of the catalog it was
+ * built from, and the checksum of everything after the header.
+ */
+class Projection {
+    public:
+        static constexpr uint32_t VERSION = 1;
+
+        static constexpr size_t DEFAULT_DIMS = 32;
+
+        /**
+         * Parameters of the projection fit; zero picks the default of a parameter.
+         */
+        struct Options {
+            size_t nDims = 0;             // default: DEFAULT_DIMS, at most one per value
+            size_t trainingVectors = 8192;
+            int iterations = 4;
+            uint64_t seed = 1;
+        };
+
+        /**
+         * Blocks of a sample projected on the basis.
+         */
+        struct Query {
+            std::vector<double> coords;
+            std::vector<double> residuals;
+            std::vector<double> norms;
+        };
+
+    private:
+        struct Header {
+            char magic[8];
+            uint32_t version;
+            uint32_t headerSize;
+            uint32_t nCols;
+            uint32_t nDims;
+            uint32_t channels;
+            uint32_t blockFrames;
+            uint64_t nSongs;
+            uint64_t nEntries;
+            uint64_t catalogChecksum;
+            uint64_t checksum;
+        };
+
+        /*
+         * Offsets of the sections, derived from the header.
+         */
+        struct Layout {
+            uint64_t basis, coords, residuals, songOffsets, end;
+        };
+
+        static_assert(sizeof(Header) == 64, "the projection header must fill one cache line");
+
+        static constexpr char MAGIC[8] = {'T', 'A', 'I', 'P', 'R', 'O', 'J', 'E'};
+
+        const char* mapping = nullptr;
+        size_t mappedBytes = 0;
+        const double* basis = nullptr;
+        const double* coords = nullptr;
+        const double* residuals = nullptr;
+        const uint64_t* songOffsets = nullptr;
+        SquaredDistanceFn squaredDistance = getSquaredDistance(bestDistanceKernel());
+
+        void close() {
+            if (mapping != nullptr)
+                munmap(const_cast<char*>(mapping), mappedBytes);
+
+            mapping = nullptr;
+            mappedBytes = 0;
+        }
+
+        const Header& getHeader() const {
+            return *reinterpret_cast<const Header*>(mapping);
+        }
+
+        static uint64_t alignUp(uint64_t offset) {
+            return (offset + Matrix<short>::ALIGNMENT - 1) / Matrix<short>::ALIGNMENT * Matrix<short>::ALIGNMENT;
+        }
+
+        static Layout getLayout(const Header& header) {
+            Layout layout;
+
+            layout.basis = alignUp(sizeof(Header));
+            layout.coords = alignUp(layout.basis + (uint64_t) header.nDims * header.nCols * sizeof(double));
+            layout.residuals = alignUp(layout.coords + header.nEntries * header.nDims * sizeof(double));
+            layout.songOffsets = alignUp(layout.residuals + header.nEntries * sizeof(double));
+            layout.end = layout.songOffsets + (header.nSongs + 1) * sizeof(uint64_t);
+            return layout;
+        }
+
+        /*
+         * Dot product with four partial sums, so that it vectorizes without reordering a single sum.
+         */
+        static double dot(const double* a, const double* b, size_t n) {
+            double sums[4] = {0, 0, 0, 0};
+            size_t value = 0;
+
+            for (; value + 4 <= n; value += 4)
+                for (size_t lane = 0; lane < 4; lane++)
+                    sums[lane] += a[value + lane] * b[value + lane];
+
+            for (; value < n; value++)
+                sums[0] += a[value] * b[value];
+
+            return (sums[0] + sums[1]) + (sums[2] + sums[3]);
+        }
+
+        /*
+         * Projects a vector on the basis and returns the norm of its residual outside the subspace.
+         * The values are converted to doubles in buffer, of nCols values.
+         */
+        static double project(const short* values, const double* basis, size_t nCols, size_t nDims, double* projected, double* buffer) {
+            double energy = 0, projectedEnergy = 0;
+
+            for (size_t value = 0; value < nCols; value++) {
+                buffer[value] = values[value];
+                energy += (double) values[value] * values[value];
+            }
+
+            for (size_t dim = 0; dim < nDims; dim++) {
+                projected[dim] = dot(basis + dim * nCols, buffer, nCols);
+                projectedEnergy += projected[dim] * projected[dim];
+            }
+
+            return std::sqrt(std::max(0.0, energy - projectedEnergy));
+        }
+
+        /*
+         * Modified Gram-Schmidt, twice so the rows stay orthonormal to the rounding of a double.
+         * A row that depends on the previous ones (the centroids span fewer dimensions) is zeroed,
+         * which keeps the lower bound valid.
+         */
+        static void orthonormalize(std::vector<double>& rows, size_t nDims, size_t nCols) {
+            for (int pass = 0; pass < 2; pass++) {
+                for (size_t dim = 0; dim < nDims; dim++) {
+                    double* row = rows.data() + dim * nCols;
+                    double before = 0;
+
+                    for (size_t value = 0; value < nCols; value++)
+                        before += row[value] * row[value];
+
+                    for (size_t previous = 0; previous < dim; previous++) {
+                        const double* other = rows.data() + previous * nCols;
+                        double dot = 0;
+
+                        for (size_t value = 0; value < nCols; value++)
+                            dot += row[value] * other[value];
+
+                        for (size_t value = 0; value < nCols; value++)
+                            row[value] -= dot * other[value];
+                    }
+
+                    double norm = 0;
+                    for (size_t value = 0; value < nCols; value++)
+                        norm += row[value] * row[value];
+
+                    double scale = norm > before * 1e-20 && norm > 0 ? 1 / std::sqrt(norm) : 0;
+                    for (size_t value = 0; value < nCols; value++)
+                        row[value] *= scale;
+                }
+            }
+        }
+
+    public:
+        Projection() = default;
+
+        ~Projection() {
+            close();
+        }
+
+        Projection(const Projection&) = delete;
+
+        Projection& operator=(const Projection&) = delete;
+
+        /**
+         * Function to know if a file starts like a projection, without mapping it.
+         * @param path is the location of the file.
+         * @return true if the file has the projection magic.
+         */
+        static bool isProjection(const std::string& path) {
+            std::ifstream fp(path, std::ios::binary);
+            char magic[sizeof(MAGIC)] = {};
+
+            return fp.read(magic, sizeof(magic)) && std::memcmp(magic, MAGIC, sizeof(MAGIC)) == 0;
+        }
+
+        /**
+         * Function to map a projection and check that its sections fit in the file.
+         * Errors are reported on std::cerr.
+         * @param path is the location of the projection.
+         * @return true if the projection was opened.
+         */
+        bool open(const std::string& path) {
+            close();
+
+            int fd = ::open(path.c_str(), O_RDONLY);
+            struct stat status;
+
+            if (fd < 0 || fstat(fd, &status) != 0 || (size_t) status.st_size < sizeof(Header)) {
+                if (fd >= 0)
+                    ::close(fd);
+                std::cerr << "Error: could not open the projection " << path << std::endl;
+                return false;
+            }
+
+            void* map = mmap(nullptr, status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            ::close(fd);
+
+            if (map == MAP_FAILED) {
+                std::cerr << "Error: could not map the projection " << path << std::endl;
+                return false;
+            }
+
+            mapping = static_cast<const char*>(map);
+            mappedBytes = status.st_size;
+            const Header& header = getHeader();
+
+            if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 || header.version != VERSION || header.headerSize != sizeof(Header)) {
+                std::cerr << "Error: unsupported projection version in " << path << std::endl;
+                close();
+                return false;
+            }
+
+            Layout layout = getLayout(header);
+
+            if (header.nDims == 0 || header.nDims > header.nCols || layout.end > mappedBytes) {
+                std::cerr << "Error: truncated or corrupted projection " << path << std::endl;
+                close();
+                return false;
+            }
+
+            basis = reinterpret_cast<const double*>(mapping + layout.basis);
+            coords = reinterpret_cast<const double*>(mapping + layout.coords);
+            residuals = reinterpret_cast<const double*>(mapping + layout.residuals);
+            songOffsets = reinterpret_cast<const uint64_t*>(mapping + layout.songOffsets);
+
+            for (size_t song = 0; song < header.nSongs; song++) {
+                if (songOffsets[song] > songOffsets[song + 1]) {
+                    std::cerr << "Error: truncated or corrupted projection " << path << std::endl;
+                    close();
+                    return false;
+                }
+            }
+
+            if (songOffsets[0] != 0 || songOffsets[header.nSongs] != header.nEntries) {
+                std::cerr << "Error: truncated or corrupted projection " << path << std::endl;
+                close();
+                return false;
+            }
+
+            return true;
+        }
+
+        /**
+         * Function to check everything after the header against its checksum.
+         * This reads the whole projection.
+         * @return true if the projection is intact.
+         */
+        bool verify() const {
+            return CodebookFile::computeChecksum(mapping + sizeof(Header), getLayout(getHeader()).end - sizeof(Header)) == getHeader().checksum;
+        }
+
+        /**
+         * Function to know if the projection was built from a catalog, so its centroids are the same.
+         * @param catalog is an open catalog.
+         * @return true if the catalog is the one projected.
+         */
+        bool isBuiltFrom(const CatalogFile& catalog) const {
+            return getHeader().catalogChecksum == catalog.getChecksum() && getHeader().nSongs == catalog.getNSongs();
+        }
+
+        size_t getNDims() const {
+            return getHeader().nDims;
+        }
+
+        size_t getNCols() const {
+            return getHeader().nCols;
+        }
+
+        size_t getNEntries() const {
+            return getHeader().nEntries;
+        }
+
+        size_t getChannels() const {
+            return getHeader().channels;
+        }
+
+        size_t getBlockFrames() const {
+            return getHeader().blockFrames;
+        }
+
+        /**
+         * Function to project the blocks of a sample once, before searching the songs.
+         * @param sampleBlocks are the blocks of the sample, with as many values as the projected centroids.
+         * @param pool runs the sample blocks in parallel.
+         * @return the projected blocks.
+         */
+        Query project(MatrixView<const short> sampleBlocks, ThreadPool& pool) const {
+            size_t nCols = getHeader().nCols;
+            size_t nDims = getHeader().nDims;
+            Query query;
+
+            query.coords.resize(sampleBlocks.getRows() * nDims);
+            query.residuals.resize(sampleBlocks.getRows());
+            query.norms.resize(sampleBlocks.getRows());
+
+            std::vector<std::vector<double>> buffers(pool.getNThreads(), std::vector<double>(nCols));
+
+            pool.parallelFor(sampleBlocks.getRows(), [&](size_t block, size_t thread) {
+                double* projected = query.coords.data() + block * nDims;
+
+                query.residuals[block] = project(sampleBlocks.getRow(block), basis, nCols, nDims, projected, buffers[thread].data());
+                query.norms[block] = std::sqrt(query.residuals[block] * query.residuals[block]
+                                               + std::inner_product(projected, projected + nDims, projected, 0.0));
+            });
+
+            return query;
+        }
+
+        /**
+         * Function to find the exact distance of every sample block to the closest centroid of a song.
+         * @param query are the sample blocks projected by project.
+         * @param sampleBlocks are the same sample blocks.
+         * @param song is the position of the song in the catalog.
+         * @param codebook are the centroids of the song in the catalog.
+         * @param minDistances receives one exact distance per sample block.
+         * @return the number of full distances computed.
+         */
+        size_t nearest(const Query& query, MatrixView<const short> sampleBlocks, size_t song, MatrixView<const short> codebook,
+                       std::vector<uint64_t>& minDistances) const {
+            size_t nCols = codebook.getCols();
+            size_t nDims = getHeader().nDims;
+            size_t first = songOffsets[song];
+            size_t k = codebook.getRows();
+            size_t nEvaluated = 0;
+
+            std::vector<std::pair<double, size_t>> bounds(k);
+            std::vector<double> norms(k);
+
+            for (size_t row = 0; row < k; row++) {
+                const double* projected = coords + (first + row) * nDims;
+                norms[row] = std::sqrt(std::inner_product(projected, projected + nDims, projected, 0.0) + residuals[first + row] * residuals[first + row]);
+            }
+
+            minDistances.assign(sampleBlocks.getRows(), std::numeric_limits<uint64_t>::max());
+
+            for (size_t block = 0; block < sampleBlocks.getRows(); block++) {
+                const double* sampleProjected = query.coords.data() + block * nDims;
+                double sampleResidual = query.residuals[block];
+                double sampleNorm = query.norms[block];
+
+                for (size_t row = 0; row < k; row++) {
+                    const double* projected = coords + (first + row) * nDims;
+                    double bound = 0;
+
+                    for (size_t dim = 0; dim < nDims; dim++)
+                        bound += (sampleProjected[dim] - projected[dim]) * (sampleProjected[dim] - projected[dim]);
+
+                    /*
+                     * The residual norms come from a difference of energies; the slack covers their rounding.
+                     */
+                    double gap = std::max(0.0, std::abs(sampleResidual - residuals[first + row]) - 1e-6 * (sampleNorm + norms[row]) - 1);
+                    bounds[row] = std::make_pair(bound + gap * gap, row);
+                }
+
+                std::sort(bounds.begin(), bounds.end());
+
+                uint64_t minNoise = std::numeric_limits<uint64_t>::max();
+
+                for (size_t position = 0; position < k; position++) {
+                    size_t row = bounds[position].second;
+                    double slack = 1e-9 * (sampleNorm + norms[row]) * (sampleNorm + norms[row]) + 1;
+
+                    if (minNoise != std::numeric_limits<uint64_t>::max() && bounds[position].first - slack > (double) minNoise)
+                        break;
+
+                    uint64_t noise = squaredDistanceBounded(squaredDistance, sampleBlocks.getRow(block), codebook.getRow(row), nCols, minNoise);
+                    nEvaluated++;
+
+                    if (noise < minNoise)
+                        minNoise = noise;
+                }
+
+                minDistances[block] = minNoise;
+            }
+
+            return nEvaluated;
+        }
+
+        /**
+         * Function to fit the projection of a catalog and write it.
+         * Every song of the catalog must have the same channels, block size and features.
+         * The basis spans the principal subspace of evenly spaced centroids of the catalog, found
+         * with a few randomized subspace iterations (the basis is multiplied by XᵀX and orthonormalized).
+         * Errors are reported on std::cerr.
+         * @param catalog is the open catalog.
+         * @param path is the location of the new projection.
+         * @param options are the parameters of the projection.
+         * @param pool runs the fit and the projection of the centroids in parallel.
+         * @return true if the whole projection was written.
+         */
+        static bool build(const CatalogFile& catalog, const std::string& path, Options options, ThreadPool& pool) {
+            size_t nSongs = catalog.getNSongs();
+
+            if (nSongs == 0) {
+                std::cerr << "Error: the catalog has no songs" << std::endl;
+                return false;
+            }
+
+            CodebookInfo info = catalog.getInfo(0);
+            size_t nCols = catalog.getCentroids(0).getCols();
+            std::vector<uint64_t> firstRows(nSongs + 1, 0);
+
+            for (size_t song = 0; song < nSongs; song++) {
+                CodebookInfo songInfo = catalog.getInfo(song);
+
+                if (songInfo.channels != info.channels || songInfo.blockFrames != info.blockFrames || catalog.getCentroids(song).getCols() != nCols
+                        || songInfo.melBands != info.melBands || (info.melBands > 0 && songInfo.sampleRate != info.sampleRate)) {
+                    std::cerr << "Error: " << catalog.getName(song) << " does not have the channels, block size and features of "
+                              << catalog.getName(0) << ", every song of a projection must have the same" << std::endl;
+                    return false;
+                }
+
+                firstRows[song + 1] = firstRows[song] + catalog.getCentroids(song).getRows();
+            }
+
+            size_t nEntries = firstRows[nSongs];
+
+            if (nEntries == 0 || nCols == 0) {
+                std::cerr << "Error: the catalog has no centroids" << std::endl;
+                return false;
+            }
+
+            size_t nTraining = std::min(std::max<size_t>(options.trainingVectors, 1), nEntries);
+            size_t nDims = std::min(options.nDims > 0 ? options.nDims : DEFAULT_DIMS, nCols);
+
+            auto getRow = [&](uint64_t index) {
+                size_t song = std::upper_bound(firstRows.begin(), firstRows.end(), index) - firstRows.begin() - 1;
+                return catalog.getCentroids(song).getRow(index - firstRows[song]);
+            };
+
+            std::vector<double> rows(nDims * nCols);
+            std::mt19937_64 generator(options.seed);
+            std::normal_distribution<double> normal;
+
+            for (double& value : rows)
+                value = normal(generator);
+
+            orthonormalize(rows, nDims, nCols);
+
+            std::vector<double> projected(nTraining * nDims);
+            std::vector<std::vector<double>> buffers(pool.getNThreads(), std::vector<double>(nCols));
+            size_t nChunks = std::min(nCols, 16 * pool.getNThreads());
+
+            for (int iteration = 0; iteration < std::max(options.iterations, 1); iteration++) {
+                pool.parallelFor(nTraining, [&](size_t block, size_t thread) {
+                    project(getRow(block * nEntries / nTraining), rows.data(), nCols, nDims, projected.data() + block * nDims, buffers[thread].data());
+                });
+
+                /*
+                 * rows = projectedᵀ X, every task computes a range of the values of every row.
+                 */
+                pool.parallelFor(nChunks, [&](size_t chunk, size_t thread) {
+                    size_t begin = chunk * nCols / nChunks, end = (chunk + 1) * nCols / nChunks;
+                    double* buffer = buffers[thread].data();
+
+                    for (size_t dim = 0; dim < nDims; dim++)
+                        std::fill(rows.begin() + dim * nCols + begin, rows.begin() + dim * nCols + end, 0.0);
+
+                    for (size_t block = 0; block < nTraining; block++) {
+                        const short* values = getRow(block * nEntries / nTraining);
+
+                        for (size_t value = begin; value < end; value++)
+                            buffer[value] = values[value];
+
+                        for (size_t dim = 0; dim < nDims; dim++) {
+                            double weight = projected[block * nDims + dim];
+                            double* row = rows.data() + dim * nCols;
+
+                            for (size_t value = begin; value < end; value++)
+                                row[value] += weight * buffer[value];
+                        }
+                    }
+                });
+
+                orthonormalize(rows, nDims, nCols);
+            }
+
+            std::vector<double> entryCoords(nEntries * nDims);
+            std::vector<double> entryResiduals(nEntries);
+
+            pool.parallelFor(nSongs, [&](size_t song, size_t thread) {
+                MatrixView<const short> centroids = catalog.getCentroids(song);
+
+                for (size_t row = 0; row < centroids.getRows(); row++) {
+                    uint64_t index = firstRows[song] + row;
+                    entryResiduals[index] = project(centroids.getRow(row), rows.data(), nCols, nDims, entryCoords.data() + index * nDims,
+                                                    buffers[thread].data());
+                }
+            });
+
+            Header header = {};
+            std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+            header.version = VERSION;
+            header.headerSize = sizeof(Header);
+            header.nCols = nCols;
+            header.nDims = nDims;
+            header.channels = info.channels;
+            header.blockFrames = info.blockFrames;
+            header.nSongs = nSongs;
+            header.nEntries = nEntries;
+            header.catalogChecksum = catalog.getChecksum();
+
+            Layout layout = getLayout(header);
+            std::ofstream fp(path, std::ios::binary);
+            uint64_t written = sizeof(Header);
+            uint64_t checksum = CodebookFile::computeChecksum(nullptr, 0);
+
+            auto writeBytes = [&](const void* data, size_t nBytes) {
+                fp.write(static_cast<const char*>(data), nBytes);
+                checksum = CodebookFile::computeChecksum(data, nBytes, checksum);
+                written += nBytes;
+            };
+
+            auto padTo = [&](uint64_t offset) {
+                const char padding[Matrix<short>::ALIGNMENT] = {};
+                writeBytes(padding, offset - written);
+            };
+
+            fp.write(reinterpret_cast<const char*>(&header), sizeof(Header));
+
+            padTo(layout.basis);
+            writeBytes(rows.data(), rows.size() * sizeof(double));
+            padTo(layout.coords);
+            writeBytes(entryCoords.data(), entryCoords.size() * sizeof(double));
+            padTo(layout.residuals);
+            writeBytes(entryResiduals.data(), entryResiduals.size() * sizeof(double));
+            padTo(layout.songOffsets);
+            writeBytes(firstRows.data(), firstRows.size() * sizeof(uint64_t));
+
+            header.checksum = checksum;
+            fp.seekp(0);
+            fp.write(reinterpret_cast<const char*>(&header), sizeof(Header));
+
+            fp.close();
+            return !fp.fail();
+        }
+};
+
+#endif
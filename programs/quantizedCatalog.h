@@ -0,0 +1,460 @@
+#ifndef QUANTIZED_CATALOG_H
+#define QUANTIZED_CATALOG_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <numeric>
+#include <string>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "batchDistance.h"
+#include "catalogFile.h"
+#include "distance.h"
+#include "matrix.h"
+#include "threadPool.h"
+
+/**
+ * Copy of the centroids of a catalog as int8, to find the closest centroid of every sample block
+ * while streaming half the bytes, with the same result as the full search.
+ *
+ * Every row is stored as c ≈ ĉ = scale * q + offset, with q in [-127, 127], together with the
+ * norm of its quantization error ‖c - ĉ‖. The distances of the int16 sample blocks to the int8
+ * rows come from one matrix product (BatchDistance::getDots), and by the triangle inequality
+ * ‖x - c‖ >= ‖x - ĉ‖ - ‖c - ĉ‖. The centroids are visited from the lowest bound with the exact
+ * int16 distance, read from the catalog, and the search stops when the lowest bound left is above
+ * the best exact distance, so only the rows reranked are read in int16.
+ *
+ * The file is little-endian: a 64 byte header, then the int8 rows (padded to 64 bytes), the
+ * parameters of every row and the first row of every song (uint64, nSongs + 1). Every section
+ * starts at a 64 byte aligned offset. The header keeps the checksum of the catalog it was built
+ * from, and the checksum of everything after the header.
+ */
+class QuantizedCatalog {
+    public:
+        static constexpr uint32_t VERSION = 1;
+
+        /**
+         * Sample blocks prepared once for every song: their split for the matrix product, their
+         * energies and the sums of their values (for the offsets of the rows).
+         */
+        struct Query {
+            std::unique_ptr<BatchDistance> batch;
+            std::vector<uint64_t> energies;
+            std::vector<double> sums;
+        };
+
+    private:
+        struct Header {
+            char magic[8];
+            uint32_t version;
+            uint32_t headerSize;
+            uint32_t nCols;
+            uint32_t rowStride;
+            uint32_t channels;
+            uint32_t blockFrames;
+            uint64_t nSongs;
+            uint64_t nEntries;
+            uint64_t catalogChecksum;
+            uint64_t checksum;
+        };
+
+        /*
+         * Parameters of a row: ĉ = scale * q + offset, ‖ĉ‖² and an upper bound of ‖c - ĉ‖.
+         */
+        struct Row {
+            double scale;
+            double offset;
+            double energy;
+            double error;
+        };
+
+        /*
+         * Offsets of the sections, derived from the header.
+         */
+        struct Layout {
+            uint64_t rows, params, songOffsets, end;
+        };
+
+        static_assert(sizeof(Header) == 64, "the quantized catalog header must fill one cache line");
+
+        static constexpr char MAGIC[8] = {'T', 'A', 'I', 'Q', 'C', 'A', 'T', 'L'};
+
+        const char* mapping = nullptr;
+        size_t mappedBytes = 0;
+        const int8_t* rows = nullptr;
+        const Row* params = nullptr;
+        const uint64_t* songOffsets = nullptr;
+        SquaredDistanceFn squaredDistance = getSquaredDistance(bestDistanceKernel());
+
+        void close() {
+            if (mapping != nullptr)
+                munmap(const_cast<char*>(mapping), mappedBytes);
+
+            mapping = nullptr;
+            mappedBytes = 0;
+        }
+
+        const Header& getHeader() const {
+            return *reinterpret_cast<const Header*>(mapping);
+        }
+
+        static uint64_t alignUp(uint64_t offset) {
+            return (offset + Matrix<short>::ALIGNMENT - 1) / Matrix<short>::ALIGNMENT * Matrix<short>::ALIGNMENT;
+        }
+
+        static Layout getLayout(const Header& header) {
+            Layout layout;
+
+            layout.rows = alignUp(sizeof(Header));
+            layout.params = alignUp(layout.rows + header.nEntries * header.rowStride);
+            layout.songOffsets = alignUp(layout.params + header.nEntries * sizeof(Row));
+            layout.end = layout.songOffsets + (header.nSongs + 1) * sizeof(uint64_t);
+            return layout;
+        }
+
+        /*
+         * Quantizes a row on 255 levels centered on the middle of its range.
+         */
+        static Row quantize(const short* values, size_t nCols, int8_t* quantized) {
+            short low = *std::min_element(values, values + nCols);
+            short high = *std::max_element(values, values + nCols);
+            Row row;
+
+            row.scale = (high - low) / 254.0;
+            row.offset = (high + (double) low) / 2;
+            row.energy = 0;
+
+            double error = 0;
+
+            for (size_t value = 0; value < nCols; value++) {
+                double level = row.scale > 0 ? std::round((values[value] - row.offset) / row.scale) : 0;
+                quantized[value] = (int8_t) std::max(-127.0, std::min(127.0, level));
+
+                double approximation = row.scale * quantized[value] + row.offset;
+                row.energy += approximation * approximation;
+                error += (values[value] - approximation) * (values[value] - approximation);
+            }
+
+            /*
+             * Rounded up, so it stays an upper bound of the error.
+             */
+            row.error = std::sqrt(error) * (1 + 1e-9) + 1e-3;
+            return row;
+        }
+
+    public:
+        QuantizedCatalog() = default;
+
+        ~QuantizedCatalog() {
+            close();
+        }
+
+        QuantizedCatalog(const QuantizedCatalog&) = delete;
+
+        QuantizedCatalog& operator=(const QuantizedCatalog&) = delete;
+
+        /**
+         * Function to know if a file starts like a quantized catalog, without mapping it.
+         * @param path is the location of the file.
+         * @return true if the file has the quantized catalog magic.
+         */
+        static bool isQuantized(const std::string& path) {
+            std::ifstream fp(path, std::ios::binary);
+            char magic[sizeof(MAGIC)] = {};
+
+            return fp.read(magic, sizeof(magic)) && std::memcmp(magic, MAGIC, sizeof(MAGIC)) == 0;
+        }
+
+        /**
+         * Function to map a quantized catalog and check that its sections fit in the file.
+         * Errors are reported on std::cerr.
+         * @param path is the location of the quantized catalog.
+         * @return true if the quantized catalog was opened.
+         */
+        bool open(const std::string& path) {
+            close();
+
+            int fd = ::open(path.c_str(), O_RDONLY);
+            struct stat status;
+
+            if (fd < 0 || fstat(fd, &status) != 0 || (size_t) status.st_size < sizeof(Header)) {
+                if (fd >= 0)
+                    ::close(fd);
+                std::cerr << "Error: could not open the quantized catalog " << path << std::endl;
+                return false;
+            }
+
+            void* map = mmap(nullptr, status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            ::close(fd);
+
+            if (map == MAP_FAILED) {
+                std::cerr << "Error: could not map the quantized catalog " << path << std::endl;
+                return false;
+            }
+
+            mapping = static_cast<const char*>(map);
+            mappedBytes = status.st_size;
+            const Header& header = getHeader();
+
+            if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 || header.version != VERSION || header.headerSize != sizeof(Header)) {
+                std::cerr << "Error: unsupported quantized catalog version in " << path << std::endl;
+                close();
+                return false;
+            }
+
+            Layout layout = getLayout(header);
+
+            if (header.rowStride != Matrix<int8_t>::getPaddedStride(header.nCols) || layout.end > mappedBytes) {
+                std::cerr << "Error: truncated or corrupted quantized catalog " << path << std::endl;
+                close();
+                return false;
+            }
+
+            rows = reinterpret_cast<const int8_t*>(mapping + layout.rows);
+            params = reinterpret_cast<const Row*>(mapping + layout.params);
+            songOffsets = reinterpret_cast<const uint64_t*>(mapping + layout.songOffsets);
+
+            bool valid = songOffsets[0] == 0 && songOffsets[header.nSongs] == header.nEntries;
+            for (size_t song = 0; song < header.nSongs; song++)
+                valid = valid && songOffsets[song] <= songOffsets[song + 1];
+
+            if (!valid) {
+                std::cerr << "Error: truncated or corrupted quantized catalog " << path << std::endl;
+                close();
+                return false;
+            }
+
+            return true;
+        }
+
+        /**
+         * Function to check everything after the header against its checksum.
+         * This reads the whole quantized catalog.
+         * @return true if the quantized catalog is intact.
+         */
+        bool verify() const {
+            return CodebookFile::computeChecksum(mapping + sizeof(Header), getLayout(getHeader()).end - sizeof(Header)) == getHeader().checksum;
+        }
+
+        /**
+         * Function to know if the quantized catalog was built from a catalog, so its rows are the same.
+         * @param catalog is an open catalog.
+         * @return true if the catalog is the one quantized.
+         */
+        bool isBuiltFrom(const CatalogFile& catalog) const {
+            return getHeader().catalogChecksum == catalog.getChecksum() && getHeader().nSongs == catalog.getNSongs();
+        }
+
+        size_t getNCols() const {
+            return getHeader().nCols;
+        }
+
+        size_t getNEntries() const {
+            return getHeader().nEntries;
+        }
+
+        size_t getChannels() const {
+            return getHeader().channels;
+        }
+
+        size_t getBlockFrames() const {
+            return getHeader().blockFrames;
+        }
+
+        /**
+         * Function to get the int8 rows of a song.
+         * @param song is the position of the song in the catalog.
+         * @return the quantized centroids of the song.
+         */
+        MatrixView<const int8_t> getRows(size_t song) const {
+            return MatrixView<const int8_t>(rows + songOffsets[song] * getHeader().rowStride, songOffsets[song + 1] - songOffsets[song],
+                                            getHeader().nCols, getHeader().rowStride);
+        }
+
+        /**
+         * Function to prepare the blocks of a sample once, before searching the songs.
+         * @param sampleBlocks are the blocks of the sample, which must outlive the query.
+         * @param kernel selects the micro-kernel of the matrix product.
+         * @return the prepared blocks.
+         */
+        Query prepare(MatrixView<const short> sampleBlocks, DistanceKernel kernel = bestDistanceKernel()) const {
+            std::vector<short> silence(sampleBlocks.getCols(), 0);
+            Query query;
+
+            query.energies.resize(sampleBlocks.getRows());
+            query.sums.resize(sampleBlocks.getRows());
+
+            for (size_t block = 0; block < sampleBlocks.getRows(); block++) {
+                const short* values = sampleBlocks.getRow(block);
+
+                query.energies[block] = squaredDistance(values, silence.data(), sampleBlocks.getCols());
+                query.sums[block] = std::accumulate(values, values + sampleBlocks.getCols(), 0.0);
+            }
+
+            query.batch.reset(new BatchDistance(sampleBlocks, query.energies, kernel));
+            return query;
+        }
+
+        /**
+         * Function to find the exact distance of every sample block to the closest centroid of a song.
+         * @param query are the sample blocks prepared by prepare.
+         * @param sampleBlocks are the same sample blocks.
+         * @param song is the position of the song in the catalog.
+         * @param codebook are the int16 centroids of the song in the catalog.
+         * @param minDistances receives one exact distance per sample block.
+         * @return the number of int16 distances computed.
+         */
+        size_t nearest(const Query& query, MatrixView<const short> sampleBlocks, size_t song, MatrixView<const short> codebook,
+                       std::vector<uint64_t>& minDistances) const {
+            size_t nCols = codebook.getCols();
+            size_t first = songOffsets[song];
+            size_t k = codebook.getRows();
+            size_t nEvaluated = 0;
+
+            std::vector<int64_t> dots;
+            std::vector<std::pair<double, size_t>> bounds(k);
+
+            query.batch->getDots(getRows(song), dots);
+            minDistances.assign(sampleBlocks.getRows(), std::numeric_limits<uint64_t>::max());
+
+            for (size_t block = 0; block < sampleBlocks.getRows(); block++) {
+                double energy = query.energies[block];
+
+                for (size_t row = 0; row < k; row++) {
+                    const Row& param = params[first + row];
+
+                    /*
+                     * ‖x - ĉ‖², less a margin for its rounding, then the bound of ‖x - c‖².
+                     */
+                    double approximation = energy + param.energy - 2 * (param.scale * dots[block * k + row] + param.offset * query.sums[block])
+                                           - 1e-9 * (energy + param.energy) - 1;
+                    double gap = std::max(0.0, std::sqrt(std::max(0.0, approximation)) - param.error);
+
+                    bounds[row] = std::make_pair(gap * gap, row);
+                }
+
+                std::sort(bounds.begin(), bounds.end());
+
+                uint64_t minNoise = std::numeric_limits<uint64_t>::max();
+
+                for (size_t position = 0; position < k; position++) {
+                    if (minNoise != std::numeric_limits<uint64_t>::max() && bounds[position].first > (double) minNoise)
+                        break;
+
+                    size_t row = bounds[position].second;
+                    uint64_t noise = squaredDistanceBounded(squaredDistance, sampleBlocks.getRow(block), codebook.getRow(row), nCols, minNoise);
+                    nEvaluated++;
+
+                    if (noise < minNoise)
+                        minNoise = noise;
+                }
+
+                minDistances[block] = minNoise;
+            }
+
+            return nEvaluated;
+        }
+
+        /**
+         * Function to quantize the centroids of a catalog and write them.
+         * Every song of the catalog must have the same channels, block size and features.
+         * Errors are reported on std::cerr.
+         * @param catalog is the open catalog.
+         * @param path is the location of the new quantized catalog.
+         * @param pool quantizes the songs in parallel.
+         * @return true if the whole quantized catalog was written.
+         */
+        static bool build(const CatalogFile& catalog, const std::string& path, ThreadPool& pool) {
+            size_t nSongs = catalog.getNSongs();
+
+            if (nSongs == 0) {
+                std::cerr << "Error: the catalog has no songs" << std::endl;
+                return false;
+            }
+
+            CodebookInfo info = catalog.getInfo(0);
+            size_t nCols = catalog.getCentroids(0).getCols();
+            std::vector<uint64_t> firstRows(nSongs + 1, 0);
+
+            for (size_t song = 0; song < nSongs; song++) {
+                CodebookInfo songInfo = catalog.getInfo(song);
+
+                if (songInfo.channels != info.channels || songInfo.blockFrames != info.blockFrames || catalog.getCentroids(song).getCols() != nCols
+                        || songInfo.melBands != info.melBands || (info.melBands > 0 && songInfo.sampleRate != info.sampleRate)) {
+                    std::cerr << "Error: " << catalog.getName(song) << " does not have the channels, block size and features of "
+                              << catalog.getName(0) << ", every song of a quantized catalog must have the same" << std::endl;
+                    return false;
+                }
+
+                firstRows[song + 1] = firstRows[song] + catalog.getCentroids(song).getRows();
+            }
+
+            size_t nEntries = firstRows[nSongs];
+            Matrix<int8_t> quantized(nEntries, nCols);
+            std::vector<Row> rowParams(nEntries);
+
+            pool.parallelFor(nSongs, [&](size_t song, size_t) {
+                MatrixView<const short> centroids = catalog.getCentroids(song);
+
+                for (size_t row = 0; row < centroids.getRows(); row++)
+                    rowParams[firstRows[song] + row] = quantize(centroids.getRow(row), nCols, quantized.getRow(firstRows[song] + row));
+            });
+
+            Header header = {};
+            std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+            header.version = VERSION;
+            header.headerSize = sizeof(Header);
+            header.nCols = nCols;
+            header.rowStride = Matrix<int8_t>::getPaddedStride(nCols);
+            header.channels = info.channels;
+            header.blockFrames = info.blockFrames;
+            header.nSongs = nSongs;
+            header.nEntries = nEntries;
+            header.catalogChecksum = catalog.getChecksum();
+
+            Layout layout = getLayout(header);
+            std::ofstream fp(path, std::ios::binary);
+            uint64_t written = sizeof(Header);
+            uint64_t checksum = CodebookFile::computeChecksum(nullptr, 0);
+
+            auto writeBytes = [&](const void* data, size_t nBytes) {
+                fp.write(static_cast<const char*>(data), nBytes);
+                checksum = CodebookFile::computeChecksum(data, nBytes, checksum);
+                written += nBytes;
+            };
+
+            auto padTo = [&](uint64_t offset) {
+                const char padding[Matrix<short>::ALIGNMENT] = {};
+                writeBytes(padding, offset - written);
+            };
+
+            fp.write(reinterpret_cast<const char*>(&header), sizeof(Header));
+
+            padTo(layout.rows);
+            if (nEntries > 0)
+                writeBytes(quantized.getRow(0), nEntries * header.rowStride);
+            padTo(layout.params);
+            writeBytes(rowParams.data(), rowParams.size() * sizeof(Row));
+            padTo(layout.songOffsets);
+            writeBytes(firstRows.data(), firstRows.size() * sizeof(uint64_t));
+
+            header.checksum = checksum;
+            fp.seekp(0);
+            fp.write(reinterpret_cast<const char*>(&header), sizeof(Header));
+
+            fp.close();
+            return !fp.fail();
+        }
+};
+
+#endif
@@ -0,0 +1,167 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Pool of threads that lives for the whole program and runs parallel loops over chunks.
+ * The chunks of a loop are first split evenly between the threads, and a thread that
+ * runs out of chunks steals half of the remaining chunks of another thread.
+ * The thread that calls parallelFor works as thread 0, so a pool of n threads only
+ * creates n - 1 threads.
+ */
+class ThreadPool {
+    public:
+        typedef std::function<void(size_t chunk, size_t thread)> Task;
+
+    private:
+        /*
+         * Range [begin, end) of chunks still owned by a thread. Padded to its own cache line.
+         */
+        struct alignas(64) ChunkQueue {
+            std::mutex m;
+            size_t begin = 0, end = 0;
+        };
+
+        std::vector<std::thread> workers;
+        std::vector<ChunkQueue> queues;
+
+        std::mutex submitMutex;
+        std::mutex m;
+        std::condition_variable wake, finished;
+        const Task* task = nullptr;
+        size_t generation = 0;
+        size_t activeWorkers = 0;
+        bool stop = false;
+
+        bool popChunk(size_t thread, size_t& chunk) {
+            std::lock_guard<std::mutex> lock(queues[thread].m);
+
+            if (queues[thread].begin == queues[thread].end)
+                return false;
+
+            chunk = queues[thread].begin++;
+            return true;
+        }
+
+        bool stealChunks(size_t thread) {
+            for (size_t i = 1; i < queues.size(); i++) {
+                ChunkQueue& victim = queues[(thread + i) % queues.size()];
+                size_t begin, end;
+                {
+                    std::lock_guard<std::mutex> lock(victim.m);
+                    size_t remaining = victim.end - victim.begin;
+
+                    if (remaining == 0)
+                        continue;
+
+                    end = victim.end;
+                    begin = end - (remaining + 1) / 2;
+                    victim.end = begin;
+                }
+
+                std::lock_guard<std::mutex> lock(queues[thread].m);
+                queues[thread].begin = begin;
+                queues[thread].end = end;
+                return true;
+            }
+
+            return false;
+        }
+
+        void runChunks(size_t thread) {
+            size_t chunk;
+
+            do {
+                while (popChunk(thread, chunk))
+                    (*task)(chunk, thread);
+            } while (stealChunks(thread));
+        }
+
+        void workerLoop(size_t thread) {
+            size_t seen = 0;
+
+            while (true) {
+                {
+                    std::unique_lock<std::mutex> lock(m);
+                    wake.wait(lock, [&] { return stop || generation != seen; });
+
+                    if (stop)
+                        return;
+
+                    seen = generation;
+                }
+
+                runChunks(thread);
+
+                std::lock_guard<std::mutex> lock(m);
+                if (--activeWorkers == 0)
+                    finished.notify_one();
+            }
+        }
+
+    public:
+        explicit ThreadPool(size_t nThreads) : queues(nThreads > 0 ? nThreads : 1) {
+            for (size_t thread = 1; thread < queues.size(); thread++)
+                workers.emplace_back(&ThreadPool::workerLoop, this, thread);
+        }
+
+        ~ThreadPool() {
+            {
+                std::lock_guard<std::mutex> lock(m);
+                stop = true;
+            }
+            wake.notify_all();
+
+            for (std::thread& worker : workers)
+                worker.join();
+        }
+
+        ThreadPool(const ThreadPool&) = delete;
+
+        ThreadPool& operator=(const ThreadPool&) = delete;
+
+        /**
+         * Function to retrieve the number of threads that run the chunks, including the caller.
+         * @return the number of threads of the pool.
+         */
+        size_t getNThreads() const {
+            return queues.size();
+        }
+
+        /**
+         * Function to run a task over every chunk in [0, nChunks) and wait for all of them.
+         * Calls from different threads are executed one after the other.
+         * @param nChunks is the number of chunks.
+         * @param task receives the chunk index and the index of the thread running it.
+         */
+        void parallelFor(size_t nChunks, const Task& task) {
+            std::lock_guard<std::mutex> submit(submitMutex);
+
+            for (size_t thread = 0; thread < queues.size(); thread++) {
+                std::lock_guard<std::mutex> lock(queues[thread].m);
+                queues[thread].begin = nChunks * thread / queues.size();
+                queues[thread].end = nChunks * (thread + 1) / queues.size();
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(m);
+                this->task = &task;
+                activeWorkers = workers.size();
+                generation++;
+            }
+            wake.notify_all();
+
+            runChunks(0);
+
+            std::unique_lock<std::mutex> lock(m);
+            finished.wait(lock, [&] { return activeWorkers == 0; });
+            this->task = nullptr;
+        }
+};
+
+#endif
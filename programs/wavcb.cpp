@@ -5,24 +5,276 @@
 #include "wavcb.h"
 #include <filesystem>
 #include <fstream>
+#include <sstream>
 #include <chrono>
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <charconv>
+#include <cstdint>
+#include "boundedQueue.h"
+#include "codebookFile.h"
 
 using namespace std;
 
 
-void fileWriter(string name, std::vector<std::vector<short>> codebook){
-    ofstream fp;
-    fp.open(name.substr(0, name.length() -3) + "codebook");
-    for(size_t i = 0; i < codebook.size(); i++){
-        for(size_t j = 0; j < codebook[i].size(); j++){
-            fp << codebook[i][j] << " ";
+/*
+  Escreve o codebook em name (trocando a extensão por .codebook) no formato binário ou,
+  com text, no formato de texto antigo. Devolve false se o ficheiro não foi escrito.
+*/
+bool fileWriter(string name, const Matrix<short>& codebook, const CodebookInfo& info, bool text){
+    string path = name.substr(0, name.length() -3) + "codebook";
+
+    if(text){
+        return CodebookFile::writeText(path, codebook.view());
+    }
+    return CodebookFile::write(path, codebook.view(), info);
+}
+
+/*
+  Parâmetros do áudio guardados no cabeçalho do codebook.
+*/
+CodebookInfo getCodebookInfo(SndfileHandle& wavFile, const CodebookOptions& options){
+    CodebookInfo info;
+    info.channels = wavFile.channels();
+    info.sampleRate = wavFile.samplerate();
+    info.blockFrames = options.blockSize;
+    info.overlapFrames = options.overlappingFactor;
+    info.melBands = options.melBands;
+    return info;
+}
+
+/*
+  Mostra quanto um passo de Lloyd com todos os blocos ainda baixou a distorção do treino por mini-lotes
+  (só um limite inferior da distância ao k-means com todos os blocos) e, com --compare-full
+  (fullBatchIterations > 0), a distorção desse k-means corrido até convergir.
+*/
+void reportMiniBatch(double miniBatch, double refined, double fullBatch, int fullBatchIterations, size_t memBudget){
+    if(memBudget == 0){
+        return;
+    }
+
+    std::cout << "Mini-batch distortion per block: " << miniBatch
+              << ", after one more full-batch Lloyd step: " << refined
+              << " (" << (miniBatch > 0 ? 100.0 * (miniBatch - refined) / miniBatch : 0.0)
+              << "% lower, only a lower bound on the gap to full-batch k-means)." << std::endl;
+
+    if(fullBatchIterations > 0){
+        std::cout << "Full-batch Lloyd distortion per block from the same initial centroids: " << fullBatch
+                  << " after " << fullBatchIterations << " iterations (mini-batch is "
+                  << (fullBatch > 0 ? 100.0 * (miniBatch - fullBatch) / fullBatch : 0.0) << "% higher)." << std::endl;
+    }
+}
+
+/*
+  Ficheiro aberto (e descodificado, fora do modo por mini-lotes) pela etapa de leitura.
+  O reader guarda uma referência para o handle, por isso o ficheiro não é copiado nem movido.
+*/
+struct DecodedFile {
+    std::string path, name;
+    SndfileHandle wavFile;
+    std::unique_ptr<BlockReader> reader;
+    std::chrono::high_resolution_clock::time_point start;
+};
+
+/*
+  Codebook calculado, à espera de ser escrito.
+*/
+struct ClusteredFile {
+    std::string name;
+    Matrix<short> codebook;
+    CodebookInfo info;
+    std::chrono::high_resolution_clock::time_point start;
+    int iterations = 0, fullBatchIterations = 0;
+    double miniBatchDistortion = 0.0, refinedDistortion = 0.0, fullBatchDistortion = 0.0;
+};
+
+/*
+  Calcula os codebooks de todos os .wav de directory num pipeline de três etapas ligadas por
+  filas limitadas: uma thread descodifica os ficheiros, nFiles threads calculam os codebooks
+  e a thread que chama escreve-os. Os k-means de todos os ficheiros correm na mesma pool de
+  nThreads threads: os ciclos paralelos de cada ficheiro usam sempre todas as threads (a pool
+  executa um ciclo de cada vez) e as partes sequenciais de um ficheiro sobrepõem-se aos ciclos
+  dos outros, por isso o último ficheiro grande não fica com uma só thread.
+  As filas têm nFiles lugares, por isso no máximo cerca de 3 x nFiles ficheiros estão em memória.
+  Os ficheiros maiores são processados primeiro para que no fim não fique um ficheiro grande
+  a atrasar o fim. Um ficheiro com erro é reportado no fim e não pára os restantes.
+*/
+int processDirectory(const std::string& directory, const std::string& output, CodebookOptions options, size_t nThreads, size_t nFiles, bool text){
+
+    std::vector<std::filesystem::path> files;
+
+    try{
+        for (const auto & entry : std::filesystem::directory_iterator(directory)){
+            std::string file = entry.path().string();
+
+            if(file.length() >= 4 && file.compare(file.length()-4, 4, ".wav") == 0){
+                files.push_back(entry.path());
+            }
         }
-        fp << "\n";
 
+        std::stable_sort(files.begin(), files.end(), [](const std::filesystem::path& a, const std::filesystem::path& b){
+            return std::filesystem::file_size(a) > std::filesystem::file_size(b);
+        });
     }
+    catch(std::filesystem::filesystem_error & e){
+        std::cerr << "Error: invalid directory" << std::endl;
+        return 1;
+    }
+
+    if(files.empty()){
+        std::cerr << "Error: no .wav files in the directory" << std::endl;
+        return 1;
+    }
+
+    if(nFiles == 0){
+        nFiles = std::min(files.size(), nThreads);
+    }
+    nFiles = std::max<size_t>(1, std::min({nFiles, files.size(), nThreads}));
+
+    /*
+      O limite de memória é dividido pelos ficheiros processados ao mesmo tempo.
+    */
+    options.memBudget /= nFiles;
+
+    auto begin = std::chrono::high_resolution_clock::now();
+
+    std::mutex outputMutex;
+    std::vector<std::string> failed;
+
+    auto fail = [&](const std::string& name, const std::string& reason){
+        std::lock_guard<std::mutex> lock(outputMutex);
+        std::cerr << "Error: " << name << ": " << reason << std::endl;
+        failed.push_back(name);
+    };
+
+    BoundedQueue<std::unique_ptr<DecodedFile>> decoded(nFiles);
+    BoundedQueue<std::unique_ptr<ClusteredFile>> clustered(nFiles);
+
+    /*
+      Etapa de leitura.
+    */
+    std::thread decoder([&](){
+        for(const std::filesystem::path& path : files){
+            std::unique_ptr<DecodedFile> job(new DecodedFile());
+            job->path = path.string();
+            job->name = path.filename().string();
+            job->start = std::chrono::high_resolution_clock::now();
+            job->wavFile = SndfileHandle(job->path);
+
+            if(job->wavFile.error()) {
+                fail(job->name, "invalid input file");
+                continue;
+            }
+            if((job->wavFile.format() & SF_FORMAT_TYPEMASK) != SF_FORMAT_WAV) {
+                fail(job->name, "file is not in WAV format");
+                continue;
+            }
+
+            job->reader.reset(new BlockReader(job->wavFile, options.blockSize, options.overlappingFactor));
+
+            /*
+              Por mini-lotes os blocos são lidos durante o treino.
+            */
+            if(options.memBudget == 0 && job->reader->getNBlocks() >= options.codebookSize && job->reader->readAll().getRows() == 0){
+                fail(job->name, "could not read all the blocks of the file");
+                continue;
+            }
+
+            decoded.push(std::move(job));
+        }
+        decoded.close();
+    });
+
+    /*
+      Etapa de clustering: todos os ficheiros partilham a pool do processo.
+    */
+    ThreadPool pool(nThreads);
+    std::vector<std::thread> clusterers;
+    size_t clusterersLeft = nFiles;
+    std::mutex clusterersMutex;
+
+    for(size_t worker = 0; worker < nFiles; worker++){
+        clusterers.emplace_back([&](){
+            std::unique_ptr<DecodedFile> job;
+
+            while(decoded.pop(job)){
+                {
+                    std::lock_guard<std::mutex> lock(outputMutex);
+                    std::cout << "Doing the codebook of the file: " << job->name << std::endl;
+                }
 
+                WAVCb codebookGenerator;
+                std::unique_ptr<ClusteredFile> result(new ClusteredFile());
+                result->codebook = codebookGenerator.getCodebook(*job->reader, options, pool);
 
-    fp.close();
+                if(result->codebook.getRows() == 0){
+                    fail(job->name, "could not compute the codebook");
+                    continue;
+                }
+
+                result->name = job->name;
+                result->info = getCodebookInfo(job->wavFile, options);
+                result->start = job->start;
+                result->iterations = codebookGenerator.getIterations();
+                result->miniBatchDistortion = codebookGenerator.getMiniBatchDistortion();
+                result->refinedDistortion = codebookGenerator.getRefinedDistortion();
+                result->fullBatchDistortion = codebookGenerator.getFullBatchDistortion();
+                result->fullBatchIterations = codebookGenerator.getFullBatchIterations();
+
+                /*
+                  Liberta as amostras antes de esperar por lugar na fila de escrita.
+                */
+                job.reset();
+                clustered.push(std::move(result));
+            }
+
+            std::lock_guard<std::mutex> lock(clusterersMutex);
+            if(--clusterersLeft == 0){
+                clustered.close();
+            }
+        });
+    }
+
+    /*
+      Etapa de escrita.
+    */
+    size_t written = 0;
+    std::unique_ptr<ClusteredFile> result;
+
+    while(clustered.pop(result)){
+        if(!fileWriter(output + result->name, result->codebook, result->info, text)){
+            fail(result->name, "could not write the codebook");
+            continue;
+        }
+        written++;
+
+        auto stop = std::chrono::high_resolution_clock::now();
+        auto duration = std::chrono::duration_cast<std::chrono::seconds>(stop - result->start);
+
+        std::lock_guard<std::mutex> lock(outputMutex);
+        std::cout << "Codebook of " << result->name << " finished in: " << duration.count()  << " seconds (" << result->iterations << " iterations)." << std::endl;
+        reportMiniBatch(result->miniBatchDistortion, result->refinedDistortion, result->fullBatchDistortion, result->fullBatchIterations, options.memBudget);
+    }
+
+    decoder.join();
+    for(std::thread& clusterer : clusterers){
+        clusterer.join();
+    }
+
+    auto duration = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::high_resolution_clock::now() - begin);
+    std::cout << written << " codebooks finished in: " << duration.count() << " seconds (" << nFiles << " files at a time)." << std::endl;
+
+    if(!failed.empty()){
+        std::cerr << failed.size() << " files failed:" << std::endl;
+        for(const std::string& name : failed){
+            std::cerr << "  " << name << std::endl;
+        }
+        return 1;
+    }
+
+    return 0;
 }
 
 bool is_number(std::string s)
@@ -32,6 +284,24 @@ bool is_number(std::string s)
     return !s.empty() && it == s.end();
 }
 
+/*
+  Lê um inteiro sem sinal que ocupa todo o argumento e não passa de max.
+  Devolve false, sem alterar value, se o argumento não for um número ou for grande demais.
+*/
+bool parse_unsigned(const char* s, uint64_t max, uint64_t& value)
+{
+    const char* end = s + std::strlen(s);
+    uint64_t parsed = 0;
+    std::from_chars_result result = std::from_chars(s, end, parsed);
+
+    if(!is_number(s) || result.ec != std::errc() || result.ptr != end || parsed > max){
+        return false;
+    }
+
+    value = parsed;
+    return true;
+}
+
 int main(int argc, char *argv[]) {
 
     if(argc < 5) {
@@ -43,6 +313,16 @@ int main(int argc, char *argv[]) {
         std::cerr << "-c codebook size" << std::endl;
         std::cerr << "-i max iterations in Kmeans" << std::endl;
         std::cerr << "-t number of threads" << std::endl;
+        std::cerr << "-j number of files processed at the same time with -d, default is min(files, threads)" << std::endl;
+        std::cerr << "-s seed for the kmeans initialization, default is 1" << std::endl;
+        std::cerr << "-a kmeans algorithm (lloyd, hamerly), default is lloyd" << std::endl;
+        std::cerr << "--mem-budget memory limit in MB, trains with mini-batches read from the file" << std::endl;
+        std::cerr << "--compare-full with --mem-budget, also runs full-batch Lloyd (streamed from the file) and reports its distortion" << std::endl;
+        std::cerr << "-k distance kernel (scalar, sse2, avx2, avx512), default is the fastest supported" << std::endl;
+        std::cerr << "-r codebook used as the initial centroids (with -f), its size replaces -c" << std::endl;
+        std::cerr << "-e 'filename' more audio of the same song, trained together with -f (can be repeated)" << std::endl;
+        std::cerr << "--text writes the codebook in the old text format instead of the binary one" << std::endl;
+        std::cerr << "--mel bands trains with the log-mel features of the blocks, with that many bands (e.g. " << LogMel::DEFAULT_BANDS << ")" << std::endl;
         std::cerr << "-w outputfile (if using -f) or outputpath (if using -d)" << std::endl;
         std::cerr << "Use at least -f or -d options" << std::endl;    
         return 1; 
@@ -51,16 +331,34 @@ int main(int argc, char *argv[]) {
     string directory = "";
     string file = "";
     string output = "";
+    string initialCodebook = "";
+    vector<string> extraFiles;
+    bool text = false;
+    bool compareFull = false;
 
     size_t blockSize = 5000;
     float overlappingFactor = 0.5;
     size_t codebookSize = 150;
     int iterations = 100;
     int nThreads = 4;
+    size_t nFiles = 0;
+    DistanceKernel kernel = bestDistanceKernel();
+    KMeansAlgorithm algorithm = KMeansAlgorithm::Lloyd;
+    uint64_t seed = 1;
+    size_t memBudget = 0;
+    size_t melBands = 0;
 
     for(int i = 1; i < argc; i++){
         
-        if(strcmp("-f", argv[i]) == 0){
+        if(strcmp("--text", argv[i]) == 0){
+            text = true;
+            continue;
+        }
+        else if(strcmp("--compare-full", argv[i]) == 0){
+            compareFull = true;
+            continue;
+        }
+        else if(strcmp("-f", argv[i]) == 0){
             file = argv[i+1];
         }
 
@@ -79,8 +377,11 @@ int main(int argc, char *argv[]) {
 
         else if(strcmp("-o", argv[i]) == 0 ){
             overlappingFactor = std::atof( argv[i+1] );
-            if(overlappingFactor == 0){
-                std::cerr << "Error: invalid overlaping factor" << std::endl;
+            /*
+              Os blocos têm de avançar pelo menos uma frame: com 1 ou mais nunca saíam do sítio.
+            */
+            if(!(overlappingFactor > 0 && overlappingFactor < 1)){
+                std::cerr << "Error: invalid overlaping factor, it must be between 0 and 1" << std::endl;
                 return 1;
             }
             
@@ -108,6 +409,62 @@ int main(int argc, char *argv[]) {
                 return 1;
             }
         }
+        else if(strcmp("-j", argv[i]) == 0 ){
+            if(!is_number(argv[i+1]) || std::atoi( argv[i+1] ) <= 0){
+                std::cerr << "Error: invalid number of files at the same time" << std::endl;
+                return 1;
+            }
+            nFiles = std::atoi( argv[i+1] );
+        }
+        else if(strcmp("-s", argv[i]) == 0 ){
+            if(!parse_unsigned(argv[i+1], UINT64_MAX, seed)){
+                std::cerr << "Error: invalid seed, it must be a number up to " << UINT64_MAX << std::endl;
+                return 1;
+            }
+        }
+        else if(strcmp("-a", argv[i]) == 0 ){
+            if(strcmp("lloyd", argv[i+1]) == 0){
+                algorithm = KMeansAlgorithm::Lloyd;
+            }
+            else if(strcmp("hamerly", argv[i+1]) == 0){
+                algorithm = KMeansAlgorithm::Hamerly;
+            }
+            else{
+                std::cerr << "Error: invalid kmeans algorithm" << std::endl;
+                return 1;
+            }
+        }
+        else if(strcmp("-k", argv[i]) == 0 ){
+            if(!parseDistanceKernel(argv[i+1], kernel)){
+                std::cerr << "Error: invalid distance kernel" << std::endl;
+                return 1;
+            }
+            if(!isDistanceKernelSupported(kernel)){
+                std::cerr << "Error: distance kernel not supported by this CPU" << std::endl;
+                return 1;
+            }
+        }
+        else if(strcmp("--mem-budget", argv[i]) == 0 ){
+            uint64_t megabytes;
+            if(!parse_unsigned(argv[i+1], SIZE_MAX / (1024 * 1024), megabytes) || megabytes == 0){
+                std::cerr << "Error: invalid memory budget" << std::endl;
+                return 1;
+            }
+            memBudget = megabytes * 1024 * 1024;
+        }
+        else if(strcmp("--mel", argv[i]) == 0 ){
+            if(!is_number(argv[i+1]) || std::atoi( argv[i+1] ) <= 0){
+                std::cerr << "Error: invalid number of mel bands" << std::endl;
+                return 1;
+            }
+            melBands = std::atoi( argv[i+1] );
+        }
+        else if(strcmp("-r", argv[i]) == 0 ){
+            initialCodebook = argv[i+1];
+        }
+        else if(strcmp("-e", argv[i]) == 0 ){
+            extraFiles.push_back(argv[i+1]);
+        }
         else if(strcmp("-w", argv[i]) == 0 ){
             output = argv[i+1];
         }
@@ -122,88 +479,118 @@ int main(int argc, char *argv[]) {
         std::cerr << "Error: invalid output file/path" << std::endl;
     }
 
+    CodebookOptions options;
+    options.blockSize = blockSize;
+    options.overlappingFactor = blockSize*overlappingFactor;
+
+    if(options.overlappingFactor >= options.blockSize){
+        std::cerr << "Error: the overlap must be smaller than the block size" << std::endl;
+        return 1;
+    }
+    options.codebookSize = codebookSize;
+    options.maxIterations = iterations;
+    options.kernel = kernel;
+    options.algorithm = algorithm;
+    options.seed = seed;
+    options.memBudget = memBudget;
+    options.melBands = melBands;
+    options.compareFull = compareFull;
+
+    if(compareFull && memBudget == 0){
+        std::cerr << "Error: --compare-full can only be used with --mem-budget" << std::endl;
+        return 1;
+    }
+
+    if(text && melBands > 0){
+        std::cerr << "Error: log-mel codebooks can only be written in the binary format" << std::endl;
+        return 1;
+    }
+
     if( file.compare("") != 0 && directory.compare("") == 0){
 
         std::cout << "Doing the codebook of the file: " << file << std::endl;
         auto start = std::chrono::high_resolution_clock::now(); 
 
-        SndfileHandle sndFileIn { file }; 
-        if(sndFileIn.error()) {
-            std::cerr << "Error: invalid input file" << std::endl;
-            return 1; 
+        /*
+          O ficheiro principal e o áudio extra da mesma música, todos com os mesmos blocos.
+        */
+        vector<string> files = { file };
+        files.insert(files.end(), extraFiles.begin(), extraFiles.end());
+
+        vector<SndfileHandle> sndFiles;
+        vector<unique_ptr<BlockReader>> readers;
+        vector<BlockReader*> readerPtrs;
+
+        for(const string& name : files){
+            SndfileHandle sndFileIn { name }; 
+            if(sndFileIn.error()) {
+                std::cerr << "Error: invalid input file " << name << std::endl;
+                return 1; 
+            }
+            if((sndFileIn.format() & SF_FORMAT_TYPEMASK) != SF_FORMAT_WAV) {
+                std::cerr << "Error: file " << name << " is not in WAV format" << std::endl;
+                return 1; 
+            }
+            sndFiles.push_back(sndFileIn);
         }
-        if((sndFileIn.format() & SF_FORMAT_TYPEMASK) != SF_FORMAT_WAV) {
-            std::cerr << "Error: file is not in WAV format" << std::endl;
-            return 1; 
+
+        for(SndfileHandle& sndFileIn : sndFiles){
+            readers.emplace_back(new BlockReader(sndFileIn, options.blockSize, options.overlappingFactor));
+            readerPtrs.push_back(readers.back().get());
         }
 
+        CodebookFile initial;
+        if(initialCodebook.compare("") != 0){
+            if(!initial.open(initialCodebook) || !initial.verify()){
+                std::cerr << "Error: invalid initial codebook" << std::endl;
+                return 1;
+            }
+
+            /*
+              Um codebook binário guarda o formato dos blocos, que tem de ser o da música (o
+              overlap pode mudar). Os codebooks de texto não o guardam, só as dimensões são verificadas.
+            */
+            CodebookInfo expected = getCodebookInfo(sndFiles[0], options);
+            const CodebookInfo& info = initial.getInfo();
+            if(initial.isBinary() && (info.channels != expected.channels || info.blockFrames != expected.blockFrames
+                                      || info.melBands != expected.melBands || info.sampleRate != expected.sampleRate)){
+                std::cerr << "Error: the initial codebook has blocks of " << info.blockFrames << " frames, " << info.channels << " channels, "
+                          << info.sampleRate << " Hz and " << info.melBands << " mel bands, but this run uses " << expected.blockFrames << " frames, "
+                          << expected.channels << " channels, " << expected.sampleRate << " Hz and " << expected.melBands << " mel bands" << std::endl;
+                return 1;
+            }
+
+            options.codebookSize = initial.getCentroids().getRows();
+            options.initialCodebook = initial.getCentroids();
+        }
+
+        ThreadPool pool(nThreads);
         WAVCb codebookGenerator;
 
-        std::vector<std::vector<short>> codebook = codebookGenerator.getCodebook(sndFileIn, 
-                blockSize, 
-                blockSize*overlappingFactor, 
-                codebookSize, 
-                iterations,
-                nThreads);
+        Matrix<short> codebook = codebookGenerator.getCodebook(readerPtrs, options, pool);
 
-        if(codebook.size() == 0){
+        if(codebook.getRows() == 0){
             return 1;
         }
 
         auto stop = std::chrono::high_resolution_clock::now();
 
-        fileWriter(output, codebook);
+        if(!fileWriter(output, codebook, getCodebookInfo(sndFiles[0], options), text)){
+            std::cerr << "Error: could not write the codebook" << std::endl;
+            return 1;
+        }
         
         auto duration = std::chrono::duration_cast<std::chrono::seconds>(stop - start); 
-        std::cout << "Codebook finished in: " << duration.count()  << " seconds." << std::endl;
+        std::cout << "Codebook finished in: " << duration.count()  << " seconds (" << codebookGenerator.getIterations() << " iterations)." << std::endl;
+        reportMiniBatch(codebookGenerator.getMiniBatchDistortion(), codebookGenerator.getRefinedDistortion(),
+                        codebookGenerator.getFullBatchDistortion(), codebookGenerator.getFullBatchIterations(), memBudget);
     }
     else if( file.compare("") == 0 && directory.compare("") != 0){
-        
-        try{
-            for (const auto & entry : std::filesystem::directory_iterator(directory)){
-
-                std::string file = entry.path().string();
-
-                if(file.compare(file.length()-4, 4, ".wav") == 0){
-                    
-                    std::cout << "Doing the codebook of the file: " << entry.path().filename() << std::endl;
-                    auto start = std::chrono::high_resolution_clock::now(); 
-
-                    SndfileHandle sndFileIn { file }; 
-                    if(sndFileIn.error()) {
-                        std::cerr << "Error: invalid input file" << std::endl;
-                        return 1; 
-                    }
-                    if((sndFileIn.format() & SF_FORMAT_TYPEMASK) != SF_FORMAT_WAV) {
-                        std::cerr << "Error: file is not in WAV format" << std::endl;
-                        return 1; 
-                    }
-
-                    WAVCb codebookGenerator;
-
-                    std::vector<std::vector<short>> codebook = codebookGenerator.getCodebook(sndFileIn, 
-                            blockSize, 
-                            blockSize*overlappingFactor, 
-                            codebookSize, 
-                            iterations,
-                            nThreads);
-                    if(codebook.size() == 0){
-                        return 1;
-                    }
-
-                    auto stop = std::chrono::high_resolution_clock::now();
-
-                    fileWriter(output + (string)entry.path().filename(), codebook);
-                    
-                    auto duration = std::chrono::duration_cast<std::chrono::seconds>(stop - start); 
-                    std::cout << "Codebook finished in: " << duration.count()  << " seconds." << std::endl;
-                }
-            }
-        }
-        catch(std::filesystem::filesystem_error & e){
-            std::cerr << "Error: invalid directory" << std::endl;
+        if(initialCodebook.compare("") != 0 || !extraFiles.empty()){
+            std::cerr << "Error: -r and -e can only be used with -f" << std::endl;
             return 1;
         }
+        return processDirectory(directory, output, options, nThreads, nFiles, text);
     }
     else{
         std::cerr << "Use only -f or -d not both." << std::endl;
@@ -4,41 +4,242 @@
 #include <time.h>
 #include <stdlib.h>
 #include "kMeans.h"
+#include "blockReader.h"
+#include "miniBatchKMeans.h"
+#include "logMel.h"
+
+/*
+  Parâmetros usados no cálculo de um codebook.
+  Se memBudget for diferente de 0 o codebook é treinado por mini-lotes com esse limite de memória (bytes).
+  Com compareFull o treino por mini-lotes é comparado com Lloyd com todos os blocos até convergir.
+  Se initialCodebook não for vazio (codebookSize linhas com os valores de um bloco) o treino
+  começa nesses centroids em vez da inicialização aleatória.
+  Se melBands for diferente de 0 o codebook é treinado com as features log-mel dos blocos
+  (melBands valores por bloco) em vez das amostras.
+*/
+struct CodebookOptions {
+    size_t blockSize = 5000;
+    size_t overlappingFactor = 2500;
+    size_t codebookSize = 150;
+    int maxIterations = 100;
+    DistanceKernel kernel = bestDistanceKernel();
+    KMeansAlgorithm algorithm = KMeansAlgorithm::Lloyd;
+    uint64_t seed = 1;
+    size_t memBudget = 0;
+    size_t melBands = 0;
+    bool compareFull = false;
+    MatrixView<const short> initialCodebook;
+};
 
 class WAVCb {
 
+    private:
+        int iterations = 0, fullBatchIterations = 0;
+        double miniBatchDistortion = 0.0, refinedDistortion = 0.0, fullBatchDistortion = 0.0;
+
+        /*
+          Matriz do codebook, com os centroids iniciais de options se existirem.
+        */
+        static Matrix<short> getInitialCodebook(const CodebookOptions& options, size_t blockSize){
+            Matrix<short> codebook(options.codebookSize, blockSize);
+            MatrixView<const short> initial = options.initialCodebook;
+
+            for(size_t row = 0; row < initial.getRows(); row++){
+                std::copy(initial.getRow(row), initial.getRow(row) + blockSize, codebook.getRow(row));
+            }
+
+            return codebook;
+        }
+
+        Matrix<short> getCodebookMiniBatch(BlockReader& reader, const CodebookOptions& options, ThreadPool& pool){
+
+            size_t batchSize = MiniBatchKMeans::getBatchSize(options.memBudget, options.codebookSize, reader.getBlockSize(), pool.getNThreads());
+
+            if(batchSize == 0){
+                std::cerr << "Error: memory budget too small, at least "
+                          << MiniBatchKMeans::getMinimumBudget(options.codebookSize, reader.getBlockSize(), pool.getNThreads()) / (1024 * 1024) + 1
+                          << " MB are needed for this codebook size." << std::endl;
+                return Matrix<short>();
+            }
+
+            Matrix<short> codebook = getInitialCodebook(options, reader.getBlockSize());
+
+            MiniBatchKMeans km(options.codebookSize, options.maxIterations, options.kernel, options.seed, options.compareFull);
+
+            if(!km.getClusters(reader, std::min(batchSize, reader.getNBlocks()), codebook.view(), pool, options.initialCodebook.getRows() > 0)){
+                std::cerr << "Error: codebook size larger than extracted blocks." << std::endl;
+                return Matrix<short>();
+            }
+
+            iterations = km.getEpochs();
+            miniBatchDistortion = km.getMiniBatchDistortion();
+            refinedDistortion = km.getRefinedDistortion();
+            fullBatchDistortion = km.getFullBatchDistortion();
+            fullBatchIterations = km.getFullBatchIterations();
+
+            return codebook;
+        }
+
     public:
 
-        std::vector<std::vector<short>> getCodebook(SndfileHandle& wavFile, size_t blockSize, size_t overlappingFactor, size_t codebookSize, int maxIterations, int nThreads){
-            std::vector<std::vector<short>> blocks;
+        /*
+          Número de iterações do kmeans (ou de passagens pelo ficheiro, por mini-lotes) no último codebook calculado.
+        */
+        int getIterations(){
+            return iterations;
+        }
 
-            size_t readBlockSize;
+        /*
+          Distorção média por bloco do último codebook por mini-lotes, antes e depois do passo final de Lloyd.
+        */
+        double getMiniBatchDistortion(){
+            return miniBatchDistortion;
+        }
 
-            std::vector<short> block(blockSize * wavFile.channels());
+        double getRefinedDistortion(){
+            return refinedDistortion;
+        }
 
-            /*
-              Lê o ficheiro e depois retrocede o valor do overlapping
-            */
-            while((readBlockSize = wavFile.readf(block.data(), blockSize))){
-                
-                if(readBlockSize == blockSize){
-                
-                    blocks.push_back(block);
-                    wavFile.seek( -overlappingFactor, SEEK_CUR);                               
-                
+        /*
+          Com compareFull, distorção média por bloco do Lloyd com todos os blocos e as suas iterações (0 sem compareFull).
+        */
+        double getFullBatchDistortion(){
+            return fullBatchDistortion;
+        }
+
+        int getFullBatchIterations(){
+            return fullBatchIterations;
+        }
+
+        Matrix<short> getCodebook(SndfileHandle& wavFile, const CodebookOptions& options, ThreadPool& pool){
+
+            BlockReader reader(wavFile, options.blockSize, options.overlappingFactor);
+
+            return getCodebook(reader, options, pool);
+        }
+
+        /*
+          Calcula o codebook dos blocos de reader, que tem de ter sido criado com o blockSize e o
+          overlappingFactor de options. Se o ficheiro já tiver sido descodificado com readAll
+          (por exemplo noutra thread) as amostras não são lidas outra vez.
+        */
+        Matrix<short> getCodebook(BlockReader& reader, const CodebookOptions& options, ThreadPool& pool){
+            std::vector<BlockReader*> readers = { &reader };
+
+            return getCodebook(readers, options, pool);
+        }
+
+        /*
+          Calcula um só codebook com os blocos de vários ficheiros da mesma música (por exemplo
+          para juntar áudio novo a um codebook anterior, dado em options.initialCodebook).
+          Por mini-lotes só é suportado um ficheiro.
+        */
+        Matrix<short> getCodebook(const std::vector<BlockReader*>& readers, const CodebookOptions& options, ThreadPool& pool){
+
+            size_t nBlocks = 0;
+            size_t blockSize = readers[0]->getBlockSize();
+
+            for(BlockReader* reader : readers){
+                nBlocks += reader->getNBlocks();
+
+                if(reader->getBlockSize() != blockSize){
+                    std::cerr << "Error: all the files of a codebook must have the same number of channels." << std::endl;
+                    return Matrix<short>();
+                }
+
+                if(options.melBands > 0 && reader->getSampleRate() != readers[0]->getSampleRate()){
+                    std::cerr << "Error: all the files of a log-mel codebook must have the same sample rate." << std::endl;
+                    return Matrix<short>();
                 }
-            
             }
-            if(blockSize < codebookSize){
+
+            /*
+              Com features log-mel cada centroid tem um valor por banda.
+            */
+            size_t nValues = options.melBands > 0 ? options.melBands : blockSize;
+
+            if(nBlocks < options.codebookSize){
                 std::cerr << "Error: codebook size larger than extracted blocks." << std::endl;
                 std::cerr << "Use a smaller codebookSize or extract more blocks ( > overlaping or < block size)" << std::endl;
-                return std::vector<std::vector<short>>();                
+                return Matrix<short>();
             }
+
+            MatrixView<const short> initial = options.initialCodebook;
+            if(initial.getRows() > 0 && (initial.getRows() != options.codebookSize || initial.getCols() != nValues)){
+                std::cerr << "Error: the initial codebook must have " << options.codebookSize << " centroids of "
+                          << nValues << (options.melBands > 0 ? " values (log-mel bands)." : " values (block size x channels).") << std::endl;
+                return Matrix<short>();
+            }
+
+            if(options.memBudget > 0){
+                if(options.melBands > 0){
+                    std::cerr << "Error: log-mel codebooks are not trained with mini-batches, their features are small." << std::endl;
+                    return Matrix<short>();
+                }
+                if(readers.size() > 1){
+                    std::cerr << "Error: mini-batch training only supports one file per codebook." << std::endl;
+                    return Matrix<short>();
+                }
+                return getCodebookMiniBatch(*readers[0], options, pool);
+            }
+
+            /*
+              Cada ficheiro é descodificado uma só vez e os blocos são vistas sobrepostas das amostras.
+              Com mais de um ficheiro os blocos são copiados para uma só matriz.
+            */
+            MatrixView<const short> blocks;
+            Matrix<short> allBlocks;
+
+            for(BlockReader* reader : readers){
+                if(reader->readAll().getRows() != reader->getNBlocks()){
+                    std::cerr << "Error: could not read all the blocks of the file." << std::endl;
+                    return Matrix<short>();
+                }
+            }
+
+            if(readers.size() == 1){
+                blocks = readers[0]->readAll();
+            }
+            else{
+                allBlocks = Matrix<short>(nBlocks, blockSize);
+                size_t row = 0;
+
+                for(BlockReader* reader : readers){
+                    MatrixView<const short> fileBlocks = reader->readAll();
+
+                    for(size_t block = 0; block < fileBlocks.getRows(); block++, row++){
+                        std::copy(fileBlocks.getRow(block), fileBlocks.getRow(block) + blockSize, allBlocks.getRow(row));
+                    }
+                }
+                blocks = allBlocks.view();
+            }
+
+            /*
+              As features substituem os blocos no clustering, que passa a ter melBands dimensões.
+            */
+            Matrix<short> features;
+
+            if(options.melBands > 0){
+                LogMel logMel(readers[0]->getChannels(), readers[0]->getSampleRate(), options.blockSize, options.melBands);
+
+                features = logMel.getFeatures(blocks, pool);
+                blocks = features.view();
+            }
+
             /*
               Executa o Clustering
             */
-            KMeans km(codebookSize, maxIterations);
+            Matrix<short> codebook = getInitialCodebook(options, nValues);
+
+            KMeans km(options.codebookSize, options.maxIterations, options.kernel, options.algorithm, options.seed);
+
+            if(!km.getClusters(blocks, codebook.view(), pool, initial.getRows() > 0)){
+                std::cerr << "Error: codebook size larger than extracted blocks." << std::endl;
+                return Matrix<short>();
+            }
+
+            iterations = km.getIterations();
 
-            return km.getClusters(blocks, nThreads);
+            return codebook;
         }
  };
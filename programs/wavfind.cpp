@@ -1,105 +1,261 @@
 #include "wavfind.h"
 #include "wavcmp.h"
 
-Wavfind::Wavfind() = default;
+/**
+ * WAV file received by the server, read by libsndfile through its virtual I/O.
+ */
+struct MemoryFile {
+    const std::string* bytes;
+    sf_count_t position;
+
+    static sf_count_t getLength(void* user) {
+        return static_cast<MemoryFile*>(user)->bytes->size();
+    }
 
-Wavfind::~Wavfind() = default;
+    static sf_count_t seek(sf_count_t offset, int whence, void* user) {
+        MemoryFile* file = static_cast<MemoryFile*>(user);
+        sf_count_t position = whence == SEEK_SET ? offset : whence == SEEK_CUR ? file->position + offset : (sf_count_t) file->bytes->size() + offset;
+
+        if (position < 0 || position > (sf_count_t) file->bytes->size())
+            return -1;
+
+        return file->position = position;
+    }
+
+    static sf_count_t read(void* data, sf_count_t count, void* user) {
+        MemoryFile* file = static_cast<MemoryFile*>(user);
+        count = std::max<sf_count_t>(0, std::min<sf_count_t>(count, file->bytes->size() - file->position));
+
+        std::memcpy(data, file->bytes->data() + file->position, count);
+        file->position += count;
+        return count;
+    }
+
+    static sf_count_t write(const void*, sf_count_t, void*) {
+        return 0;
+    }
+
+    static sf_count_t tell(void* user) {
+        return static_cast<MemoryFile*>(user)->position;
+    }
+};
 
 /**
- * Function to compare the given result with the result of, so far, the most probable codebook.
- * @param codebookName is the name of the codebook which represents a music.
- * @param result is the signal-to-energy ratio used as factor of comparison.
+ * Largest query accepted by the server.
  */
-void Wavfind::compare(std::string codebookName, double result) {
-    if (result > this -> signalNoiseRatio) {
-        this -> signalNoiseRatio = result;
-        this -> probableCodebook = std::move(codebookName);
-    }
-}
+constexpr size_t MAX_QUERY_BYTES = 1u << 30;
 
 /**
- * Function to retrieve the music name with the highest probability.
- * @return the name of the most probable music.
+ * Bytes by which the buffer of a query grows while it is read, so a header alone cannot make the
+ * server allocate MAX_QUERY_BYTES.
  */
-std::string Wavfind::guessMusic() {
-    return this -> probableCodebook;
-}
+constexpr size_t QUERY_CHUNK_BYTES = 1u << 20;
+
+/**
+ * Seconds a client has to send its whole query, and then to read its whole answer, before the
+ * server drops it.
+ */
+constexpr int CLIENT_TIMEOUT_SECONDS = 10;
+
+using Deadline = std::chrono::steady_clock::time_point;
 
 /**
- * Function to open a directory and retrieve all the files inside.
- * @param path is the location of the directory with the collection of codebooks.
- * @return all the files, that should be codebooks, inside of the directory.
+ * Function to wait until a socket can be read or written, but not past a deadline.
+ * @param events are the poll events to wait for.
+ * @return false if the deadline passed first.
  */
-std::vector<std::string> Wavfind::open(const std::string& path = ".") {
-    DIR*    dir;
-    dirent* pdir;
-    std::vector<std::string> files;
+bool waitFor(int fd, short events, Deadline deadline) {
+    while (true) {
+        auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+
+        if (remaining.count() <= 0)
+            return false;
 
-    if (path.back() != '/' and path != ".") {
-        std::cerr << "Directory is missing the / at the end!" << std::endl;
-        exit(EXIT_FAILURE);
+        pollfd request = {fd, events, 0};
+        int nReady = poll(&request, 1, remaining.count());
+
+        if (nReady < 0 && errno == EINTR)
+            continue;
+
+        return nReady > 0;
     }
+}
 
-    dir = opendir(path.c_str());
+/**
+ * Function to read exactly n bytes of a socket.
+ * @return false if the connection ended or the deadline passed first.
+ */
+bool readAll(int fd, char* data, size_t n, Deadline deadline) {
+    while (n > 0) {
+        if (!waitFor(fd, POLLIN, deadline))
+            return false;
+
+        ssize_t nRead = ::read(fd, data, n);
+
+        if (nRead < 0 && errno == EINTR)
+            continue;
 
-    if (dir == nullptr) {
-        std::cerr << "Directory doesn't exist!" << std::endl;
-        exit(EXIT_FAILURE);
+        if (nRead <= 0)
+            return false;
+
+        data += nRead;
+        n -= nRead;
     }
 
-    while ((pdir = readdir(dir)))
-        if (strncmp(pdir->d_name, ".", 1) != 0 and strncmp(pdir->d_name, "..", 2) != 0)
-            files.emplace_back(pdir->d_name);
+    return true;
+}
 
-    return files;
+/**
+ * Function to write a whole string to a socket; errors are ignored, the client may have left.
+ */
+void writeAll(int fd, const std::string& text, Deadline deadline) {
+    for (size_t written = 0; written < text.size(); ) {
+        if (!waitFor(fd, POLLOUT, deadline))
+            return;
+
+        ssize_t nWritten = ::write(fd, text.data() + written, text.size() - written);
+
+        if (nWritten < 0 && errno == EINTR)
+            continue;
+
+        if (nWritten <= 0)
+            return;
+
+        written += nWritten;
+    }
 }
 
 /**
- * Function to retrieve all the blocks from the codebook file.
- * @param codebook is the file which contains the blocks to be compared with the sample blocks.
- * @param blockSize is the size of each block inside of the codebook file.
- * @return all the blocks inside the codebook file.
+ * Function to answer one query of the server.
+ * The query starts with a header line, "WAV <results> <bytes>" followed by a WAV file, or
+ * "PCM <channels> <results> <bytes>" followed by interleaved 16-bit little-endian samples.
+ * The answer is what wavfind prints for the sample.
+ * @return the answer, or the error that prevented the query.
  */
-std::vector<std::vector<short>> Wavfind::getCodebookBlocks(std::ifstream & codebook, size_t blockSize) {
-    short val;
-    std::string value;
-    std::vector<short> codebookBlock;
-    std::vector<std::vector<short>> codebookBlocks;
-
-    if (codebook.is_open()) {
-        while (getline(codebook, value, ' ')) {
-            std::stringstream sstream(value);
-            sstream >> val;
-            codebookBlock.push_back(val);
-
-            if (codebookBlock.size() == blockSize) {
-                codebookBlocks.push_back(codebookBlock);
-                codebookBlock.clear();
-            }
-        }
+std::string answer(int fd, const Library& library, QueryOptions options, ThreadPool& pool) {
+    /*
+     * The deadline covers the whole query, so a client cannot hold the server by sending a byte
+     * now and then.
+     */
+    Deadline deadline = std::chrono::steady_clock::now() + std::chrono::seconds(CLIENT_TIMEOUT_SECONDS);
+    std::string header;
+    char c;
+
+    while (header.size() < 256 && readAll(fd, &c, 1, deadline) && c != '\n')
+        header += c;
+
+    std::istringstream fields(header);
+    std::string kind;
+    size_t channels = 0, nBytes = 0;
+
+    fields >> kind;
+    if (kind == "PCM")
+        fields >> channels;
+    fields >> options.nResults >> nBytes;
+
+    if (!fields || (kind != "WAV" && kind != "PCM") || (kind == "PCM" && channels == 0) || options.nResults == 0 || nBytes > MAX_QUERY_BYTES)
+        return "Error: invalid query header \"" + header + "\"\n";
+
+    std::string bytes;
+
+    while (bytes.size() < nBytes) {
+        size_t chunk = std::min(QUERY_CHUNK_BYTES, nBytes - bytes.size());
+
+        bytes.resize(bytes.size() + chunk);
+        if (!readAll(fd, &bytes[bytes.size() - chunk], chunk, deadline))
+            return "Error: the query ended before its " + std::to_string(nBytes) + " bytes\n";
+    }
+
+    std::vector<short> samples;
+
+    if (kind == "WAV") {
+        MemoryFile file = {&bytes, 0};
+        SF_VIRTUAL_IO io = {MemoryFile::getLength, MemoryFile::seek, MemoryFile::read, MemoryFile::write, MemoryFile::tell};
+        SndfileHandle sampleFile(io, &file);
+        std::string error;
+
+        if (!Wavfind::checkFormat(sampleFile, error))
+            return "Error: " + error + "\n";
 
-        codebook.close();
+        channels = sampleFile.channels();
+        options.sampleRate = sampleFile.samplerate();
+        samples = Wavfind::readSamples(sampleFile);
     }
+    else {
+        samples.resize(nBytes / sizeof(short));
 
-    return codebookBlocks;
+        for (size_t value = 0; value < samples.size(); value++)
+            samples[value] = (short) (uint16_t) ((unsigned char) bytes[2 * value] | (unsigned char) bytes[2 * value + 1] << 8);
+    }
+
+    std::ostringstream out;
+    Wavfind wf;
+    wf.identify(library, samples, channels, options, pool, out, out);
+    return out.str();
 }
 
 /**
- * Function to retrieve all the blocks from the audio sample file.
- * @param sampleFile is a sample of an audio file with the .wav extension.
- * @param blockSize is the size of each block inside of the sample file.
- * @return all the blocks inside the audio sample file.
+ * Function to answer queries on a Unix domain socket until the process is stopped.
+ * The library stays open between queries, so a query only costs its scoring. The queries are
+ * answered one at a time, each with every thread of the pool; a client that has not sent its whole
+ * query, or read its whole answer, within CLIENT_TIMEOUT_SECONDS is dropped so it cannot stall the others.
+ * @param socketPath is the location of the socket, replaced if it is a socket.
+ * @return the exit status of the program.
  */
-std::vector<std::vector<short>> Wavfind::getSampleBlocks(SndfileHandle sampleFile, size_t blockSize) {
-    size_t readBlockSize;
-    std::vector<std::vector<short>> blocks;
-    std::vector<short> block(blockSize * sampleFile.channels());
+int serve(const std::string& socketPath, const Library& library, const QueryOptions& options, ThreadPool& pool) {
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
 
-    while((readBlockSize = sampleFile.readf(block.data(), blockSize)))
-        if (readBlockSize == blockSize)
-            blocks.push_back(block);
+    if (socketPath.size() >= sizeof(address.sun_path)) {
+        std::cerr << "Error: the socket path is too long" << std::endl;
+        return 1;
+    }
+    std::strcpy(address.sun_path, socketPath.c_str());
+
+    /*
+     * Only a socket left by an earlier server is replaced; any other file at the path is kept.
+     */
+    struct stat status;
+    if (lstat(socketPath.c_str(), &status) == 0) {
+        if (!S_ISSOCK(status.st_mode)) {
+            std::cerr << "Error: " << socketPath << " exists and is not a socket" << std::endl;
+            return 1;
+        }
+        unlink(socketPath.c_str());
+    }
+
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
 
-    return blocks;
+    if (server < 0 || bind(server, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(server, 16) != 0) {
+        std::cerr << "Error: could not listen on " << socketPath << std::endl;
+        return 1;
+    }
+
+    /*
+     * A client that leaves before its answer must not stop the server.
+     */
+    std::signal(SIGPIPE, SIG_IGN);
+    std::cerr << "Serving " << library.getNSongs() << " songs on " << socketPath << std::endl;
+
+    while (true) {
+        int client = accept(server, nullptr, nullptr);
+
+        if (client < 0) {
+            /*
+             * Running out of descriptors or memory lasts until something is freed, so wait
+             * instead of failing again at once.
+             */
+            if (errno != EINTR && errno != ECONNABORTED) {
+                std::cerr << "Error: could not accept a connection: " << std::strerror(errno) << std::endl;
+                std::this_thread::sleep_for(std::chrono::seconds(1));
+            }
+            continue;
+        }
+
+        std::string text = answer(client, library, options, pool);
+        writeAll(client, text, std::chrono::steady_clock::now() + std::chrono::seconds(CLIENT_TIMEOUT_SECONDS));
+        close(client);
+    }
 }
 
 /**
@@ -142,60 +298,174 @@ double Wavcmp::signalNoiseRatio(double signalEnergy, double noiseEnergy){
 }
 
 int main(int argc, char *argv[]) {
-    if(argc != 4) {
-        std::cerr << "Usage: wavfind <directory with codebooks> <audio sample file> <blockSize>" << std::endl;
+    std::vector<std::string> arguments;
+    size_t nThreads = std::max(1u, std::thread::hardware_concurrency());
+    QueryOptions options;
+    std::string indexPath, projectionPath, quantizedPath, coarsePath, socketPath;
+    size_t streamChannels = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if ((strcmp(argv[i], "-t") == 0 || strcmp(argv[i], "-n") == 0 || strcmp(argv[i], "--nprobe") == 0) && i + 1 < argc) {
+            int value = std::atoi(argv[i + 1]);
+
+            if (value <= 0) {
+                std::cerr << "Error: invalid value for " << argv[i] << std::endl;
+                return 1;
+            }
+
+            (argv[i][1] == 't' ? nThreads : argv[i][1] == 'n' ? options.nResults : options.nProbe) = value;
+            i++;
+        }
+        else if (strcmp(argv[i], "--index") == 0 && i + 1 < argc)
+            indexPath = argv[++i];
+        else if (strcmp(argv[i], "--projection") == 0 && i + 1 < argc)
+            projectionPath = argv[++i];
+        else if (strcmp(argv[i], "--quantized") == 0 && i + 1 < argc)
+            quantizedPath = argv[++i];
+        else if (strcmp(argv[i], "--coarse") == 0 && i + 1 < argc)
+            coarsePath = argv[++i];
+        else if (strcmp(argv[i], "--shortlist") == 0 && i + 1 < argc) {
+            int value = std::atoi(argv[++i]);
+
+            if (value <= 0) {
+                std::cerr << "Error: invalid value for --shortlist" << std::endl;
+                return 1;
+            }
+
+            options.shortlist = value;
+        }
+        else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc)
+            socketPath = argv[++i];
+        else if (strcmp(argv[i], "--stream") == 0 && i + 1 < argc) {
+            int value = std::atoi(argv[++i]);
+
+            if (value <= 0) {
+                std::cerr << "Error: invalid value for --stream" << std::endl;
+                return 1;
+            }
+
+            streamChannels = value;
+        }
+        else if (strcmp(argv[i], "--margin") == 0 && i + 1 < argc) {
+            char* end;
+            options.stopMargin = std::strtod(argv[++i], &end);
+
+            if (*end != '\0' || !(options.stopMargin >= 0)) {
+                std::cerr << "Error: invalid value for --margin" << std::endl;
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc) {
+            std::string name = argv[++i];
+
+            if (name != "pruned" && name != "batch") {
+                std::cerr << "Error: unknown engine " << name << std::endl;
+                return 1;
+            }
+
+            options.engine = name == "batch" ? ScoreEngine::Batch : ScoreEngine::Pruned;
+        }
+        else if (strcmp(argv[i], "--check") == 0)
+            options.checkEngines = true;
+        else
+            arguments.emplace_back(argv[i]);
+    }
+
+    /*
+     * The server receives its samples on the socket and the stream on stdin, so they have no
+     * sample file argument.
+     */
+    size_t nFiles = socketPath.empty() && streamChannels == 0 ? 2 : 1;
+
+    if(arguments.size() != nFiles && arguments.size() != nFiles + 1) {
+        std::cerr << "Usage: wavfind [-t threads] [-n results] [--index index [--nprobe lists] | --coarse catalog [--shortlist songs]] [--projection projection | --quantized quantized] [--engine pruned|batch] [--check] <directory with codebooks or catalog> <audio sample file> [blockSize]" << std::endl;
+        std::cerr << "       wavfind --serve <socket> [options] <directory with codebooks or catalog> [blockSize]" << std::endl;
+        std::cerr << "       wavfind --stream <channels> [--margin dB] [options] <directory with codebooks or catalog> [blockSize] < samples" << std::endl;
+        std::cerr << "The blockSize is only needed for codebooks in the text format." << std::endl;
+        std::cerr << "-t is the number of threads (default: all the cores), -n the number of ranked songs to show (default: 1)." << std::endl;
+        std::cerr << "--index only scores the songs that a catalog index (wavlib index) finds close to the sample;" << std::endl;
+        std::cerr << "--nprobe is the number of index lists visited per block, more is slower and misses less songs (default: 8)." << std::endl;
+        std::cerr << "--coarse scores the songs of a decimated catalog (wavlib decimate) first, and only the best --shortlist (default: 8)" << std::endl;
+        std::cerr << "at full resolution." << std::endl;
+        std::cerr << "--projection finds the closest centroids of a catalog with its projection (wavlib project), with the same scores." << std::endl;
+        std::cerr << "--quantized finds them with the int8 copy of the catalog (wavlib quantize) and an exact rerank, with the same scores." << std::endl;
+        std::cerr << "--engine is the search for the closest codebook blocks (default: batch), --check compares both engines on every song." << std::endl;
+        std::cerr << "--serve keeps the codebooks open and answers the queries of wavquery on a Unix socket." << std::endl;
+        std::cerr << "--stream scores 16-bit little-endian samples from stdin as they arrive, and stops once the best song" << std::endl;
+        std::cerr << "leads the runner-up by --margin (default: read everything)." << std::endl;
         return 1;
     }
 
-    std::stringstream sstream(argv[argc-1]);
-    size_t blockSize;
-    sstream >> blockSize;
-    Wavfind wf;
-    Wavcmp wcmp;
-    SndfileHandle sampleFile { argv[argc-2] };
+    if(arguments.size() == nFiles + 1) {
+        std::stringstream sstream(arguments[nFiles]);
+        sstream >> options.blockSize;
+    }
+
+    if (!socketPath.empty() && streamChannels > 0) {
+        std::cerr << "Error: --serve and --stream cannot be used together" << std::endl;
+        return 1;
+    }
+
+    /*
+     * The index finds its candidates from the whole sample, which a stream does not have yet.
+     */
+    if (streamChannels > 0 && !indexPath.empty()) {
+        std::cerr << "Error: --stream scores every song, it cannot use --index" << std::endl;
+        return 1;
+    }
+
+    if (streamChannels > 0 && !projectionPath.empty()) {
+        std::cerr << "Error: --stream scores its blocks with the engine, it cannot use --projection" << std::endl;
+        return 1;
+    }
 
-    if(sampleFile.error()) {
-        std::cerr << "Error: invalid input file" << std::endl;
+    if (streamChannels > 0 && !quantizedPath.empty()) {
+        std::cerr << "Error: --stream scores its blocks with the engine, it cannot use --quantized" << std::endl;
         return 1;
     }
 
-    if((sampleFile.format() & SF_FORMAT_TYPEMASK) != SF_FORMAT_WAV) {
-        std::cerr << "Error: file is not in WAV format" << std::endl;
+    if (streamChannels > 0 && !coarsePath.empty()) {
+        std::cerr << "Error: --stream scores every song, it cannot use --coarse" << std::endl;
         return 1;
     }
 
-    if((sampleFile.format() & SF_FORMAT_SUBMASK) != SF_FORMAT_PCM_16) {
-        std::cerr << "Error: file is not in PCM_16 format" << std::endl;
+    if (!indexPath.empty() && !coarsePath.empty()) {
+        std::cerr << "Error: --index and --coarse both shortlist the songs, only one can be used" << std::endl;
         return 1;
     }
 
-    std::vector<std::vector<short>> sampleBlocks = wf.getSampleBlocks(sampleFile, blockSize);
-    std::vector<std::string> files = wf.open(argv[argc-3]);
+    if (!projectionPath.empty() && !quantizedPath.empty()) {
+        std::cerr << "Error: --projection and --quantized cannot be used together" << std::endl;
+        return 1;
+    }
 
-    for (const auto & file : files) {
-        double result = 0.0;
-        std::ifstream codebook (argv[argc-3] + file);
-        std::vector<std::vector<short>> codebookBlocks = wf.getCodebookBlocks(codebook, blockSize);
+    Library library;
+    if (!library.open(arguments[0], indexPath, projectionPath, quantizedPath))
+        return 1;
 
-        for (const auto & sampleBlock : sampleBlocks) {
-            double min_error = -std::numeric_limits<double>::infinity();
+    if (!coarsePath.empty() && !library.openCoarse(coarsePath))
+        return 1;
 
-            for (const auto & codebookBlock : codebookBlocks) {
-                double error = wcmp.signalNoiseRatio(wcmp.signalEnergy(sampleBlock),
-                        wcmp.noiseEnergy(codebookBlock, sampleBlock));
+    ThreadPool pool(nThreads);
 
-                if (error > min_error)
-                    min_error = error;
-            }
+    if (!socketPath.empty())
+        return serve(socketPath, library, options, pool);
 
-            result += min_error;
-            codebook.clear();
-            codebook.seekg(0, std::ios::beg);
-        }
+    if (streamChannels > 0) {
+        Wavfind wf;
+        return wf.identifyStream(library, STDIN_FILENO, streamChannels, options, pool, std::cout, std::cerr) ? 0 : 1;
+    }
+
+    SndfileHandle sampleFile { arguments[1] };
+    std::string error;
 
-        wf.compare(file, result);
+    if (!Wavfind::checkFormat(sampleFile, error)) {
+        std::cerr << "Error: " << error << std::endl;
+        return 1;
     }
 
-    std::cout << "I think this is your song: " << wf.guessMusic() << std::endl;
-    return 0;
+    options.sampleRate = sampleFile.samplerate();
+
+    Wavfind wf;
+    return wf.identify(library, Wavfind::readSamples(sampleFile), sampleFile.channels(), options, pool, std::cout, std::cerr) ? 0 : 1;
 }
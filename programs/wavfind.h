@@ -1,3 +1,6 @@
+#ifndef WAVFIND_H
+#define WAVFIND_H
+
 #include <iostream>
 #include <sndfile.hh>
 #include <string>
@@ -10,6 +13,124 @@
 #include <fstream>
 #include <sstream>
 #include <numeric>
+#include <limits>
+#include <map>
+#include <set>
+#include <tuple>
+#include "codebookFile.h"
+#include "catalogFile.h"
+#include "ivfIndex.h"
+#include "projection.h"
+#include "quantizedCatalog.h"
+#include "decimation.h"
+#include "wavscore.h"
+#include "logMel.h"
+#include "threadPool.h"
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <algorithm>
+#include <csignal>
+#include <cerrno>
+#include <chrono>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/**
+ * Options of a query, the same on the command line and in the server.
+ */
+struct QueryOptions {
+    size_t blockSize = 0;     // block size of the codebooks in the text format
+    size_t nResults = 1;
+    size_t nProbe = 8;
+    size_t shortlist = 8;     // songs scored at full resolution after a coarse catalog
+    ScoreEngine engine = ScoreEngine::Batch;
+    bool checkEngines = false;
+    double stopMargin = std::numeric_limits<double>::infinity();    // margin that ends a stream early
+    size_t sampleRate = 0;    // sample rate of the sample, 0 if unknown (raw samples)
+};
+
+/**
+ * Representation of the blocks of a song: the samples of blocks of blockFrames frames, or with
+ * melBands > 0 their log-mel features at sampleRate. The sample is converted once per format.
+ */
+struct BlockFormat {
+    size_t blockFrames = 0;
+    size_t melBands = 0;
+    size_t sampleRate = 0;
+
+    bool operator<(const BlockFormat& other) const {
+        return std::tie(blockFrames, melBands, sampleRate) < std::tie(other.blockFrames, other.melBands, other.sampleRate);
+    }
+
+    bool operator==(const BlockFormat& other) const {
+        return std::tie(blockFrames, melBands, sampleRate) == std::tie(other.blockFrames, other.melBands, other.sampleRate);
+    }
+};
+
+/**
+ * Codebooks of the songs, opened once so that any number of samples can be scored against them:
+ * a catalog, optionally with its index, its projection or quantized copy and its decimated copy,
+ * or a directory of codebooks.
+ */
+class Library {
+private:
+    CatalogFile catalog;
+    IvfIndex index;
+    bool catalogMode = false;
+    Projection projection;
+    QuantizedCatalog quantizedCatalog;
+    bool indexed = false;
+    bool projected = false;
+    bool quantized = false;
+    std::unique_ptr<Library> coarse;
+    size_t coarseFactor = 0;
+    std::vector<std::string> names;
+    std::vector<std::unique_ptr<CodebookFile>> codebooks;
+    std::vector<CodebookNorms> norms;
+public:
+    bool open(const std::string& path, const std::string& indexPath, const std::string& projectionPath = "",
+              const std::string& quantizedPath = "");
+
+    size_t getNSongs() const;
+
+    const std::string& getName(size_t song) const;
+
+    bool isOpen(size_t song) const;
+
+    bool isBinary(size_t song) const;
+
+    MatrixView<const short> getCentroids(size_t song) const;
+
+    const CodebookNorms& getNorms(size_t song) const;
+
+    CodebookInfo getInfo(size_t song) const;
+
+    bool isIndexed() const;
+
+    const IvfIndex& getIndex() const;
+
+    bool isProjected() const;
+
+    const Projection& getProjection() const;
+
+    bool isQuantized() const;
+
+    const QuantizedCatalog& getQuantized() const;
+
+    bool openCoarse(const std::string& path);
+
+    bool hasCoarse() const;
+
+    const Library& getCoarse() const;
+
+    size_t getCoarseFactor() const;
+
+    const CatalogFile& getCatalog() const;
+};
 
 /**
  * Class responsible for finding the most probable music to which a audio sample belongs,
@@ -19,6 +140,15 @@ class Wavfind {
 private:
     std::string probableCodebook = "None";
     double signalNoiseRatio = -std::numeric_limits<double>::infinity();
+    std::vector<std::pair<std::string, double>> results;
+
+    static bool getSongFormat(const Library& library, size_t song, size_t channels, const QueryOptions& options,
+                              BlockFormat& format, std::string& reason);
+
+    void report(const QueryOptions& options, std::ostream& out);
+
+    static std::vector<size_t> getShortlist(const Library& library, const std::vector<short>& samples, size_t channels,
+                                            const QueryOptions& options, ThreadPool& pool, std::ostream& err);
 public:
     ~Wavfind();
 
@@ -26,11 +156,25 @@ public:
 
     void compare(std::string codebook, double result);
 
-    static std::vector<std::vector<short>> getCodebookBlocks(std::ifstream & codebookPath, size_t blockSize);
+    static bool checkFormat(SndfileHandle& sampleFile, std::string& error);
+
+    static std::vector<short> readSamples(SndfileHandle& sampleFile);
 
-    static std::vector<std::vector<short>> getSampleBlocks(SndfileHandle sampleFile, size_t blockSize);
+    static Matrix<short> getSampleBlocks(const std::vector<short>& samples, size_t channels, size_t blockSize);
+
+    static Matrix<short> getQueryBlocks(Matrix<short> blocks, size_t channels, const BlockFormat& format);
+
+    bool identify(const Library& library, const std::vector<short>& samples, size_t channels, const QueryOptions& options,
+                  ThreadPool& pool, std::ostream& out, std::ostream& err);
+
+    bool identifyStream(const Library& library, int fd, size_t channels, const QueryOptions& options,
+                        ThreadPool& pool, std::ostream& out, std::ostream& err);
 
     std::string guessMusic();
 
+    std::vector<std::pair<std::string, double>> getRanking(size_t nResults);
+
     static std::vector<std::string> open(const std::string& path);
 };
+
+#endif
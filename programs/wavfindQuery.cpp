@@ -0,0 +1,767 @@
+#include "wavfind.h"
+
+/*
+ * Library and Wavfind: opening the codebooks and answering queries. Shared by wavfind and the
+ * benchmark of wavprint, so both run the same query path.
+ */
+
+Wavfind::Wavfind() = default;
+
+Wavfind::~Wavfind() = default;
+
+/**
+ * Function to compare the given result with the result of, so far, the most probable codebook.
+ * @param codebookName is the name of the codebook which represents a music.
+ * @param result is the signal-to-energy ratio used as factor of comparison.
+ */
+void Wavfind::compare(std::string codebookName, double result) {
+    this -> results.emplace_back(codebookName, result);
+
+    if (result > this -> signalNoiseRatio) {
+        this -> signalNoiseRatio = result;
+        this -> probableCodebook = std::move(codebookName);
+    }
+}
+
+/**
+ * Function to retrieve the music name with the highest probability.
+ * @return the name of the most probable music.
+ */
+std::string Wavfind::guessMusic() {
+    return this -> probableCodebook;
+}
+
+/**
+ * Function to retrieve the best ranked musics, in the order they were compared when they tie.
+ * @param nResults is the maximum number of musics to retrieve.
+ * @return the names and results of the most probable musics, best first.
+ */
+std::vector<std::pair<std::string, double>> Wavfind::getRanking(size_t nResults) {
+    std::vector<std::pair<std::string, double>> ranking = this -> results;
+
+    std::stable_sort(ranking.begin(), ranking.end(), [](const std::pair<std::string, double>& a, const std::pair<std::string, double>& b) {
+        return a.second > b.second;
+    });
+
+    if (ranking.size() > nResults)
+        ranking.resize(nResults);
+
+    return ranking;
+}
+
+/**
+ * Function to open a directory and retrieve all the files inside.
+ * @param path is the location of the directory with the collection of codebooks.
+ * @return all the files, that should be codebooks, inside of the directory.
+ */
+std::vector<std::string> Wavfind::open(const std::string& path = ".") {
+    DIR*    dir;
+    dirent* pdir;
+    std::vector<std::string> files;
+
+    if (path.back() != '/' and path != ".") {
+        std::cerr << "Directory is missing the / at the end!" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    dir = opendir(path.c_str());
+
+    if (dir == nullptr) {
+        std::cerr << "Directory doesn't exist!" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    while ((pdir = readdir(dir)))
+        if (strncmp(pdir->d_name, ".", 1) != 0 and strncmp(pdir->d_name, "..", 2) != 0)
+            files.emplace_back(pdir->d_name);
+
+    return files;
+}
+
+/**
+ * Function to open the songs of a catalog or of a directory of codebooks.
+ * Codebooks of a directory that cannot be opened are reported and left out of the queries.
+ * @param path is a catalog or a directory, ending with /, with codebooks.
+ * @param indexPath is the index of the catalog, or empty to score every song.
+ * @param projectionPath is the projection of the catalog, or empty to search every centroid with the engine.
+ * @param quantizedPath is the quantized copy of the catalog, or empty to search every centroid with the engine.
+ * @return false if the library cannot be used.
+ */
+bool Library::open(const std::string& path, const std::string& indexPath, const std::string& projectionPath, const std::string& quantizedPath) {
+    catalogMode = CatalogFile::isCatalog(path);
+
+    if (!catalogMode && !indexPath.empty()) {
+        std::cerr << "Error: --index needs a catalog, not a directory" << std::endl;
+        return false;
+    }
+
+    if (!catalogMode && !projectionPath.empty()) {
+        std::cerr << "Error: --projection needs a catalog, not a directory" << std::endl;
+        return false;
+    }
+
+    if (!catalogMode && !quantizedPath.empty()) {
+        std::cerr << "Error: --quantized needs a catalog, not a directory" << std::endl;
+        return false;
+    }
+
+    if (catalogMode) {
+        if (!catalog.open(path))
+            return false;
+
+        for (size_t song = 0; song < catalog.getNSongs(); song++)
+            names.push_back(catalog.getName(song));
+    }
+    else {
+        names = Wavfind::open(path);
+        codebooks.resize(names.size());
+
+        for (size_t file = 0; file < names.size(); file++) {
+            codebooks[file].reset(new CodebookFile());
+
+            if (!codebooks[file]->open(path + names[file]))
+                codebooks[file].reset();
+        }
+    }
+
+    /*
+     * The norms of the codebook blocks do not depend on the sample, so every query shares them.
+     */
+    norms.resize(names.size());
+    for (size_t song = 0; song < names.size(); song++)
+        if (isOpen(song))
+            norms[song] = CodebookNorms(getCentroids(song));
+
+    if (!projectionPath.empty()) {
+        if (!projection.open(projectionPath))
+            return false;
+
+        if (!projection.isBuiltFrom(catalog)) {
+            std::cerr << "Error: the projection " << projectionPath << " was not built from " << path << std::endl;
+            return false;
+        }
+
+        projected = true;
+    }
+
+    if (!quantizedPath.empty()) {
+        if (!quantizedCatalog.open(quantizedPath))
+            return false;
+
+        if (!quantizedCatalog.isBuiltFrom(catalog)) {
+            std::cerr << "Error: the quantized catalog " << quantizedPath << " was not built from " << path << std::endl;
+            return false;
+        }
+
+        quantized = true;
+    }
+
+    if (indexPath.empty())
+        return true;
+
+    if (!index.open(indexPath))
+        return false;
+
+    if (!index.isBuiltFrom(catalog)) {
+        std::cerr << "Error: the index " << indexPath << " was not built from " << path << std::endl;
+        return false;
+    }
+
+    indexed = true;
+    return true;
+}
+
+size_t Library::getNSongs() const {
+    return names.size();
+}
+
+const std::string& Library::getName(size_t song) const {
+    return names[song];
+}
+
+bool Library::isOpen(size_t song) const {
+    return catalogMode || codebooks[song] != nullptr;
+}
+
+bool Library::isBinary(size_t song) const {
+    return catalogMode || codebooks[song]->isBinary();
+}
+
+MatrixView<const short> Library::getCentroids(size_t song) const {
+    return catalogMode ? catalog.getCentroids(song) : codebooks[song]->getCentroids();
+}
+
+const CodebookNorms& Library::getNorms(size_t song) const {
+    return norms[song];
+}
+
+CodebookInfo Library::getInfo(size_t song) const {
+    return catalogMode ? catalog.getInfo(song) : codebooks[song]->getInfo();
+}
+
+bool Library::isIndexed() const {
+    return indexed;
+}
+
+const IvfIndex& Library::getIndex() const {
+    return index;
+}
+
+bool Library::isProjected() const {
+    return projected;
+}
+
+const Projection& Library::getProjection() const {
+    return projection;
+}
+
+bool Library::isQuantized() const {
+    return quantized;
+}
+
+const QuantizedCatalog& Library::getQuantized() const {
+    return quantizedCatalog;
+}
+
+/**
+ * Function to open the decimated copy of the catalog (wavlib decimate), whose songs are scored
+ * first to shortlist the songs scored at full resolution.
+ * @param path is the decimated catalog.
+ * @return false if it is not a decimated copy of the catalog of the library.
+ */
+bool Library::openCoarse(const std::string& path) {
+    if (!catalogMode) {
+        std::cerr << "Error: --coarse needs a catalog, not a directory" << std::endl;
+        return false;
+    }
+
+    coarse.reset(new Library());
+
+    if (!coarse->open(path, ""))
+        return false;
+
+    bool valid = coarse->catalogMode && coarse->getNSongs() == getNSongs();
+
+    for (size_t song = 0; valid && song < getNSongs(); song++) {
+        CodebookInfo info = getInfo(song), coarseInfo = coarse->getInfo(song);
+
+        if (song == 0 && coarseInfo.blockFrames > 0)
+            coarseFactor = info.blockFrames / coarseInfo.blockFrames;
+
+        valid = getName(song) == coarse->getName(song) && info.channels == coarseInfo.channels && info.melBands == 0 && coarseInfo.melBands == 0
+                && coarseFactor > 1 && coarseInfo.blockFrames * coarseFactor == info.blockFrames;
+    }
+
+    if (!valid) {
+        std::cerr << "Error: " << path << " is not a decimated copy of the catalog (wavlib decimate)" << std::endl;
+        coarse.reset();
+        return false;
+    }
+
+    return true;
+}
+
+bool Library::hasCoarse() const {
+    return coarse != nullptr;
+}
+
+const Library& Library::getCoarse() const {
+    return *coarse;
+}
+
+size_t Library::getCoarseFactor() const {
+    return coarseFactor;
+}
+
+const CatalogFile& Library::getCatalog() const {
+    return catalog;
+}
+
+/**
+ * Function to check that a sample is a WAV file with 16-bit samples.
+ * @param sampleFile is the opened sample.
+ * @param error receives the reason when the sample cannot be used.
+ * @return true if the sample can be read.
+ */
+bool Wavfind::checkFormat(SndfileHandle& sampleFile, std::string& error) {
+    if(sampleFile.error())
+        error = "invalid input file";
+    else if((sampleFile.format() & SF_FORMAT_TYPEMASK) != SF_FORMAT_WAV)
+        error = "file is not in WAV format";
+    else if((sampleFile.format() & SF_FORMAT_SUBMASK) != SF_FORMAT_PCM_16)
+        error = "file is not in PCM_16 format";
+    else
+        return true;
+
+    return false;
+}
+
+/**
+ * Function to read all the interleaved samples of an audio file.
+ * @param sampleFile is the opened sample.
+ * @return the samples of every frame, one value per channel.
+ */
+std::vector<short> Wavfind::readSamples(SndfileHandle& sampleFile) {
+    const sf_count_t framesPerRead = 65536;
+    std::vector<short> samples;
+    std::vector<short> buffer(framesPerRead * sampleFile.channels());
+    sf_count_t nFrames;
+
+    while ((nFrames = sampleFile.readf(buffer.data(), framesPerRead)) > 0)
+        samples.insert(samples.end(), buffer.begin(), buffer.begin() + nFrames * sampleFile.channels());
+
+    return samples;
+}
+
+/**
+ * Function to split the samples of an audio sample in blocks, leaving out an incomplete last block.
+ * @param samples are the interleaved samples of the audio sample.
+ * @param channels is the number of channels of the samples.
+ * @param blockSize is the number of frames of each block.
+ * @return all the blocks of the audio sample.
+ */
+Matrix<short> Wavfind::getSampleBlocks(const std::vector<short>& samples, size_t channels, size_t blockSize) {
+    size_t blockValues = blockSize * channels;
+    Matrix<short> blocks(blockValues > 0 ? samples.size() / blockValues : 0, blockValues);
+
+    for (size_t block = 0; block < blocks.getRows(); block++)
+        std::copy(samples.begin() + block * blockValues, samples.begin() + (block + 1) * blockValues, blocks.getRow(block));
+
+    return blocks;
+}
+
+/**
+ * Function to find how the blocks of a song are represented, and check that it can be compared with a sample.
+ * @param library are the songs.
+ * @param song is the position of the song in the library.
+ * @param channels is the number of channels of the sample.
+ * @param options give the block size of the codebooks in the text format and the sample rate of the sample.
+ * @param format receives the representation of the blocks of the song.
+ * @param reason receives why the song cannot be compared, empty if it was not opened.
+ * @return false if the song cannot be compared with the sample.
+ */
+bool Wavfind::getSongFormat(const Library& library, size_t song, size_t channels, const QueryOptions& options,
+                            BlockFormat& format, std::string& reason) {
+    if (!library.isOpen(song))
+        return false;
+
+    CodebookInfo info = library.getInfo(song);
+    bool binary = library.isBinary(song);
+
+    format.blockFrames = binary ? info.blockFrames : options.blockSize;
+    format.melBands = info.melBands;
+    format.sampleRate = info.melBands > 0 ? info.sampleRate : 0;
+
+    size_t nValues = format.melBands > 0 ? format.melBands : format.blockFrames * channels;
+
+    if (format.blockFrames == 0)
+        reason = "text codebooks need the blockSize argument";
+    else if (binary && info.channels != channels)
+        reason = "the codebook has " + std::to_string(info.channels) + " channels and the sample " + std::to_string(channels);
+    else if (format.melBands > 0 && format.sampleRate == 0)
+        reason = "its log-mel features have no sample rate";
+    else if (format.melBands > 0 && options.sampleRate != 0 && options.sampleRate != format.sampleRate)
+        reason = "its log-mel features are of " + std::to_string(format.sampleRate) + " Hz and the sample has " + std::to_string(options.sampleRate) + " Hz";
+    else if (library.getCentroids(song).getCols() != nValues)
+        reason = format.melBands > 0 ? "its rows do not have " + std::to_string(format.melBands) + " bands"
+                                     : "its blocks do not have " + std::to_string(format.blockFrames) + " frames";
+    else
+        return true;
+
+    return false;
+}
+
+/**
+ * Function to represent blocks of the sample as the blocks of the songs with a format.
+ * @param blocks are the samples of the blocks.
+ * @param channels is the number of channels of the samples.
+ * @param format is the representation of the blocks of the songs.
+ * @return the blocks, or their log-mel features.
+ */
+Matrix<short> Wavfind::getQueryBlocks(Matrix<short> blocks, size_t channels, const BlockFormat& format) {
+    if (format.melBands == 0)
+        return blocks;
+
+    return LogMel(channels, format.sampleRate, format.blockFrames, format.melBands).getFeatures(blocks.view());
+}
+
+/**
+ * Function to print the most probable song of the compared ones, the ranking when more than one
+ * result is asked, and the margin of the best song to the runner-up, to apply a confidence threshold.
+ * @param options are the parameters of the query.
+ * @param out receives the answer.
+ */
+void Wavfind::report(const QueryOptions& options, std::ostream& out) {
+    out << "I think this is your song: " << guessMusic() << std::endl;
+
+    std::vector<std::pair<std::string, double>> ranking = getRanking(std::max<size_t>(options.nResults, 2));
+
+    if (options.nResults > 1)
+        for (size_t rank = 0; rank < std::min(options.nResults, ranking.size()); rank++)
+            out << rank + 1 << ". " << ranking[rank].first << " " << ranking[rank].second << std::endl;
+
+    if (ranking.size() > 1)
+        out << "Margin to the runner-up: " << ranking[0].second - ranking[1].second << std::endl;
+}
+
+/**
+ * Function to shortlist the songs of a library with its decimated copy: the sample is decimated
+ * the same way, scored against every decimated song, and the best ones are kept.
+ * @param library are the songs to compare with the sample, with their decimated copy.
+ * @param samples are the interleaved samples of the audio sample.
+ * @param channels is the number of channels of the samples.
+ * @param options are the parameters of the query.
+ * @param pool runs the songs in parallel.
+ * @param err receives the errors and the skipped songs.
+ * @return the positions of the shortlisted songs, in the order of the library.
+ */
+std::vector<size_t> Wavfind::getShortlist(const Library& library, const std::vector<short>& samples, size_t channels,
+                                          const QueryOptions& options, ThreadPool& pool, std::ostream& err) {
+    QueryOptions coarseOptions = options;
+    coarseOptions.nResults = std::max(options.shortlist, options.nResults);
+    coarseOptions.checkEngines = false;
+    coarseOptions.sampleRate = 0;
+
+    std::ostringstream ignored;
+    Wavfind coarseFind;
+
+    coarseFind.identify(library.getCoarse(), decimateFrames(samples, channels, library.getCoarseFactor()), channels, coarseOptions, pool, ignored, err);
+
+    std::set<std::string> names;
+    for (const std::pair<std::string, double>& result : coarseFind.getRanking(coarseOptions.nResults))
+        names.insert(result.first);
+
+    std::vector<size_t> songs;
+    for (size_t song = 0; song < library.getNSongs(); song++)
+        if (names.count(library.getName(song)) > 0)
+            songs.push_back(song);
+
+    return songs;
+}
+
+/**
+ * Function to score a sample against the songs of a library and print the most probable song.
+ * Every song is scored by one task of the pool; the results are merged in the order of the
+ * library, so ties are resolved as with one thread.
+ * @param library are the songs to compare with the sample.
+ * @param samples are the interleaved samples of the audio sample.
+ * @param channels is the number of channels of the samples.
+ * @param options are the parameters of the query.
+ * @param pool runs the songs in parallel.
+ * @param out receives the answer.
+ * @param err receives the errors and the skipped songs.
+ * @return false if the sample cannot be compared with the library, or the engines disagree with --check.
+ */
+bool Wavfind::identify(const Library& library, const std::vector<short>& samples, size_t channels, const QueryOptions& options,
+                       ThreadPool& pool, std::ostream& out, std::ostream& err) {
+    /*
+     * Binary codebooks carry their own block size and features, so the sample is split (and its
+     * block energies computed) once per format in use, by the first thread that needs it.
+     */
+    std::map<BlockFormat, Matrix<short>> sampleBlocksByFormat;
+    std::map<BlockFormat, std::unique_ptr<WavScore>> scorers;
+    std::mutex scorersMutex, messagesMutex;
+    bool engineMismatches = false;
+    Projection::Query projectionQuery;
+    QuantizedCatalog::Query quantizedQuery;
+    MatrixView<const short> catalogBlocks;
+    BlockFormat catalogFormat;
+    bool catalogSearch = false;
+
+    auto getScorer = [&](const BlockFormat& format) {
+        std::lock_guard<std::mutex> lock(scorersMutex);
+
+        if (scorers.count(format) == 0) {
+            sampleBlocksByFormat[format] = getQueryBlocks(getSampleBlocks(samples, channels, format.blockFrames), channels, format);
+            scorers[format].reset(new WavScore(sampleBlocksByFormat[format].view(), bestDistanceKernel(), options.engine));
+        }
+
+        return scorers[format].get();
+    };
+
+    auto skip = [&](const std::string& name, const std::string& reason) {
+        std::lock_guard<std::mutex> lock(messagesMutex);
+        err << "Skipping " << name << ": " << reason << std::endl;
+    };
+
+    /*
+     * Returns false if the codebook cannot be compared with the sample.
+     */
+    auto score = [&](size_t song, double& result) {
+        const std::string& name = library.getName(song);
+        std::string reason;
+        BlockFormat format;
+
+        if (!getSongFormat(library, song, channels, options, format, reason)) {
+            if (!reason.empty())
+                skip(name, reason);
+            return false;
+        }
+
+        MatrixView<const short> codebookBlocks = library.getCentroids(song);
+        const WavScore* scorer = getScorer(format);
+
+        if (catalogSearch && format == catalogFormat && codebookBlocks.getRows() > 0) {
+            std::vector<uint64_t> minDistances, engineDistances;
+
+            if (library.isProjected())
+                library.getProjection().nearest(projectionQuery, catalogBlocks, song, codebookBlocks, minDistances);
+            else
+                library.getQuantized().nearest(quantizedQuery, catalogBlocks, song, codebookBlocks, minDistances);
+
+            result = scorer->score(minDistances);
+
+            if (options.checkEngines) {
+                scorer->nearest(codebookBlocks, library.getNorms(song), engineDistances);
+
+                size_t nMismatches = 0;
+                for (size_t block = 0; block < minDistances.size(); block++)
+                    if (minDistances[block] != engineDistances[block])
+                        nMismatches++;
+
+                if (nMismatches > 0) {
+                    std::lock_guard<std::mutex> lock(messagesMutex);
+                    err << "Error: the " << (library.isProjected() ? "projection" : "quantized catalog") << " and the engine disagree on "
+                        << nMismatches << " blocks of " << name << std::endl;
+                    engineMismatches = true;
+                }
+            }
+        }
+        else
+            result = scorer->score(codebookBlocks, library.getNorms(song));
+
+        if (options.checkEngines) {
+            size_t nMismatches = scorer->checkEngines(codebookBlocks, library.getNorms(song));
+
+            if (nMismatches > 0) {
+                std::lock_guard<std::mutex> lock(messagesMutex);
+                err << "Error: the engines disagree on " << nMismatches << " blocks of " << name << std::endl;
+                engineMismatches = true;
+            }
+        }
+
+        return true;
+    };
+
+    /*
+     * With an index (or a decimated catalog) only the candidate songs are scored. Each of them gets the
+     * exact score of the chosen engine, but a song left out of the shortlist is never scored, so the
+     * answer can differ from a full scan when the right song is not shortlisted.
+     */
+    std::vector<size_t> songs;
+
+    if (library.isIndexed()) {
+        const IvfIndex& index = library.getIndex();
+
+        if (index.getChannels() != channels) {
+            err << "Error: the index has " << index.getChannels() << " channels and the sample " << channels << std::endl;
+            return false;
+        }
+
+        /*
+         * Every song of an index has the format of the first one.
+         */
+        CodebookInfo info = library.getInfo(0);
+        BlockFormat format = {index.getBlockFrames(), info.melBands, info.melBands > 0 ? info.sampleRate : 0};
+
+        if (format.melBands > 0 && options.sampleRate != 0 && options.sampleRate != format.sampleRate) {
+            err << "Error: the index has log-mel features of " << format.sampleRate << " Hz and the sample has " << options.sampleRate << " Hz" << std::endl;
+            return false;
+        }
+
+        getScorer(format);
+        songs = index.getCandidates(sampleBlocksByFormat[format].view(), library.getCatalog(), options.nProbe, pool);
+    }
+    else if (library.hasCoarse())
+        songs = getShortlist(library, samples, channels, options, pool, err);
+    else {
+        songs.resize(library.getNSongs());
+        std::iota(songs.begin(), songs.end(), 0);
+    }
+
+    /*
+     * Every song of a projection or of a quantized catalog has the format of the first one, and
+     * the sample is projected (or split for the int8 matrix product) once.
+     */
+    if ((library.isProjected() || library.isQuantized()) && library.getNSongs() > 0) {
+        std::string reason;
+
+        if (getSongFormat(library, 0, channels, options, catalogFormat, reason)) {
+            getScorer(catalogFormat);
+            catalogBlocks = sampleBlocksByFormat[catalogFormat].view();
+
+            if (library.isProjected())
+                projectionQuery = library.getProjection().project(catalogBlocks, pool);
+            else
+                quantizedQuery = library.getQuantized().prepare(catalogBlocks);
+
+            catalogSearch = true;
+        }
+    }
+
+    std::vector<double> songResults(songs.size());
+    std::vector<char> scored(songs.size());
+
+    pool.parallelFor(songs.size(), [&](size_t i, size_t) {
+        scored[i] = score(songs[i], songResults[i]);
+    });
+
+    for (size_t i = 0; i < songs.size(); i++)
+        if (scored[i])
+            compare(library.getName(songs[i]), songResults[i]);
+
+    report(options, out);
+
+    if (options.checkEngines)
+        out << "Engine check: " << (engineMismatches ? "FAILED" : "ok") << std::endl;
+
+    return !engineMismatches;
+}
+
+/**
+ * Function to identify a sample that arrives in chunks, as interleaved 16-bit little-endian samples.
+ * The score of a song is a sum over the blocks of the sample, so every complete block is scored
+ * against the songs as soon as it arrives and added to their scores. The query stops as soon as
+ * the margin of the best song to the runner-up reaches options.stopMargin, or at the end of the
+ * input, and gives the same answer as identify for the samples read so far.
+ * @param library are the songs to compare with the sample.
+ * @param fd is the input, read with whatever each read returns so live captures are not delayed.
+ * @param channels is the number of channels of the samples.
+ * @param options are the parameters of the query.
+ * @param pool runs the songs in parallel.
+ * @param out receives the answer.
+ * @param err receives the errors and the skipped songs.
+ * @return false if no song can be compared with the sample, or the engines disagree with --check.
+ */
+bool Wavfind::identifyStream(const Library& library, int fd, size_t channels, const QueryOptions& options,
+                             ThreadPool& pool, std::ostream& out, std::ostream& err) {
+    /*
+     * The songs are grouped by format, and each group consumes the samples at its own pace.
+     */
+    std::map<BlockFormat, std::vector<size_t>> songsByFormat;
+    std::map<BlockFormat, size_t> nBlocksByFormat;
+
+    for (size_t song = 0; song < library.getNSongs(); song++) {
+        std::string reason;
+        BlockFormat format;
+
+        if (getSongFormat(library, song, channels, options, format, reason)) {
+            songsByFormat[format].push_back(song);
+            nBlocksByFormat[format] = 0;
+        }
+        else if (!reason.empty())
+            err << "Skipping " << library.getName(song) << ": " << reason << std::endl;
+    }
+
+    if (songsByFormat.empty()) {
+        err << "Error: no codebook can be compared with the sample" << std::endl;
+        return false;
+    }
+
+    std::vector<double> songResults(library.getNSongs(), 0.0);
+    std::vector<char> scored(library.getNSongs(), 0);
+    std::vector<short> samples;
+    size_t firstFrame = 0;
+    std::mutex messagesMutex;
+    bool engineMismatches = false, decided = false;
+
+    std::vector<char> buffer(1 << 16);
+    size_t nBuffered = 0;
+    ssize_t nRead;
+
+    while (!decided && (nRead = ::read(fd, buffer.data() + nBuffered, buffer.size() - nBuffered)) > 0) {
+        nBuffered += nRead;
+
+        size_t nValues = nBuffered / sizeof(short) / channels * channels;
+        for (size_t value = 0; value < nValues; value++)
+            samples.push_back((short) (uint16_t) ((unsigned char) buffer[2 * value] | (unsigned char) buffer[2 * value + 1] << 8));
+
+        nBuffered -= nValues * sizeof(short);
+        std::memmove(buffer.data(), buffer.data() + nValues * sizeof(short), nBuffered);
+
+        size_t nFrames = firstFrame + samples.size() / channels;
+        bool updated = false;
+
+        for (auto& group : songsByFormat) {
+            size_t blockSize = group.first.blockFrames;
+            size_t& nBlocks = nBlocksByFormat[group.first];
+            size_t nNewBlocks = nFrames / blockSize - nBlocks;
+
+            if (nNewBlocks == 0)
+                continue;
+
+            Matrix<short> newBlocks(nNewBlocks, blockSize * channels);
+            for (size_t block = 0; block < nNewBlocks; block++) {
+                auto begin = samples.begin() + ((nBlocks + block) * blockSize - firstFrame) * channels;
+                std::copy(begin, begin + blockSize * channels, newBlocks.getRow(block));
+            }
+
+            Matrix<short> queryBlocks = getQueryBlocks(std::move(newBlocks), channels, group.first);
+            WavScore scorer(queryBlocks.view(), bestDistanceKernel(), options.engine);
+            const std::vector<size_t>& songs = group.second;
+
+            pool.parallelFor(songs.size(), [&](size_t i, size_t) {
+                MatrixView<const short> codebookBlocks = library.getCentroids(songs[i]);
+
+                songResults[songs[i]] += scorer.score(codebookBlocks, library.getNorms(songs[i]));
+                scored[songs[i]] = 1;
+
+                if (options.checkEngines && scorer.checkEngines(codebookBlocks, library.getNorms(songs[i])) > 0) {
+                    std::lock_guard<std::mutex> lock(messagesMutex);
+                    err << "Error: the engines disagree on " << library.getName(songs[i]) << std::endl;
+                    engineMismatches = true;
+                }
+            });
+
+            nBlocks += nNewBlocks;
+            updated = true;
+        }
+
+        /*
+         * The samples every group has consumed are not needed anymore.
+         */
+        size_t consumed = std::numeric_limits<size_t>::max();
+        for (const auto& group : nBlocksByFormat)
+            consumed = std::min(consumed, group.second * group.first.blockFrames);
+
+        samples.erase(samples.begin(), samples.begin() + (consumed - firstFrame) * channels);
+        firstFrame = consumed;
+
+        if (updated && options.stopMargin < std::numeric_limits<double>::infinity()) {
+            double best = -std::numeric_limits<double>::infinity(), runnerUp = best;
+            size_t nScored = 0;
+
+            for (size_t song = 0; song < library.getNSongs(); song++) {
+                if (!scored[song])
+                    continue;
+
+                nScored++;
+                if (songResults[song] > best) {
+                    runnerUp = best;
+                    best = songResults[song];
+                }
+                else if (songResults[song] > runnerUp)
+                    runnerUp = songResults[song];
+            }
+
+            decided = nScored > 1 && best - runnerUp >= options.stopMargin;
+        }
+    }
+
+    for (size_t song = 0; song < library.getNSongs(); song++)
+        if (scored[song])
+            compare(library.getName(song), songResults[song]);
+
+    report(options, out);
+
+    size_t nBlocks = 0;
+    for (const auto& group : nBlocksByFormat)
+        nBlocks = std::max(nBlocks, group.second);
+
+    out << (decided ? "Decided after " : "Read all the ") << nBlocks << " blocks" << std::endl;
+
+    if (options.checkEngines)
+        out << "Engine check: " << (engineMismatches ? "FAILED" : "ok") << std::endl;
+
+    return !engineMismatches;
+}
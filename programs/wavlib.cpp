@@ -0,0 +1,576 @@
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <filesystem>
+#include <thread>
+#include <numeric>
+#include "codebookFile.h"
+#include "catalogFile.h"
+#include "ivfIndex.h"
+#include "projection.h"
+#include "quantizedCatalog.h"
+#include "decimation.h"
+
+/**
+ * Function to print the usage of every subcommand.
+ */
+void usage() {
+    std::cerr << "Usage: wavlib <command> [arguments]" << std::endl;
+    std::cerr << "  convert <text codebook> <binary codebook> <channels> [sample rate] [overlap frames]" << std::endl;
+    std::cerr << "  totext <codebook> <text codebook>" << std::endl;
+    std::cerr << "  pack <catalog> <binary codebook or directory>..." << std::endl;
+    std::cerr << "  index <catalog> <index> [-l lists] [-m subspaces] [-c codewords] [-t threads]" << std::endl;
+    std::cerr << "  project <catalog> <projection> [-d dimensions] [-t threads]" << std::endl;
+    std::cerr << "  quantize <catalog> <quantized catalog> [-t threads]" << std::endl;
+    std::cerr << "  decimate <catalog> <coarse catalog> [-f factor]" << std::endl;
+    std::cerr << "  info <codebook, catalog, index, projection or quantized catalog>..." << std::endl;
+}
+
+/**
+ * Function to convert a text codebook to the binary format.
+ * The text format does not store the audio parameters, so the number of channels must be given.
+ * @return the exit status of the program.
+ */
+int convert(int argc, char *argv[]) {
+    if (argc < 5 || argc > 7) {
+        usage();
+        return 1;
+    }
+
+    CodebookInfo info;
+    info.channels = std::atoi(argv[4]);
+    info.sampleRate = argc > 5 ? std::atoi(argv[5]) : 0;
+    info.overlapFrames = argc > 6 ? std::atoi(argv[6]) : 0;
+
+    CodebookFile codebook;
+    if (!codebook.open(argv[2]))
+        return 1;
+
+    MatrixView<const short> centroids = codebook.getCentroids();
+
+    if (info.channels == 0 || centroids.getCols() % info.channels != 0) {
+        std::cerr << "Error: the centroids have " << centroids.getCols() << " values, not a multiple of the channels" << std::endl;
+        return 1;
+    }
+    info.blockFrames = centroids.getCols() / info.channels;
+
+    if (!CodebookFile::write(argv[3], centroids, info)) {
+        std::cerr << "Error: could not write " << argv[3] << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Function to write any codebook in the text format.
+ * @return the exit status of the program.
+ */
+int toText(int argc, char *argv[]) {
+    if (argc != 4) {
+        usage();
+        return 1;
+    }
+
+    CodebookFile codebook;
+    if (!codebook.open(argv[2]) || !codebook.verify()) {
+        std::cerr << "Error: invalid codebook " << argv[2] << std::endl;
+        return 1;
+    }
+
+    /*
+     * The text format has no header, the features would be read as samples.
+     */
+    if (codebook.getInfo().melBands > 0) {
+        std::cerr << "Error: log-mel codebooks cannot be written in the text format" << std::endl;
+        return 1;
+    }
+
+    if (!CodebookFile::writeText(argv[3], codebook.getCentroids())) {
+        std::cerr << "Error: could not write " << argv[3] << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Function to merge binary codebooks into one catalog.
+ * Directories add all their .codebook files, in name order. A song is named after its codebook file.
+ * @return the exit status of the program.
+ */
+int pack(int argc, char *argv[]) {
+    if (argc < 4) {
+        usage();
+        return 1;
+    }
+
+    std::vector<std::string> paths;
+
+    for (int i = 3; i < argc; i++) {
+        std::error_code error;
+
+        if (!std::filesystem::is_directory(argv[i], error)) {
+            paths.emplace_back(argv[i]);
+            continue;
+        }
+
+        std::vector<std::string> directoryPaths;
+        for (const auto & entry : std::filesystem::directory_iterator(argv[i], error))
+            if (entry.path().extension() == ".codebook")
+                directoryPaths.push_back(entry.path().string());
+
+        std::sort(directoryPaths.begin(), directoryPaths.end());
+        paths.insert(paths.end(), directoryPaths.begin(), directoryPaths.end());
+    }
+
+    std::vector<std::unique_ptr<CodebookFile>> codebooks;
+    std::vector<const CodebookFile*> songs;
+    std::vector<std::string> names;
+
+    for (const std::string& path : paths) {
+        std::unique_ptr<CodebookFile> codebook(new CodebookFile());
+
+        if (!codebook->open(path) || !codebook->verify()) {
+            std::cerr << "Error: invalid codebook " << path << std::endl;
+            return 1;
+        }
+
+        if (!codebook->isBinary()) {
+            std::cerr << "Error: " << path << " is a text codebook, convert it first with wavlib convert" << std::endl;
+            return 1;
+        }
+
+        names.push_back(std::filesystem::path(path).filename().string());
+        songs.push_back(codebook.get());
+        codebooks.push_back(std::move(codebook));
+    }
+
+    if (songs.empty()) {
+        std::cerr << "Error: no codebooks to pack" << std::endl;
+        return 1;
+    }
+
+    if (!CatalogFile::write(argv[2], names, songs)) {
+        std::cerr << "Error: could not write " << argv[2] << std::endl;
+        return 1;
+    }
+
+    std::cout << "Packed " << songs.size() << " codebooks into " << argv[2] << std::endl;
+    return 0;
+}
+
+/**
+ * Function to build the approximate index of a catalog, used by wavfind --index.
+ * @return the exit status of the program.
+ */
+int index(int argc, char *argv[]) {
+    if (argc < 4) {
+        usage();
+        return 1;
+    }
+
+    IvfIndex::Options options;
+    size_t nThreads = std::max(1u, std::thread::hardware_concurrency());
+
+    for (int i = 4; i < argc; i++) {
+        if (i + 1 >= argc || argv[i][0] != '-' || std::strlen(argv[i]) != 2 || std::strchr("lmct", argv[i][1]) == nullptr) {
+            usage();
+            return 1;
+        }
+
+        int value = std::atoi(argv[i + 1]);
+        if (value <= 0) {
+            std::cerr << "Error: invalid value for " << argv[i] << std::endl;
+            return 1;
+        }
+
+        switch (argv[i][1]) {
+            case 'l': options.nLists = value; break;
+            case 'm': options.nSubspaces = value; break;
+            case 'c': options.nCodewords = value; break;
+            default: nThreads = value; break;
+        }
+        i++;
+    }
+
+    CatalogFile catalog;
+    if (!catalog.open(argv[2]))
+        return 1;
+
+    ThreadPool pool(nThreads);
+    if (!IvfIndex::build(catalog, argv[3], options, pool)) {
+        std::cerr << "Error: could not build " << argv[3] << std::endl;
+        return 1;
+    }
+
+    IvfIndex built;
+    if (!built.open(argv[3]))
+        return 1;
+
+    std::cout << "Indexed " << built.getNEntries() << " centroids of " << catalog.getNSongs() << " songs in " << built.getNLists()
+              << " lists, " << built.getNSubspaces() << " subspaces of " << built.getNCodewords() << " codewords" << std::endl;
+    return 0;
+}
+
+/**
+ * Function to build the projection of a catalog on its principal subspace, used by wavfind --projection.
+ * @return the exit status of the program.
+ */
+int project(int argc, char *argv[]) {
+    if (argc < 4) {
+        usage();
+        return 1;
+    }
+
+    Projection::Options options;
+    size_t nThreads = std::max(1u, std::thread::hardware_concurrency());
+
+    for (int i = 4; i < argc; i++) {
+        if (i + 1 >= argc || argv[i][0] != '-' || std::strlen(argv[i]) != 2 || std::strchr("dt", argv[i][1]) == nullptr) {
+            usage();
+            return 1;
+        }
+
+        int value = std::atoi(argv[i + 1]);
+        if (value <= 0) {
+            std::cerr << "Error: invalid value for " << argv[i] << std::endl;
+            return 1;
+        }
+
+        (argv[i][1] == 'd' ? options.nDims : nThreads) = value;
+        i++;
+    }
+
+    CatalogFile catalog;
+    if (!catalog.open(argv[2]))
+        return 1;
+
+    ThreadPool pool(nThreads);
+    if (!Projection::build(catalog, argv[3], options, pool)) {
+        std::cerr << "Error: could not build " << argv[3] << std::endl;
+        return 1;
+    }
+
+    Projection built;
+    if (!built.open(argv[3]))
+        return 1;
+
+    std::cout << "Projected " << built.getNEntries() << " centroids of " << catalog.getNSongs() << " songs from "
+              << built.getNCols() << " to " << built.getNDims() << " dimensions" << std::endl;
+    return 0;
+}
+
+/**
+ * Function to print the parameters of a projection and check its checksum.
+ * @return the exit status of the program.
+ */
+int projectionInfo(const std::string& path) {
+    Projection projection;
+
+    if (!projection.open(path))
+        return 1;
+
+    bool valid = projection.verify();
+    std::cout << path << ": projection of " << projection.getNEntries() << " centroids, " << projection.getChannels() << " channels, blocks of "
+              << projection.getBlockFrames() << " frames, " << projection.getNCols() << " values to " << projection.getNDims()
+              << " dimensions, checksum " << (valid ? "ok" : "FAILED") << std::endl;
+
+    return valid ? 0 : 1;
+}
+
+/**
+ * Function to write the int8 copy of the centroids of a catalog, used by wavfind --quantized.
+ * @return the exit status of the program.
+ */
+int quantize(int argc, char *argv[]) {
+    if (argc != 4 && !(argc == 6 && strcmp(argv[4], "-t") == 0)) {
+        usage();
+        return 1;
+    }
+
+    size_t nThreads = std::max(1u, std::thread::hardware_concurrency());
+
+    if (argc == 6) {
+        int value = std::atoi(argv[5]);
+
+        if (value <= 0) {
+            std::cerr << "Error: invalid value for -t" << std::endl;
+            return 1;
+        }
+        nThreads = value;
+    }
+
+    CatalogFile catalog;
+    if (!catalog.open(argv[2]))
+        return 1;
+
+    ThreadPool pool(nThreads);
+    if (!QuantizedCatalog::build(catalog, argv[3], pool)) {
+        std::cerr << "Error: could not build " << argv[3] << std::endl;
+        return 1;
+    }
+
+    QuantizedCatalog built;
+    if (!built.open(argv[3]))
+        return 1;
+
+    std::cout << "Quantized " << built.getNEntries() << " centroids of " << catalog.getNSongs() << " songs to int8" << std::endl;
+    return 0;
+}
+
+/**
+ * Function to write the decimated copy of a catalog, used by wavfind --coarse to shortlist songs.
+ * Every centroid is decimated by the same factor, which must divide the block size of every song.
+ * Without -f the factor is the largest one up to 8 that divides all the block sizes.
+ * @return the exit status of the program.
+ */
+int decimate(int argc, char *argv[]) {
+    if (argc != 4 && !(argc == 6 && strcmp(argv[4], "-f") == 0)) {
+        usage();
+        return 1;
+    }
+
+    size_t factor = 0;
+
+    if (argc == 6) {
+        int value = std::atoi(argv[5]);
+
+        if (value <= 1) {
+            std::cerr << "Error: invalid value for -f" << std::endl;
+            return 1;
+        }
+        factor = value;
+    }
+
+    CatalogFile catalog;
+    if (!catalog.open(argv[2]))
+        return 1;
+
+    if (factor == 0) {
+        size_t blockFrames = 0;
+
+        for (size_t song = 0; song < catalog.getNSongs(); song++)
+            blockFrames = std::gcd(blockFrames, (size_t) catalog.getInfo(song).blockFrames);
+
+        for (factor = 8; factor > 1 && blockFrames % factor != 0; factor--);
+
+        if (factor == 1) {
+            std::cerr << "Error: no factor up to 8 divides the block sizes of " << argv[2] << ", choose one with -f" << std::endl;
+            return 1;
+        }
+    }
+
+    std::vector<std::string> names;
+    std::vector<Matrix<short>> decimated;
+    std::vector<CodebookInfo> infos;
+
+    for (size_t song = 0; song < catalog.getNSongs(); song++) {
+        CodebookInfo info = catalog.getInfo(song);
+        MatrixView<const short> centroids = catalog.getCentroids(song);
+
+        if (info.melBands > 0) {
+            std::cerr << "Error: " << catalog.getName(song) << " has log-mel features, only the samples of blocks can be decimated" << std::endl;
+            return 1;
+        }
+
+        if (info.blockFrames % factor != 0 || info.blockFrames / factor == 0) {
+            std::cerr << "Error: the blocks of " << info.blockFrames << " frames of " << catalog.getName(song)
+                      << " cannot be decimated by " << factor << std::endl;
+            return 1;
+        }
+
+        Matrix<short> rows(centroids.getRows(), info.blockFrames / factor * info.channels);
+
+        for (size_t row = 0; row < centroids.getRows(); row++)
+            decimateFrames(centroids.getRow(row), info.blockFrames, info.channels, factor, rows.getRow(row));
+
+        info.blockFrames /= factor;
+        info.overlapFrames /= factor;
+        info.sampleRate /= factor;
+
+        names.push_back(catalog.getName(song));
+        decimated.push_back(std::move(rows));
+        infos.push_back(info);
+    }
+
+    std::vector<MatrixView<const short>> centroids;
+    for (const Matrix<short>& rows : decimated)
+        centroids.push_back(rows.view());
+
+    if (!CatalogFile::write(argv[3], names, centroids, infos)) {
+        std::cerr << "Error: could not write " << argv[3] << std::endl;
+        return 1;
+    }
+
+    std::cout << "Decimated " << names.size() << " songs of " << argv[2] << " by " << factor << " into " << argv[3] << std::endl;
+    return 0;
+}
+
+/**
+ * Function to print the parameters of a quantized catalog and check its checksum.
+ * @return the exit status of the program.
+ */
+int quantizedInfo(const std::string& path) {
+    QuantizedCatalog quantized;
+
+    if (!quantized.open(path))
+        return 1;
+
+    bool valid = quantized.verify();
+    std::cout << path << ": int8 copy of " << quantized.getNEntries() << " centroids of " << quantized.getNCols() << " values, "
+              << quantized.getChannels() << " channels, blocks of " << quantized.getBlockFrames() << " frames, checksum "
+              << (valid ? "ok" : "FAILED") << std::endl;
+
+    return valid ? 0 : 1;
+}
+
+/**
+ * Function to print the parameters of an index and check its checksum.
+ * @return the exit status of the program.
+ */
+int indexInfo(const std::string& path) {
+    IvfIndex index;
+
+    if (!index.open(path))
+        return 1;
+
+    bool valid = index.verify();
+    std::cout << path << ": index of " << index.getNEntries() << " centroids, " << index.getChannels() << " channels, blocks of "
+              << index.getBlockFrames() << " frames, " << index.getNLists() << " lists, " << index.getNSubspaces()
+              << " subspaces of " << index.getNCodewords() << " codewords, checksum " << (valid ? "ok" : "FAILED") << std::endl;
+
+    return valid ? 0 : 1;
+}
+
+/**
+ * Function to print the songs of a catalog and check its checksums.
+ * @return the exit status of the program.
+ */
+int catalogInfo(const std::string& path) {
+    CatalogFile catalog;
+
+    if (!catalog.open(path))
+        return 1;
+
+    bool valid = catalog.verify();
+    std::cout << path << ": catalog of " << catalog.getNSongs() << " songs, checksums " << (valid ? "ok" : "FAILED") << std::endl;
+
+    for (size_t song = 0; song < catalog.getNSongs(); song++) {
+        CodebookInfo info = catalog.getInfo(song);
+
+        std::cout << "  " << catalog.getName(song) << ": " << catalog.getCentroids(song).getRows() << " centroids, "
+                  << info.channels << " channels, " << info.sampleRate << " Hz, blocks of " << info.blockFrames << " frames";
+
+        if (info.melBands > 0)
+            std::cout << ", " << info.melBands << " log-mel bands";
+        std::cout << std::endl;
+    }
+
+    return valid ? 0 : 1;
+}
+
+/**
+ * Function to print the header of codebooks and check their checksums.
+ * @return the exit status of the program, 1 if any codebook is invalid.
+ */
+int info(int argc, char *argv[]) {
+    if (argc < 3) {
+        usage();
+        return 1;
+    }
+
+    int status = 0;
+
+    for (int i = 2; i < argc; i++) {
+        if (CatalogFile::isCatalog(argv[i])) {
+            if (catalogInfo(argv[i]) != 0)
+                status = 1;
+            continue;
+        }
+
+        if (IvfIndex::isIndex(argv[i])) {
+            if (indexInfo(argv[i]) != 0)
+                status = 1;
+            continue;
+        }
+
+        if (Projection::isProjection(argv[i])) {
+            if (projectionInfo(argv[i]) != 0)
+                status = 1;
+            continue;
+        }
+
+        if (QuantizedCatalog::isQuantized(argv[i])) {
+            if (quantizedInfo(argv[i]) != 0)
+                status = 1;
+            continue;
+        }
+
+        CodebookFile codebook;
+
+        if (!codebook.open(argv[i])) {
+            status = 1;
+            continue;
+        }
+
+        const CodebookInfo& info = codebook.getInfo();
+        bool valid = codebook.verify();
+
+        std::cout << argv[i] << ": " << (codebook.isBinary() ? "binary" : "text")
+                  << ", " << codebook.getCentroids().getRows() << " centroids of " << codebook.getCentroids().getCols() << " values";
+
+        if (codebook.isBinary()) {
+            std::cout << ", " << info.channels << " channels, " << info.sampleRate << " Hz, blocks of "
+                      << info.blockFrames << " frames with " << info.overlapFrames << " overlapping, checksum "
+                      << (valid ? "ok" : "FAILED");
+
+            if (info.melBands > 0)
+                std::cout << ", " << info.melBands << " log-mel bands";
+        }
+        std::cout << std::endl;
+
+        if (!valid)
+            status = 1;
+    }
+
+    return status;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        usage();
+        return 1;
+    }
+
+    if (strcmp(argv[1], "convert") == 0)
+        return convert(argc, argv);
+
+    if (strcmp(argv[1], "totext") == 0)
+        return toText(argc, argv);
+
+    if (strcmp(argv[1], "pack") == 0)
+        return pack(argc, argv);
+
+    if (strcmp(argv[1], "index") == 0)
+        return index(argc, argv);
+
+    if (strcmp(argv[1], "project") == 0)
+        return project(argc, argv);
+
+    if (strcmp(argv[1], "quantize") == 0)
+        return quantize(argc, argv);
+
+    if (strcmp(argv[1], "decimate") == 0)
+        return decimate(argc, argv);
+
+    if (strcmp(argv[1], "info") == 0)
+        return info(argc, argv);
+
+    usage();
+    return 1;
+}
@@ -0,0 +1,435 @@
+#include <iostream>
+#include <sndfile.hh>
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <vector>
+#include <map>
+#include <memory>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#include <numeric>
+#include <limits>
+#include <cmath>
+#include <filesystem>
+#include <thread>
+#include "fingerprint.h"
+#include "wavfind.h"
+
+/**
+ * Function to print the usage of every subcommand.
+ */
+void usage() {
+    std::cerr << "Usage: wavprint <command> [arguments]" << std::endl;
+    std::cerr << "  build <index> <WAV file or directory>... [-t threads]" << std::endl;
+    std::cerr << "  find [-n results] <index> <audio sample file>" << std::endl;
+    std::cerr << "  info <index>" << std::endl;
+    std::cerr << "  bench <index> <directory with codebooks or catalog> <WAV file or directory>... [-q queries per song] [-l seconds] [-s noise] [-e pruned|batch] [-t threads]" << std::endl;
+}
+
+/**
+ * Function to read a whole WAV file with 16-bit samples.
+ * Errors are reported on std::cerr.
+ * @param path is the location of the file.
+ * @param samples receives the interleaved samples.
+ * @param channels receives the number of channels.
+ * @param sampleRate receives the sample rate.
+ * @return false if the file cannot be read.
+ */
+bool readWav(const std::string& path, std::vector<short>& samples, size_t& channels, size_t& sampleRate) {
+    SndfileHandle file { path };
+
+    if (file.error() || (file.format() & SF_FORMAT_TYPEMASK) != SF_FORMAT_WAV || (file.format() & SF_FORMAT_SUBMASK) != SF_FORMAT_PCM_16) {
+        std::cerr << "Error: " << path << " is not a WAV file with 16-bit samples" << std::endl;
+        return false;
+    }
+
+    const sf_count_t framesPerRead = 65536;
+    std::vector<short> buffer(framesPerRead * file.channels());
+    sf_count_t nFrames;
+
+    samples.clear();
+    while ((nFrames = file.readf(buffer.data(), framesPerRead)) > 0)
+        samples.insert(samples.end(), buffer.begin(), buffer.begin() + nFrames * file.channels());
+
+    channels = file.channels();
+    sampleRate = file.samplerate();
+    return true;
+}
+
+/**
+ * Function to list the WAV files of the arguments; directories add all their .wav files, in name order.
+ * @param arguments are files and directories.
+ * @return the paths of the files.
+ */
+std::vector<std::string> getWavPaths(const std::vector<std::string>& arguments) {
+    std::vector<std::string> paths;
+
+    for (const std::string& argument : arguments) {
+        std::error_code error;
+
+        if (!std::filesystem::is_directory(argument, error)) {
+            paths.push_back(argument);
+            continue;
+        }
+
+        std::vector<std::string> directoryPaths;
+        for (const auto & entry : std::filesystem::directory_iterator(argument, error))
+            if (entry.path().extension() == ".wav")
+                directoryPaths.push_back(entry.path().string());
+
+        std::sort(directoryPaths.begin(), directoryPaths.end());
+        paths.insert(paths.end(), directoryPaths.begin(), directoryPaths.end());
+    }
+
+    return paths;
+}
+
+/**
+ * Function to get the name of a song without its directory and extension, to compare the names
+ * of WAV files, codebooks and fingerprinted songs.
+ */
+std::string getStem(const std::string& name) {
+    return std::filesystem::path(name).stem().string();
+}
+
+/**
+ * Function to split the options of a subcommand from its other arguments.
+ * @param letters are the options that take a value, such as "tn".
+ * @param values receives the value of every option given.
+ * @param arguments receives the other arguments.
+ * @return false if an option is unknown or has no value.
+ */
+bool parseArguments(int argc, char *argv[], const char* letters, std::map<char, std::string>& values, std::vector<std::string>& arguments) {
+    for (int i = 2; i < argc; i++) {
+        if (argv[i][0] == '-' && std::strlen(argv[i]) == 2) {
+            if (std::strchr(letters, argv[i][1]) == nullptr || i + 1 >= argc)
+                return false;
+
+            values[argv[i][1]] = argv[i + 1];
+            i++;
+        }
+        else
+            arguments.emplace_back(argv[i]);
+    }
+
+    return true;
+}
+
+/**
+ * Function to read a positive option.
+ * @return false, after reporting it, if the value is not a positive number.
+ */
+bool getPositive(const std::map<char, std::string>& values, char letter, double& value) {
+    if (values.count(letter) == 0)
+        return true;
+
+    char* end;
+    value = std::strtod(values.at(letter).c_str(), &end);
+
+    if (*end != '\0' || !(value > 0)) {
+        std::cerr << "Error: invalid value for -" << letter << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Function to fingerprint WAV files into a new index.
+ * @return the exit status of the program.
+ */
+int build(int argc, char *argv[]) {
+    std::map<char, std::string> values;
+    std::vector<std::string> arguments;
+    double nThreads = std::max(1u, std::thread::hardware_concurrency());
+
+    if (!parseArguments(argc, argv, "t", values, arguments) || arguments.size() < 2) {
+        usage();
+        return 1;
+    }
+
+    if (!getPositive(values, 't', nThreads))
+        return 1;
+
+    std::vector<std::string> paths = getWavPaths(std::vector<std::string>(arguments.begin() + 1, arguments.end()));
+
+    if (paths.empty()) {
+        std::cerr << "Error: no WAV files to fingerprint" << std::endl;
+        return 1;
+    }
+
+    std::vector<std::string> names(paths.size());
+    std::vector<std::vector<Landmark>> landmarks(paths.size());
+    std::vector<size_t> nFrames(paths.size());
+    std::vector<char> valid(paths.size());
+    Fingerprinter fingerprinter;
+    ThreadPool pool((size_t) nThreads);
+
+    pool.parallelFor(paths.size(), [&](size_t file, size_t) {
+        std::vector<short> samples;
+        size_t channels, sampleRate;
+
+        valid[file] = readWav(paths[file], samples, channels, sampleRate);
+        if (!valid[file])
+            return;
+
+        names[file] = std::filesystem::path(paths[file]).filename().string();
+        landmarks[file] = fingerprinter.getLandmarks(samples, channels, sampleRate);
+        nFrames[file] = samples.size() / channels * Fingerprinter::SAMPLE_RATE / sampleRate / Fingerprinter::HOP;
+    });
+
+    size_t nLandmarks = 0;
+
+    for (size_t file = 0; file < paths.size(); file++) {
+        if (!valid[file])
+            return 1;
+        nLandmarks += landmarks[file].size();
+    }
+
+    if (!FingerprintIndex::write(arguments[0], names, landmarks, nFrames)) {
+        std::cerr << "Error: could not write " << arguments[0] << std::endl;
+        return 1;
+    }
+
+    std::cout << "Fingerprinted " << paths.size() << " songs with " << nLandmarks << " landmarks into " << arguments[0] << std::endl;
+    return 0;
+}
+
+/**
+ * Function to rank the songs of an index by their votes.
+ * @param matches are the votes of every song.
+ * @return the matches, best first, in the order of the index when they tie.
+ */
+std::vector<FingerprintIndex::Match> getRanking(std::vector<FingerprintIndex::Match> matches) {
+    std::stable_sort(matches.begin(), matches.end(), [](const FingerprintIndex::Match& a, const FingerprintIndex::Match& b) {
+        return a.votes > b.votes;
+    });
+
+    return matches;
+}
+
+/**
+ * Function to identify an audio sample with a fingerprint index.
+ * @return the exit status of the program.
+ */
+int find(int argc, char *argv[]) {
+    std::map<char, std::string> values;
+    std::vector<std::string> arguments;
+    double nResults = 1;
+
+    if (!parseArguments(argc, argv, "n", values, arguments) || arguments.size() != 2) {
+        usage();
+        return 1;
+    }
+
+    if (!getPositive(values, 'n', nResults))
+        return 1;
+
+    FingerprintIndex index;
+    std::vector<short> samples;
+    size_t channels, sampleRate;
+
+    if (!index.open(arguments[0]) || !readWav(arguments[1], samples, channels, sampleRate))
+        return 1;
+
+    std::vector<FingerprintIndex::Match> ranking = getRanking(index.identify(Fingerprinter().getLandmarks(samples, channels, sampleRate)));
+
+    if (ranking.empty() || ranking[0].votes == 0) {
+        std::cout << "I think this is your song: None" << std::endl;
+        return 0;
+    }
+
+    std::cout << "I think this is your song: " << index.getName(ranking[0].song) << std::endl;
+
+    if (nResults > 1)
+        for (size_t rank = 0; rank < std::min((size_t) nResults, ranking.size()); rank++)
+            std::cout << rank + 1 << ". " << index.getName(ranking[rank].song) << " " << ranking[rank].votes << std::endl;
+
+    if (ranking.size() > 1)
+        std::cout << "Margin to the runner-up: " << ranking[0].votes - ranking[1].votes << " landmarks" << std::endl;
+
+    std::cout << "Position in the song: " << (double) ranking[0].offset * Fingerprinter::HOP / Fingerprinter::SAMPLE_RATE << " s" << std::endl;
+    return 0;
+}
+
+/**
+ * Function to print the songs of a fingerprint index and check its checksum.
+ * @return the exit status of the program.
+ */
+int info(int argc, char *argv[]) {
+    if (argc != 3) {
+        usage();
+        return 1;
+    }
+
+    FingerprintIndex index;
+
+    if (!index.open(argv[2]))
+        return 1;
+
+    bool valid = index.verify();
+    std::cout << argv[2] << ": fingerprint index of " << index.getNSongs() << " songs, " << index.getNPostings() << " landmarks, checksum "
+              << (valid ? "ok" : "FAILED") << std::endl;
+
+    for (size_t song = 0; song < index.getNSongs(); song++)
+        std::cout << "  " << index.getName(song) << ": " << (double) index.getNFrames(song) * Fingerprinter::HOP / Fingerprinter::SAMPLE_RATE << " s" << std::endl;
+
+    return valid ? 0 : 1;
+}
+
+/**
+ * Function to find the best song of a library for a sample with the query path of wavfind.
+ * @param options are the parameters of the query; its sample rate is set to the sample's.
+ * @return the name of the best song, or an empty name if no song can be compared with the sample.
+ */
+std::string findInLibrary(const Library& library, const std::vector<short>& samples, size_t channels, size_t sampleRate,
+                          QueryOptions options, ThreadPool& pool) {
+    std::ostringstream out, err;
+    Wavfind wf;
+
+    options.sampleRate = sampleRate;
+    if (!wf.identify(library, samples, channels, options, pool, out, err))
+        return "";
+
+    return wf.guessMusic();
+}
+
+/**
+ * Function to compare the accuracy and latency of the fingerprint index and the codebooks on the
+ * same excerpts: queriesPerSong excerpts of every WAV file, at random positions and with Gaussian
+ * noise of the given deviation, are identified by both, the codebooks with the query of wavfind
+ * and the engine given by -e. An answer is right when its name is the name of the WAV file,
+ * without the extensions.
+ * @return the exit status of the program.
+ */
+int bench(int argc, char *argv[]) {
+    std::map<char, std::string> values;
+    std::vector<std::string> arguments;
+    double nQueries = 3, seconds = 5, noise = 0, nThreads = std::max(1u, std::thread::hardware_concurrency());
+
+    if (!parseArguments(argc, argv, "qlset", values, arguments) || arguments.size() < 3) {
+        usage();
+        return 1;
+    }
+
+    if (values.count('s') > 0 && values['s'] == "0")
+        values.erase('s');
+
+    if (!getPositive(values, 'q', nQueries) || !getPositive(values, 'l', seconds) || !getPositive(values, 's', noise) || !getPositive(values, 't', nThreads))
+        return 1;
+
+    QueryOptions options;
+
+    if (values.count('e') > 0) {
+        if (values['e'] != "pruned" && values['e'] != "batch") {
+            std::cerr << "Error: unknown engine " << values['e'] << std::endl;
+            return 1;
+        }
+        options.engine = values['e'] == "batch" ? ScoreEngine::Batch : ScoreEngine::Pruned;
+    }
+
+    FingerprintIndex index;
+    Library library;
+
+    if (!index.open(arguments[0]) || !library.open(arguments[1], ""))
+        return 1;
+
+    std::vector<std::string> paths = getWavPaths(std::vector<std::string>(arguments.begin() + 2, arguments.end()));
+    ThreadPool pool((size_t) nThreads);
+    Fingerprinter fingerprinter;
+    std::mt19937_64 generator(1);
+    std::normal_distribution<double> gaussian(0, noise);
+
+    struct Matcher {
+        std::string name;
+        size_t nRight = 0;
+        std::vector<double> latencies;
+    };
+
+    Matcher matchers[2] = {{std::string("codebooks (") + (options.engine == ScoreEngine::Batch ? "batch" : "pruned") + " engine)", 0, {}},
+                           {"fingerprints", 0, {}}};
+
+    for (const std::string& path : paths) {
+        std::vector<short> samples;
+        size_t channels, sampleRate;
+
+        if (!readWav(path, samples, channels, sampleRate))
+            return 1;
+
+        size_t nFrames = samples.size() / channels;
+        size_t excerptFrames = std::min(nFrames, (size_t) (seconds * sampleRate));
+
+        for (size_t query = 0; query < (size_t) nQueries; query++) {
+            size_t first = std::uniform_int_distribution<size_t>(0, nFrames - excerptFrames)(generator);
+            std::vector<short> excerpt(samples.begin() + first * channels, samples.begin() + (first + excerptFrames) * channels);
+
+            if (noise > 0)
+                for (short& sample : excerpt)
+                    sample = (short) std::max(-32768.0, std::min(32767.0, std::round(sample + gaussian(generator))));
+
+            for (size_t matcher = 0; matcher < 2; matcher++) {
+                auto start = std::chrono::steady_clock::now();
+                std::string answer;
+
+                if (matcher == 0) {
+                    answer = findInLibrary(library, excerpt, channels, sampleRate, options, pool);
+                }
+                else {
+                    std::vector<FingerprintIndex::Match> ranking = getRanking(index.identify(fingerprinter.getLandmarks(excerpt, channels, sampleRate)));
+                    answer = !ranking.empty() && ranking[0].votes > 0 ? index.getName(ranking[0].song) : "";
+                }
+
+                std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+                matchers[matcher].latencies.push_back(elapsed.count());
+
+                if (getStem(getStem(answer)) == getStem(path))
+                    matchers[matcher].nRight++;
+            }
+        }
+    }
+
+    std::cout << "Excerpts of " << seconds << " s with noise " << noise << ": " << paths.size() << " songs x " << (size_t) nQueries << " queries, "
+              << library.getNSongs() << " codebooks in the library, " << index.getNSongs() << " songs in the index" << std::endl;
+
+    for (Matcher& matcher : matchers) {
+        std::vector<double>& latencies = matcher.latencies;
+        std::sort(latencies.begin(), latencies.end());
+
+        double mean = latencies.empty() ? 0 : std::accumulate(latencies.begin(), latencies.end(), 0.0) / latencies.size();
+        double median = latencies.empty() ? 0 : latencies[latencies.size() / 2];
+        double worst = latencies.empty() ? 0 : latencies.back();
+
+        std::cout << matcher.name << ": " << matcher.nRight << "/" << latencies.size() << " right, " << mean << " ms mean, "
+                  << median << " ms median, " << worst << " ms max per query" << std::endl;
+    }
+
+    return 0;
+}
+
+/**
+ * Identification of songs by constellation fingerprints: pairs of spectral peaks hashed into an
+ * inverted index, and a benchmark against the codebooks of wavfind.
+ */
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        usage();
+        return 1;
+    }
+
+    if (strcmp(argv[1], "build") == 0)
+        return build(argc, argv);
+
+    if (strcmp(argv[1], "find") == 0)
+        return find(argc, argv);
+
+    if (strcmp(argv[1], "info") == 0)
+        return info(argc, argv);
+
+    if (strcmp(argv[1], "bench") == 0)
+        return bench(argc, argv);
+
+    usage();
+    return 1;
+}
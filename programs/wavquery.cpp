@@ -0,0 +1,118 @@
+#include <iostream>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/**
+ * Function to write a whole buffer to a socket.
+ * @return false if the server closed the connection.
+ */
+bool writeAll(int fd, const char* data, size_t n) {
+    while (n > 0) {
+        ssize_t nWritten = ::write(fd, data, n);
+
+        if (nWritten <= 0)
+            return false;
+
+        data += nWritten;
+        n -= nWritten;
+    }
+
+    return true;
+}
+
+/**
+ * Client of wavfind --serve: sends an audio sample to the server and prints its answer.
+ * The sample is a WAV file, or with --pcm raw interleaved 16-bit little-endian samples;
+ * "-" reads it from the standard input.
+ */
+int main(int argc, char *argv[]) {
+    size_t nResults = 1, channels = 0;
+    std::string arguments[2];
+    int nArguments = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if ((strcmp(argv[i], "-n") == 0 || strcmp(argv[i], "--pcm") == 0) && i + 1 < argc) {
+            int value = std::atoi(argv[i + 1]);
+
+            if (value <= 0) {
+                std::cerr << "Error: invalid value for " << argv[i] << std::endl;
+                return 1;
+            }
+
+            (argv[i][1] == 'n' ? nResults : channels) = value;
+            i++;
+        }
+        else if (nArguments < 2)
+            arguments[nArguments++] = argv[i];
+        else
+            nArguments++;
+    }
+
+    if (nArguments != 2) {
+        std::cerr << "Usage: wavquery [-n results] [--pcm channels] <socket> <audio sample file or ->" << std::endl;
+        std::cerr << "--pcm sends raw interleaved 16-bit little-endian samples instead of a WAV file." << std::endl;
+        return 1;
+    }
+
+    std::string bytes;
+
+    if (arguments[1] == "-")
+        bytes.assign(std::istreambuf_iterator<char>(std::cin), std::istreambuf_iterator<char>());
+    else {
+        std::ifstream fp(arguments[1], std::ios::binary);
+
+        if (!fp) {
+            std::cerr << "Error: could not open " << arguments[1] << std::endl;
+            return 1;
+        }
+
+        bytes.assign(std::istreambuf_iterator<char>(fp), std::istreambuf_iterator<char>());
+    }
+
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+
+    if (arguments[0].size() >= sizeof(address.sun_path)) {
+        std::cerr << "Error: the socket path is too long" << std::endl;
+        return 1;
+    }
+    std::strcpy(address.sun_path, arguments[0].c_str());
+
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (server < 0 || connect(server, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+        std::cerr << "Error: could not connect to " << arguments[0] << std::endl;
+        return 1;
+    }
+
+    std::string header = channels > 0
+        ? "PCM " + std::to_string(channels) + " " + std::to_string(nResults) + " " + std::to_string(bytes.size()) + "\n"
+        : "WAV " + std::to_string(nResults) + " " + std::to_string(bytes.size()) + "\n";
+
+    if (!writeAll(server, header.data(), header.size()) || !writeAll(server, bytes.data(), bytes.size())) {
+        std::cerr << "Error: the server closed the connection" << std::endl;
+        close(server);
+        return 1;
+    }
+
+    /*
+     * The answer is the output of wavfind for the sample; an answer starting with an error fails.
+     */
+    std::string reply;
+    char buffer[4096];
+    ssize_t nRead;
+
+    while ((nRead = ::read(server, buffer, sizeof(buffer))) > 0)
+        reply.append(buffer, nRead);
+
+    close(server);
+    std::cout << reply;
+
+    return reply.empty() || reply.compare(0, 6, "Error:") == 0 ? 1 : 0;
+}
@@ -0,0 +1,238 @@
+#ifndef WAVSCORE_H
+#define WAVSCORE_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <utility>
+#include <limits>
+#include <memory>
+#include <vector>
+#include "batchDistance.h"
+#include "distance.h"
+#include "matrix.h"
+
+/**
+ * Search for the closest codebook block of every sample block; both give the same exact result.
+ * Pruned skips most codebook blocks with a norm bound, Batch computes every distance with a
+ * blocked matrix product (see BatchDistance).
+ */
+enum class ScoreEngine { Pruned, Batch };
+
+/**
+ * Squared norms of the blocks of a codebook, and the blocks sorted by norm for the pruned engine.
+ * They only depend on the codebook, so they are computed once when it is opened and shared by
+ * every query.
+ */
+class CodebookNorms {
+    private:
+        std::vector<uint64_t> energies;
+        std::vector<std::pair<double, size_t>> byNorm;
+
+    public:
+        CodebookNorms() = default;
+
+        /**
+         * @param codebook are the blocks of the codebook.
+         * @param kernel is the implementation of the squared distance.
+         */
+        explicit CodebookNorms(MatrixView<const short> codebook, DistanceKernel kernel = bestDistanceKernel())
+            : energies(codebook.getRows()), byNorm(codebook.getRows()) {
+            SquaredDistanceFn squaredDistance = getSquaredDistance(kernel);
+            std::vector<short> silence(codebook.getCols(), 0);
+
+            for (size_t row = 0; row < codebook.getRows(); row++) {
+                energies[row] = squaredDistance(codebook.getRow(row), silence.data(), codebook.getCols());
+                byNorm[row] = std::make_pair(std::sqrt((double) energies[row]), row);
+            }
+
+            std::sort(byNorm.begin(), byNorm.end());
+        }
+
+        const std::vector<uint64_t>& getEnergies() const {
+            return energies;
+        }
+
+        const std::vector<std::pair<double, size_t>>& getByNorm() const {
+            return byNorm;
+        }
+};
+
+/**
+ * Class responsible for scoring an audio sample against codebooks.
+ * The signal energy of every sample block is computed once per query. The codebook blocks are
+ * ranked by squared error, which gives the same order as the signal-to-noise ratio, and only
+ * the best match of each sample block is converted to a signal-to-noise ratio.
+ * The norms of the sample blocks are kept to prune the search for the closest codebook block.
+ */
+class WavScore {
+    private:
+        MatrixView<const short> sampleBlocks;
+        std::vector<uint64_t> energies;
+        std::vector<double> norms;
+        std::vector<short> silence;
+        SquaredDistanceFn squaredDistance;
+        DistanceKernel kernel;
+        ScoreEngine engine;
+        std::unique_ptr<BatchDistance> batch;
+
+        /*
+         * The codebook blocks are sorted by norm and visited outwards from the norm of the sample
+         * block, starting with the best block of the previous sample block, and the search stops
+         * when the norm bound |‖x‖ - ‖c‖| <= ‖x - c‖ shows that no other block can be closer.
+         * A distance is also abandoned as soon as it exceeds the best one so far.
+         */
+        void nearestPruned(MatrixView<const short> codebook, const CodebookNorms& codebookNorms, std::vector<uint64_t>& minDistances) const {
+            size_t nValues = sampleBlocks.getCols();
+            size_t k = codebook.getRows();
+            const std::vector<std::pair<double, size_t>>& byNorm = codebookNorms.getByNorm();
+
+            minDistances.resize(sampleBlocks.getRows());
+            size_t previous = 0;
+
+            for (size_t block = 0; block < sampleBlocks.getRows(); block++) {
+                const short* sampleBlock = sampleBlocks.getRow(block);
+                double norm = norms[block];
+
+                uint64_t minNoise = squaredDistance(sampleBlock, codebook.getRow(byNorm[previous].second), nValues);
+                size_t best = previous;
+
+                size_t right = std::lower_bound(byNorm.begin(), byNorm.end(), std::make_pair(norm, (size_t) 0)) - byNorm.begin();
+                size_t left = right;
+
+                while (left > 0 || right < k) {
+                    double leftGap = left > 0 ? norm - byNorm[left - 1].first : std::numeric_limits<double>::infinity();
+                    double rightGap = right < k ? byNorm[right].first - norm : std::numeric_limits<double>::infinity();
+                    size_t position = leftGap < rightGap ? --left : right++;
+                    double gap = std::min(leftGap, rightGap);
+
+                    /*
+                     * The blocks further away have larger gaps, so none of them can be closer.
+                     * The margin keeps the pruning exact despite the rounding of the norms.
+                     */
+                    if (gap > 0 && gap * gap > (double) minNoise * (1 + 1e-9) + 1)
+                        break;
+
+                    if (position == previous)
+                        continue;
+
+                    uint64_t noise = squaredDistanceBounded(squaredDistance, sampleBlock, codebook.getRow(byNorm[position].second), nValues, minNoise);
+
+                    if (noise < minNoise) {
+                        minNoise = noise;
+                        best = position;
+                    }
+                }
+
+                previous = best;
+                minDistances[block] = minNoise;
+            }
+        }
+
+    public:
+        /**
+         * @param sampleBlocks are the blocks of the sample, which must outlive the scorer.
+         * @param kernel is the implementation of the squared distance.
+         * @param engine is the search for the closest codebook blocks.
+         */
+        explicit WavScore(MatrixView<const short> sampleBlocks, DistanceKernel kernel = bestDistanceKernel(), ScoreEngine engine = ScoreEngine::Batch)
+            : sampleBlocks(sampleBlocks), energies(sampleBlocks.getRows()), norms(sampleBlocks.getRows()),
+              silence(sampleBlocks.getCols(), 0), squaredDistance(getSquaredDistance(kernel)), kernel(kernel),
+              engine(engine) {
+            for (size_t block = 0; block < sampleBlocks.getRows(); block++) {
+                energies[block] = squaredDistance(sampleBlocks.getRow(block), silence.data(), sampleBlocks.getCols());
+                norms[block] = std::sqrt((double) energies[block]);
+            }
+
+            if (this->engine == ScoreEngine::Batch)
+                batch.reset(new BatchDistance(sampleBlocks, energies, kernel));
+        }
+
+        /**
+         * Function to compute the signal-to-noise ratio, in dB, of a block.
+         * A silent block has no signal, so it never matches (-infinity).
+         * @param signalEnergy of the block.
+         * @param noiseEnergy between the block and its codebook block.
+         * @return the signal-to-noise ratio.
+         */
+        static double signalNoiseRatio(uint64_t signalEnergy, uint64_t noiseEnergy) {
+            if (signalEnergy == 0)
+                return -std::numeric_limits<double>::infinity();
+
+            return 10 * log10((double) signalEnergy / noiseEnergy);
+        }
+
+        /**
+         * Function to score the sample against a codebook: the sum, over the sample blocks, of the
+         * signal-to-noise ratio of the closest codebook block.
+         * @param codebook are the blocks of the codebook, with as many values as the sample blocks.
+         * @param codebookNorms are the norms of the codebook blocks.
+         * @return the score of the codebook, higher is more similar.
+         */
+        double score(MatrixView<const short> codebook, const CodebookNorms& codebookNorms) const {
+            if (codebook.getRows() == 0)
+                return sampleBlocks.getRows() > 0 ? -std::numeric_limits<double>::infinity() : 0.0;
+
+            std::vector<uint64_t> minDistances;
+
+            nearest(codebook, codebookNorms, minDistances);
+            return score(minDistances);
+        }
+
+        /**
+         * Function to score the sample from the distances of its blocks to the closest codebook blocks,
+         * found by another search (such as a projection of the catalog).
+         * @param minDistances has one squared distance per sample block.
+         * @return the score of the codebook, higher is more similar.
+         */
+        double score(const std::vector<uint64_t>& minDistances) const {
+            double result = 0.0;
+
+            for (size_t block = 0; block < sampleBlocks.getRows(); block++)
+                result += signalNoiseRatio(energies[block], minDistances[block]);
+
+            return result;
+        }
+
+        /**
+         * Function to find, with the engine of the scorer, the distance of every sample block to the
+         * closest block of a codebook.
+         * @param codebook are the blocks of the codebook, at least one, with as many values as the sample blocks.
+         * @param codebookNorms are the norms of the codebook blocks.
+         * @param minDistances receives one squared distance per sample block.
+         */
+        void nearest(MatrixView<const short> codebook, const CodebookNorms& codebookNorms, std::vector<uint64_t>& minDistances) const {
+            if (engine == ScoreEngine::Batch)
+                batch->nearest(codebook, codebookNorms.getEnergies(), minDistances);
+            else
+                nearestPruned(codebook, codebookNorms, minDistances);
+        }
+
+        /**
+         * Function to check that both engines find the same closest distances for a codebook.
+         * @param codebook are the blocks of the codebook, with as many values as the sample blocks.
+         * @param codebookNorms are the norms of the codebook blocks.
+         * @return the number of sample blocks where the engines disagree.
+         */
+        size_t checkEngines(MatrixView<const short> codebook, const CodebookNorms& codebookNorms) const {
+            if (codebook.getRows() == 0)
+                return 0;
+
+            std::vector<uint64_t> pruned, batched;
+
+            nearestPruned(codebook, codebookNorms, pruned);
+            if (batch)
+                batch->nearest(codebook, codebookNorms.getEnergies(), batched);
+            else
+                BatchDistance(sampleBlocks, energies, kernel).nearest(codebook, codebookNorms.getEnergies(), batched);
+
+            size_t nMismatches = 0;
+            for (size_t block = 0; block < sampleBlocks.getRows(); block++)
+                if (pruned[block] != batched[block])
+                    nMismatches++;
+
+            return nMismatches;
+        }
+};
+
+#endif